@@ -70,6 +70,24 @@ static void length_counter_clock(length_counter_t* l)
 }
 
 
+//
+// Divider shared by channel timers: counts value down to 0, then reloads period on next clock.
+// Run for number of clocks at once, returns number of reloads
+//
+static uint32_t timer_run(uint16_t* value, uint16_t period, uint32_t clocks)
+{
+    uint32_t n;
+    if (clocks <= *value)
+    {
+        *value -= (uint16_t)clocks;
+        return 0;
+    }
+    n = clocks - *value - 1;    // clocks left after first reload
+    *value = period - (uint16_t)(n % ((uint32_t)period + 1));
+    return 1 + n / ((uint32_t)period + 1);
+}
+
+
 //
 // Pulse channel
 // http://wiki.nesdev.org/w/index.php/APU_Pulse
@@ -120,6 +138,13 @@ static void pulse_timer_clock(pulse_t* p)
 }
 
 
+static void pulse_timer_run(pulse_t* p, uint32_t clocks)
+{
+    uint32_t n = timer_run(&(p->timer_value), p->timer_period, clocks);
+    p->duty_index = (uint8_t)((p->duty_index + 8 - n % 8) % 8);     // count down
+}
+
+
 // http://wiki.nesdev.org/w/index.php/APU_Sweep
 static void pulse_sweep_clock(pulse_t* p, bool p1)
 {
@@ -222,6 +247,18 @@ static void triangle_timer_clock(triangle_t* t)
 }
 
 
+static void triangle_timer_run(triangle_t* t, uint32_t clocks)
+{
+    // Silencing conditions only change by frame counter or register write
+    if (!t->enabled) return;
+    if (t->timer_period_bad) return;
+    if (t->length_counter.value == 0) return;
+    if (t->linear_counter_value == 0) return;
+    uint32_t n = timer_run(&(t->timer_value), t->timer_period, clocks);
+    t->waveform_index = (uint8_t)((t->waveform_index + n) % 32);
+}
+
+
 static void triangle_linear_counter_clock(triangle_t* t)
 {
     if (t->linear_counter_reload)
@@ -271,6 +308,18 @@ static void noise_reset(noise_t* n)
 }
 
 
+static void noise_shift(noise_t* n)
+{
+    // When the timer clocks the shift register, the following occur in order:
+    // 1) Feedback is calculated as the exclusive-OR of bit 0 and one other bit: bit 6 if Mode flag is set, otherwise bit 1.
+    uint16_t feedback = (n->shift_reg & 0x0001) ^ (n->mode ? ((n->shift_reg >> 6) & 0x0001) : ((n->shift_reg >> 1) & 0x0001));
+    // 2) The shift register is shifted right by one bit.
+    n->shift_reg = n->shift_reg >> 1;
+    // 3) Bit 14, the leftmost bit, is set to the feedback calculated earlier.
+    n->shift_reg |= (feedback << 14);
+}
+
+
 static void noise_timer_clock(noise_t* n)
 {
     if (n->timer_value > 0)
@@ -280,17 +329,19 @@ static void noise_timer_clock(noise_t* n)
     else 
     {
         n->timer_value = n->timer_period;
-        // When the timer clocks the shift register, the following occur in order:
-        // 1) Feedback is calculated as the exclusive-OR of bit 0 and one other bit: bit 6 if Mode flag is set, otherwise bit 1.
-        uint16_t feedback = (n->shift_reg & 0x0001) ^ (n->mode ? ((n->shift_reg >> 6) & 0x0001) : ((n->shift_reg >> 1) & 0x0001));
-        // 2) The shift register is shifted right by one bit.
-        n->shift_reg = n->shift_reg >> 1;
-        // 3) Bit 14, the leftmost bit, is set to the feedback calculated earlier.
-        n->shift_reg |= (feedback << 14);
+        noise_shift(n);
     }
 }
 
 
+static void noise_timer_run(noise_t* n, uint32_t clocks)
+{
+    uint32_t r = timer_run(&(n->timer_value), n->timer_period, clocks);
+    while (r--)
+        noise_shift(n);
+}
+
+
 static uint8_t noise_output(noise_t* n)
 {
     if (!n->enabled) return 0;
@@ -380,13 +431,9 @@ static void dmc_reset(dmc_t* d)
 }
 
 
-static void dmc_timer_clock(dmc_t* d)
+// Timer output clock
+static void dmc_timer_expire(dmc_t* d)
 {
-    if (d->timer_value > 0)
-    {
-        --d->timer_value;
-        return;
-    }
     d->timer_value = d->timer_period;
     // When the timer outputs a clock, the following actions occur in order: 
     if (!d->output_silence)
@@ -431,6 +478,29 @@ static void dmc_timer_clock(dmc_t* d)
 }
 
 
+static void dmc_timer_clock(dmc_t* d)
+{
+    if (d->timer_value > 0)
+    {
+        --d->timer_value;
+        return;
+    }
+    dmc_timer_expire(d);
+}
+
+
+static void dmc_timer_run(dmc_t* d, uint32_t clocks)
+{
+    // Output clock changes state every time, step through each of them
+    while (clocks > d->timer_value)
+    {
+        clocks -= (uint32_t)d->timer_value + 1;
+        dmc_timer_expire(d);
+    }
+    d->timer_value -= (uint16_t)clocks;
+}
+
+
 static uint8_t dmc_output(dmc_t* d)
 {
     return d->output_value;
@@ -509,18 +579,34 @@ static void apu_clock_timers(nesapu_t* a)
     // Pulse/Noise/DMC channels clock every second CPU cycles
     if (a->cycles % 2)
     {
-        pulse_timer_clock(&(a->pulse1));
-        pulse_timer_clock(&(a->pulse2));
+        pulse_timer_clock(&(a->pulse[0]));
+        pulse_timer_clock(&(a->pulse[1]));
         noise_timer_clock(&(a->noise));
         dmc_timer_clock(&(a->dmc));
     }
 }
 
 
+// Same as calling apu_clock_timers() for number of cycles, starting from a->cycles (a->cycles is not changed)
+static void apu_run_timers(nesapu_t* a, uint32_t cycles)
+{
+    // Odd cycles in a->cycles ... a->cycles + cycles - 1
+    uint32_t half = (uint32_t)((((uint64_t)a->cycles + cycles) >> 1) - (a->cycles >> 1));
+    triangle_timer_run(&(a->triangle), cycles);
+    if (half)
+    {
+        pulse_timer_run(&(a->pulse[0]), half);
+        pulse_timer_run(&(a->pulse[1]), half);
+        noise_timer_run(&(a->noise), half);
+        dmc_timer_run(&(a->dmc), half);
+    }
+}
+
+
 static void frame_counter_clock_length_counters(nesapu_t* a)
 {
-    length_counter_clock(&(a->pulse1.length_counter));
-    length_counter_clock(&(a->pulse2.length_counter));
+    length_counter_clock(&(a->pulse[0].length_counter));
+    length_counter_clock(&(a->pulse[1].length_counter));
     length_counter_clock(&(a->triangle.length_counter));
     length_counter_clock(&(a->noise.length_counter));
 }
@@ -528,15 +614,15 @@ static void frame_counter_clock_length_counters(nesapu_t* a)
 
 static void frame_counter_clock_sweeps(nesapu_t* a)
 {
-    pulse_sweep_clock(&(a->pulse1), true);
-    pulse_sweep_clock(&(a->pulse2), false);
+    pulse_sweep_clock(&(a->pulse[0]), true);
+    pulse_sweep_clock(&(a->pulse[1]), false);
 }
 
 
 static void frame_counter_clock_envelopes(nesapu_t* a)
 {
-    envelope_clock(&(a->pulse1.envelope));
-    envelope_clock(&(a->pulse2.envelope));
+    envelope_clock(&(a->pulse[0].envelope));
+    envelope_clock(&(a->pulse[1].envelope));
     envelope_clock(&(a->noise.envelope));
 }
 
@@ -551,93 +637,105 @@ static void frame_counter_clock_linear_counter(nesapu_t* a)
 // APU
 // https://wiki.nesdev.org/w/index.php/APU
 //
+
+// Register decode, what a register at $4000 + index does and the channel it belongs to
+#define APU_REG_NONE            0   // not an APU register
+#define APU_REG_UNUSED          1   // unused, only stored
+#define APU_REG_PULSE_CTRL      2
+#define APU_REG_PULSE_SWEEP     3
+#define APU_REG_PULSE_LO        4
+#define APU_REG_PULSE_HI        5
+#define APU_REG_TRIANGLE_CTRL   6
+#define APU_REG_TRIANGLE_LO     7
+#define APU_REG_TRIANGLE_HI     8
+#define APU_REG_NOISE_CTRL      9
+#define APU_REG_NOISE_PERIOD    10
+#define APU_REG_NOISE_LENGTH    11
+#define APU_REG_DMC_CTRL        12
+#define APU_REG_DMC_LOAD        13
+#define APU_REG_DMC_ADDR        14
+#define APU_REG_DMC_LENGTH      15
+#define APU_REG_STATUS          16
+#define APU_REG_FRAME_COUNTER   17
+
+typedef struct apu_reg_decode_s
+{
+    uint8_t kind;       // APU_REG_xxx
+    uint8_t channel;    // pulse channel index
+} apu_reg_decode_t;
+
+static const apu_reg_decode_t apu_reg_decode[NESAPU_REG_COUNT] =
+{
+    { APU_REG_PULSE_CTRL, 0 },      { APU_REG_PULSE_SWEEP, 0 },     { APU_REG_PULSE_LO, 0 },        { APU_REG_PULSE_HI, 0 },        // $4000
+    { APU_REG_PULSE_CTRL, 1 },      { APU_REG_PULSE_SWEEP, 1 },     { APU_REG_PULSE_LO, 1 },        { APU_REG_PULSE_HI, 1 },        // $4004
+    { APU_REG_TRIANGLE_CTRL, 0 },   { APU_REG_UNUSED, 0 },          { APU_REG_TRIANGLE_LO, 0 },     { APU_REG_TRIANGLE_HI, 0 },     // $4008
+    { APU_REG_NOISE_CTRL, 0 },      { APU_REG_UNUSED, 0 },          { APU_REG_NOISE_PERIOD, 0 },    { APU_REG_NOISE_LENGTH, 0 },    // $400C
+    { APU_REG_DMC_CTRL, 0 },        { APU_REG_DMC_LOAD, 0 },        { APU_REG_DMC_ADDR, 0 },        { APU_REG_DMC_LENGTH, 0 },      // $4010
+    { APU_REG_NONE, 0 },            { APU_REG_STATUS, 0 },          { APU_REG_NONE, 0 },            { APU_REG_FRAME_COUNTER, 0 }    // $4014
+};
+
+
+// --LC VVVV of pulse and noise channels
+static void envelope_write_ctrl(envelope_t* e, length_counter_t* l, uint8_t val)
+{
+    l->halt = (val & 0x20) ? true : false;      // Length counter halt (L)
+    e->loop = (val & 0x20) ? true : false;      // or Envelope loop (L)
+    e->enabled = (val & 0x10) ? false : true;   // Constant volume or Envelope enabled (C)
+    e->period = val & 0x0f;                     // Volume or Period of envelope (VVVV)
+}
+
+
 static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
 {
     nesapu_t* a = (nesapu_t*) cookie;
-    if (0 == a)
+    const apu_reg_decode_t* d;
+    pulse_t* p;
+    if ((0 == a) || (addr < NESAPU_REG_BASE) || (addr >= NESAPU_REG_BASE + NESAPU_REG_COUNT))
+        return false;
+    d = &(apu_reg_decode[addr - NESAPU_REG_BASE]);
+    if (APU_REG_NONE == d->kind)
         return false;
-    switch (addr)
+    a->reg[addr - NESAPU_REG_BASE] = val;
+    p = &(a->pulse[d->channel]);
+    switch (d->kind)
     {
-    // Pulse1 regs
-    case 0x4000: // DDLC VVVV
-        a->reg4000 = val;
-        a->pulse1.duty = (val & 0xc0) >> 6;         // Duty (DD), index into tbl_pulse_waveform
-        a->pulse1.length_counter.halt = (val & 0x20) ? true : false;    // Length counter halt (L)
-        a->pulse1.envelope.loop = (val & 0x20) ? true : false;          // or Envelope loop (L)
-        a->pulse1.envelope.enabled = (val & 0x10) ? false : true;       // Constant volume or Envelope enabled (C)
-        a->pulse1.envelope.period = val & 0x0f;     // Volume or Period of envelope (VVVV)
+    // Pulse regs
+    case APU_REG_PULSE_CTRL: // DDLC VVVV
+        p->duty = (val & 0xc0) >> 6;    // Duty (DD), index into tbl_pulse_waveform
+        envelope_write_ctrl(&(p->envelope), &(p->length_counter), val);
+        if (d->channel)
+            p->envelope.start = true;   // $4004 restarts envelope but $4000 does not, kept so rips stay the same
         break;
-    case 0x4001: // EPPP NSSS
-        a->reg4001 = val;
-        a->pulse1.sweep.enabled = (val & 0x80) ? true : false; // Sweep enabled (E)
-        a->pulse1.sweep.period = (val & 0x70) >> 4;            // Sweep period (PPP)
-        a->pulse1.sweep.negate = (val & 0x08) ? true : false;  // Negate (N)
-        a->pulse1.sweep.shift = val & 0x07;                    // Shift (SSS)
-        a->pulse1.sweep.reload = true;
+    case APU_REG_PULSE_SWEEP: // EPPP NSSS
+        p->sweep.enabled = (val & 0x80) ? true : false; // Sweep enabled (E)
+        p->sweep.period = (val & 0x70) >> 4;            // Sweep period (PPP)
+        p->sweep.negate = (val & 0x08) ? true : false;  // Negate (N)
+        p->sweep.shift = val & 0x07;                    // Shift (SSS)
+        p->sweep.reload = true;
         break;
-    case 0x4002: // TTTT TTTT
-        a->reg4002 = val;
-        a->pulse1.timer_period &= 0xff00;
-        a->pulse1.timer_period |= val;     // Timer period low (TTTT TTTT)
+    case APU_REG_PULSE_LO: // TTTT TTTT
+        p->timer_period &= 0xff00;
+        p->timer_period |= val;     // Timer period low (TTTT TTTT)
         break;
-    case 0x4003: // LLLL LTTT
-        a->reg4003 = val;
-        a->pulse1.timer_period &= 0x00ff;
-        a->pulse1.timer_period |= ((uint16_t)(val & 0x07) << 8);   // Timer period high 3 bits (TTT)
-        a->pulse1.length_counter.value = length_counter_table[(val & 0xf8) >> 3];
-        a->pulse1.envelope.start = true;
-        a->pulse1.duty_index = 0;
-        break;
-
-    // Pulse2 regs
-    case 0x4004: // DDLC VVVV
-        a->reg4004 = val;
-        a->pulse2.duty = (val & 0xc0) >> 6;     // Duty (DD), index into tbl_pulse_waveform
-        a->pulse2.length_counter.halt = (val & 0x20) ? true : false;    // Length counter halt (L)
-        a->pulse2.envelope.loop = (val & 0x20) ? true : false;          // or Envelope loop (L)
-        a->pulse2.envelope.enabled = (val & 0x10) ? false : true;       // Constant volume or Envelope enabled (C)
-        a->pulse2.envelope.period = val & 0x0f; // Volume or Period of envelope (VVVV)
-        a->pulse2.envelope.start = true;
-        break;
-    case 0x4005: // EPPP NSSS
-        a->reg4005 = val;
-        a->pulse2.sweep.enabled = (val & 0x80) ? true : false; // Sweep enabled (E)
-        a->pulse2.sweep.period = (val & 0x70) >> 4;            // Sweep period (PPP)
-        a->pulse2.sweep.negate = (val & 0x08) ? true : false;  // Negate (N)
-        a->pulse2.sweep.shift = val & 0x07;                    // Shift (SSS)
-        a->pulse2.sweep.reload = true;
-        break;
-    case 0x4006: // TTTT TTTT
-        a->reg4006 = val;
-        a->pulse2.timer_period &= 0xff00;
-        a->pulse2.timer_period |= val;     // Timer period low (TTTT TTTT)
-        break;
-    case 0x4007: // LLLL LTTT
-        a->reg4007 = val;
-        a->pulse2.timer_period &= 0x00ff;
-        a->pulse2.timer_period |= ((uint16_t)(val & 0x07) << 8);   // Timer period high (TTT)
-        a->pulse2.length_counter.value = length_counter_table[(val & 0xf8) >> 3];   // Length counter load
-        a->pulse2.envelope.start = true;
-        a->pulse2.duty_index = 0;
+    case APU_REG_PULSE_HI: // LLLL LTTT
+        p->timer_period &= 0x00ff;
+        p->timer_period |= ((uint16_t)(val & 0x07) << 8);   // Timer period high 3 bits (TTT)
+        p->length_counter.value = length_counter_table[(val & 0xf8) >> 3];  // Length counter load
+        p->envelope.start = true;
+        p->duty_index = 0;
         break;
     // Triangle
-    case 0x4008: // CRRR RRR
-        a->reg4008 = val;
+    case APU_REG_TRIANGLE_CTRL: // CRRR RRR
         a->triangle.length_counter.halt = (val & 0x80) ? true : false;  // Control flag (Length counter halt flag) (C)
         a->triangle.linear_counter_ctrl = (val & 0x80) ? true : false;
         a->triangle.linear_counter_period = (val & 0x7F);   // Counter reload value
         break;
-    case 0x4009:
-        a->reg4009 = val;
-        break;
-    case 0x400a: // LLLL LLLL
-        a->reg400a = val;
+    case APU_REG_TRIANGLE_LO: // LLLL LLLL
         a->triangle.timer_period &= 0xff00;
         a->triangle.timer_period |= val;    // Timer period low (LLLL LLLL)
         a->triangle.timer_period_bad = ((a->triangle.timer_period >= 0x7fe) || (a->triangle.timer_period <= 1)) ? true : false;
         break;
-    case 0x400b: // llll lHHH
-        a->reg400b = val;
+    case APU_REG_TRIANGLE_HI: // llll lHHH
         a->triangle.timer_period &= 0x00ff;
         a->triangle.timer_period |= ((uint16_t)(val & 0x07) << 8);   // Timer period high (HHH)
         a->triangle.timer_period_bad = ((a->triangle.timer_period >= 0x7fe) || (a->triangle.timer_period <= 1)) ? true : false;
@@ -646,19 +744,11 @@ static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
         a->triangle.timer_value = a->triangle.timer_period;   
         break;
     // Noise
-    case 0x400c: // --lc vvvv
-        a->reg400c = val;
-        a->noise.length_counter.halt = (val & 0x20) ? true : false; // Length counter halt (l) 
-        a->noise.envelope.loop = (val & 0x20) ? true : false;       // Envelope loop (l)
-        a->noise.envelope.enabled = (val & 0x10) ? false : true;    // Constant volume or envelope (c)
-        a->noise.envelope.period = (val & 0x0f);    // Volume or envelope divider period (vvvv)
+    case APU_REG_NOISE_CTRL: // --lc vvvv
+        envelope_write_ctrl(&(a->noise.envelope), &(a->noise.length_counter), val);
         a->noise.envelope.start = true;
         break;
-    case 0x400d:
-        a->reg400d = val;
-        break;
-    case 0x400e: // M--- PPPP
-        a->reg400e = val;
+    case APU_REG_NOISE_PERIOD: // M--- PPPP
         a->noise.mode = (val & 0x80) ? true : false;    // Mode flag (M)
         if (!a->format)  // NTSC lookup table for timer period (PPPP)
         {
@@ -669,14 +759,12 @@ static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
             a->noise.timer_period = noise_timer_period_pal[val & 0x0f];
         }
         break;
-    case 0x400f: // llll l---
-        a->reg400f = val;
+    case APU_REG_NOISE_LENGTH: // llll l---
         a->noise.length_counter.value = length_counter_table[(val & 0xf8) >> 3];    // Length counter value (lllll)
         a->noise.envelope.start = true;
         break;
     // DMC
-    case 0x4010: // IL-- RRRR
-        a->reg4010 = val;
+    case APU_REG_DMC_CTRL: // IL-- RRRR
         a->dmc.irq_enabled = (val & 0x80) ? true : false;       // IRQ enable flag (I)
         a->dmc.loop = (val & 0x40) ? true : false;              // Loop flag (L)
         if (!a->dmc.irq_enabled) a->dmc.irq_requested = false;  // No IRQ if channel disabled
@@ -689,27 +777,24 @@ static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
             a->dmc.timer_period = dmc_timer_period_pal[val & 0x0f];
         }
         break;
-    case 0x4011: // -DDD DDDD
-        a->reg4011 = val;
+    case APU_REG_DMC_LOAD: // -DDD DDDD
         a->dmc.output_value = (val & 0x7f); // Output value (DDD DDDD)
         break;
-    case 0x4012: // AAAA AAAA
-        a->reg4012 = val;
+    case APU_REG_DMC_ADDR: // AAAA AAAA
         a->dmc.sample_addr = 0xc000 + ((uint16_t)val << 6); // Sample address = %11AAAAAA.AA000000 = $C000 + (A * 64)
         break;
-    case 0x4013: // LLLL LLLL
-        a->reg4013 = val;
+    case APU_REG_DMC_LENGTH: // LLLL LLLL
         a->dmc.sample_len = ((uint16_t)val << 4) + 1;   // Sample length = %LLLL.LLLL0001 = (L * 16) + 1 bytes
         break;
     // Status
-    case 0x4015: // ---D NT21
-        a->pulse1.enabled = (val & 0x01) ? true : false;    // 1
-        a->pulse2.enabled = (val & 0x02) ? true : false;    // 2
+    case APU_REG_STATUS: // ---D NT21
+        a->pulse[0].enabled = (val & 0x01) ? true : false;  // 1
+        a->pulse[1].enabled = (val & 0x02) ? true : false;  // 2
         a->triangle.enabled = (val & 0x04) ? true : false;  // T
         a->noise.enabled = (val & 0x08) ? true : false;     // N
         a->dmc.enabled = (val & 0x10) ? true : false;       // D
-        if (!(a->pulse1.enabled)) a->pulse1.length_counter.value = 0;
-        if (!(a->pulse2.enabled)) a->pulse2.length_counter.value = 0;
+        if (!(a->pulse[0].enabled)) a->pulse[0].length_counter.value = 0;
+        if (!(a->pulse[1].enabled)) a->pulse[1].length_counter.value = 0;
         if (!(a->triangle.enabled)) a->triangle.length_counter.value = 0;
         if (!(a->noise.enabled)) a->noise.length_counter.value = 0;
         // Writing to 0x4015 clears DMC interrupt flag
@@ -737,8 +822,7 @@ static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
         }
         break;
     // Frame counter
-    case 0x4017:
-        a->reg4017 = val;
+    case APU_REG_FRAME_COUNTER:
         a->frame_counter.mode = (val & 0x80) ? true : false;
         a->frame_counter.inhibit_irq = (val & 0x40) ? true : false;
         if (a->frame_counter.mode) 
@@ -749,8 +833,8 @@ static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
             frame_counter_clock_sweeps(a);
         }
         break;
-    default:
-        return false;
+    default:    // APU_REG_UNUSED
+        break;
     }
     return true;
 }
@@ -759,75 +843,17 @@ static bool apu_write_reg(uint16_t addr, uint8_t val, void* cookie)
 static bool apu_read_reg(uint16_t addr, uint8_t* rval, void* cookie, uint8_t owner)
 {
     nesapu_t* a = (nesapu_t*)cookie;
-    if (0 == a)
+    if ((0 == a) || (addr < NESAPU_REG_BASE) || (addr >= NESAPU_REG_BASE + NESAPU_REG_COUNT))
         return false;
-    switch (addr)
+    switch (apu_reg_decode[addr - NESAPU_REG_BASE].kind)
     {
-    case 0x4000:
-        *rval = a->reg4000;
-        break;
-    case 0x4001:
-        *rval = a->reg4001;
-        break;
-    case 0x4002:
-        *rval = a->reg4002;
-        break;
-    case 0x4003:
-        *rval = a->reg4003;
-        break;
-    case 0x4004:
-        *rval = a->reg4004;
-        break;
-    case 0x4005:
-        *rval = a->reg4005;
-        break;
-    case 0x4006:
-        *rval = a->reg4006;
-        break;
-    case 0x4007:
-        *rval = a->reg4007;
-        break;
-    case 0x4008:
-        *rval = a->reg4008;
-        break;
-    case 0x4009:
-        *rval = a->reg4009;
-        break;
-    case 0x400a:
-        *rval = a->reg400a;
-        break;
-    case 0x400b:
-        *rval = a->reg400b;
-        break;
-    case 0x400c:
-        *rval = a->reg400c;
-        break;
-    case 0x400d:
-        *rval = a->reg400d;
-        break;
-    case 0x400e:
-        *rval = a->reg400e;
-        break;
-    case 0x400f:
-        *rval = a->reg400f;
-        break;
-    case 0x4010:
-        *rval = a->reg4010;
-        break;
-    case 0x4011:
-        *rval = a->reg4011;
-        break;
-    case 0x4012:
-        *rval = a->reg4012;
-        break;
-    case 0x4013:
-        *rval = a->reg4013;
-        break;
-    case 0x4015:    // IF-D NT21
+    case APU_REG_NONE:
+        return false;
+    case APU_REG_STATUS:    // IF-D NT21
         // Read 0x4015 is from actual hardware
         *rval = 0x00;
-        *rval |= (a->pulse1.length_counter.value > 0) ? 0x01 : 0x00;    
-        *rval |= (a->pulse2.length_counter.value > 0) ? 0x02 : 0x00;
+        *rval |= (a->pulse[0].length_counter.value > 0) ? 0x01 : 0x00;
+        *rval |= (a->pulse[1].length_counter.value > 0) ? 0x02 : 0x00;
         *rval |= (a->triangle.length_counter.value > 0) ? 0x04 : 0x00;
         *rval |= (a->noise.length_counter.value > 0) ? 0x08 : 0x00;
         *rval |= (a->dmc.read_remaining > 0) ? 0x10 : 0x00;
@@ -836,11 +862,10 @@ static bool apu_read_reg(uint16_t addr, uint8_t* rval, void* cookie, uint8_t own
         // Read 0x4015 clears frame interrupt flag
         a->frame_counter.irq_requested = false;
         break;
-    case 0x4017:
-        *rval = a->reg4017;
-        break;
     default:
-        return false;
+        // Other registers read back the value written
+        *rval = a->reg[addr - NESAPU_REG_BASE];
+        break;
     }
     return true;
 }
@@ -891,19 +916,27 @@ bool nesapu_attach_bus(nesapu_t* a, nesbus_t* b)
 }
 
 
+// Copy emulation state (registers, channels, frame counter) from src. Host side fields of a
+// (DMC bus connection) are kept, any pointer added to nesapu_t must be kept here too.
+void nesapu_copy_state(nesapu_t* a, const nesapu_t* src)
+{
+    nesbus_t* bus;
+    if ((0 == a) || (0 == src))
+        return;
+    bus = a->dmc.bus;
+    *a = *src;
+    a->dmc.bus = bus;
+}
+
+
 void nesapu_reset(nesapu_t* a)
 {
-    a->reg4000 = a->reg4001 = a->reg4002 = a->reg4003 = 0x00;
-    a->reg4004 = a->reg4005 = a->reg4006 = a->reg4007 = 0x00;
-    a->reg4008 = a->reg4009 = a->reg400a = a->reg400b = 0x00;
-    a->reg400c = a->reg400d = a->reg400e = a->reg400f = 0x00;
-    a->reg4010 = a->reg4011 = a->reg4012 = a->reg4013 = 0x00;
-    a->reg4017 = 0x00;
+    memset(a->reg, 0, sizeof(a->reg));
     a->cycles = 0;
     a->next_frame_cycle = 0;
     a->accumulated_frame_cycle_error = 32767;   // Euquivalent of 0.5 cycle initial error
-    pulse_reset(&(a->pulse1));
-    pulse_reset(&(a->pulse2));
+    pulse_reset(&(a->pulse[0]));
+    pulse_reset(&(a->pulse[1]));
     triangle_reset(&(a->triangle));
     noise_reset(&(a->noise));
     dmc_reset(&(a->dmc));
@@ -912,99 +945,131 @@ void nesapu_reset(nesapu_t* a)
 }
 
 
+// Frame counter step, called at a->next_frame_cycle
+static void frame_counter_step(nesapu_t* a)
+{
+    // mode 0:    mode 1:       function
+    // false      true
+    // ---------  -----------  -----------------------------
+    //  - - - f    - - - - -    IRQ (if bit 6 is clear)
+    //  - l - l    - l - - l    Length counter and sweep
+    //  e e e e    e e e - e    Envelope and linear counter
+    if (a->frame_counter.mode)
+    {
+        // mode 1
+        switch (a->seq_step % 5)
+        {
+        case 0:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            break;
+        case 1:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            frame_counter_clock_length_counters(a);
+            frame_counter_clock_sweeps(a);
+            break;
+        case 2:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            break;
+        case 3:
+            // Nothing
+            break;
+        case 4:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            frame_counter_clock_length_counters(a);
+            frame_counter_clock_sweeps(a);
+            break;
+        }
+    }
+    else
+    {
+        // mode 0
+        switch (a->seq_step % 4)
+        {
+        case 0:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            break;
+        case 1:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            frame_counter_clock_length_counters(a);
+            frame_counter_clock_sweeps(a);
+            break;
+        case 2:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            break;
+        case 3:
+            frame_counter_clock_envelopes(a);
+            frame_counter_clock_linear_counter(a);
+            frame_counter_clock_length_counters(a);
+            frame_counter_clock_sweeps(a);
+            if (a->frame_counter.inhibit_irq == false)
+            {
+                a->frame_counter.irq_requested = true;
+            }
+            break;
+        }
+    }
+    ++(a->seq_step);
+    // Schedule next frame clock
+    a->next_frame_cycle = a->cycles + a->cycles_per_frame;
+    a->accumulated_frame_cycle_error += a->frame_cycle_error;
+    if (a->accumulated_frame_cycle_error & 0xFFFF0000) // if error >= 65536
+    {
+        ++(a->next_frame_cycle);
+        a->accumulated_frame_cycle_error &= 0xFFFF;
+    }
+}
+
+
 void nesapu_clock(nesapu_t* a)
 {
     apu_clock_timers(a);
-
     // Frame Counter
     if (a->cycles == a->next_frame_cycle)
+        frame_counter_step(a);
+    ++(a->cycles);
+}
+
+
+// Same as calling nesapu_clock() for number of cycles. Channel timers are advanced in bulk between
+// frame counter steps. DMC stall/IRQ raised in the middle of the run stays pending, caller should
+// use nesapu_quiet_cycles() to end the run at such events.
+void nesapu_run(nesapu_t* a, uint32_t cycles)
+{
+    uint32_t n;
+    while (cycles)
     {
-        // mode 0:    mode 1:       function
-        // false      true
-        // ---------  -----------  -----------------------------
-        //  - - - f    - - - - -    IRQ (if bit 6 is clear)
-        //  - l - l    - l - - l    Length counter and sweep
-        //  e e e e    e e e - e    Envelope and linear counter
-        if (a->frame_counter.mode)
+        // run up to and including next frame counter step
+        n = a->next_frame_cycle - a->cycles;
+        if (n < cycles)
         {
-            // mode 1
-            switch (a->seq_step % 5)
-            {
-            case 0:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                break;
-            case 1:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                frame_counter_clock_length_counters(a);
-                frame_counter_clock_sweeps(a);
-                break;
-            case 2:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                break;
-            case 3:
-                // Nothing
-                break;
-            case 4:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                frame_counter_clock_length_counters(a);
-                frame_counter_clock_sweeps(a);
-                break;
-            }
+            apu_run_timers(a, n + 1);
+            a->cycles += n;
+            frame_counter_step(a);
+            ++(a->cycles);
+            cycles -= n + 1;
         }
         else
         {
-            // mode 0
-            switch (a->seq_step % 4)
-            {
-            case 0:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                break;
-            case 1:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                frame_counter_clock_length_counters(a);
-                frame_counter_clock_sweeps(a);
-                break;
-            case 2:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                break;
-            case 3:
-                frame_counter_clock_envelopes(a);
-                frame_counter_clock_linear_counter(a);
-                frame_counter_clock_length_counters(a);
-                frame_counter_clock_sweeps(a);
-                if (a->frame_counter.inhibit_irq == false)
-                {
-                    a->frame_counter.irq_requested = true;
-                }
-                break;
-            }
-        }
-        ++(a->seq_step);
-        // Schedule next frame clock
-        a->next_frame_cycle = a->cycles + a->cycles_per_frame;
-        a->accumulated_frame_cycle_error += a->frame_cycle_error;
-        if (a->accumulated_frame_cycle_error & 0xFFFF0000) // if error >= 65536
-        {
-            ++(a->next_frame_cycle);
-            a->accumulated_frame_cycle_error &= 0xFFFF;
+            apu_run_timers(a, cycles);
+            a->cycles += cycles;
+            cycles = 0;
         }
     }
-    ++(a->cycles);
 }
 
 
 nesfloat_t nesapu_sample(nesapu_t* a)
 {
     nesfloat_t sample = mixer_sample(
-        pulse_output(&(a->pulse1)),
-        pulse_output(&(a->pulse2)),
+        pulse_output(&(a->pulse[0])),
+        pulse_output(&(a->pulse[1])),
         triangle_output(&(a->triangle)),
         noise_output(&(a->noise)),
         dmc_output(&(a->dmc)));
@@ -1012,6 +1077,42 @@ nesfloat_t nesapu_sample(nesapu_t* a)
 }
 
 
+// Mixer table indices, (pulse << 8) | tnd. Same indices always give same sample
+uint16_t nesapu_mixer_index(nesapu_t* a)
+{
+    uint16_t pulse = pulse_output(&(a->pulse[0])) + pulse_output(&(a->pulse[1]));
+    uint16_t tnd = 3 * triangle_output(&(a->triangle)) + 2 * noise_output(&(a->noise)) + dmc_output(&(a->dmc));
+    return (pulse << 8) | tnd;
+}
+
+
+// Append current channel outputs to out, returns false if out is full
+bool nesapu_record_outputs(nesapu_t* a, nesapu_outputs_t* out, uint32_t clock)
+{
+    int k = out->count;
+    if (k >= NESAPU_OUTPUT_BLOCK)
+        return false;
+    out->clock[k] = clock;
+    out->pulse1[k] = pulse_output(&(a->pulse[0]));
+    out->pulse2[k] = pulse_output(&(a->pulse[1]));
+    out->triangle[k] = triangle_output(&(a->triangle));
+    out->noise[k] = noise_output(&(a->noise));
+    out->dmc[k] = dmc_output(&(a->dmc));
+    out->count = k + 1;
+    return true;
+}
+
+
+// Mix recorded outputs to out->count samples, same results as nesfloat_to_sample(nesapu_sample())
+void nesapu_mix_outputs(const nesapu_outputs_t* out, int16_t* samples)
+{
+    nesfloat_t mix[NESAPU_OUTPUT_BLOCK];
+    for (int k = 0; k < out->count; ++k)
+        mix[k] = mixer_sample(out->pulse1[k], out->pulse2[k], out->triangle[k], out->noise[k], out->dmc[k]);
+    nesfloat_to_samples(mix, samples, out->count);
+}
+
+
 bool nesapu_irq_requested(nesapu_t* a)
 {
     // Frame counter and DMC can raise IRQ
@@ -1028,3 +1129,37 @@ bool nesapu_dmc_stall_cpu(nesapu_t* a)
     }
     return false;
 }
+
+
+// Number of cycles that can be clocked before the APU stalls the CPU or raises an IRQ by itself.
+// Such event, if any, happens in the last of these cycles. Register accesses are not considered.
+uint32_t nesapu_quiet_cycles(nesapu_t* a)
+{
+    uint32_t quiet = 0xFFFFFFFF, t;
+    dmc_t* d = &(a->dmc);
+    if (d->stall_cpu)
+        return 1;   // not yet handled
+    // DMC fetches memory (and may raise IRQ) when output cycle ends with sample buffer filled.
+    // Once buffer is found empty, no more fetch until 0x4015 write
+    if (!d->read_buffer_empty && (d->read_remaining > 0))
+    {
+        // timer expires after (timer_value + 1) clocks then every (timer_period + 1) clocks.
+        // Output cycle ends at the expiry that counts output_bits_remaining down to 0
+        uint32_t expiries = (d->output_bits_remaining > 0) ? d->output_bits_remaining : 1;
+        uint32_t clocks = (uint32_t)d->timer_value + 1 + (expiries - 1) * ((uint32_t)d->timer_period + 1);
+        // DMC timer clocks at odd cycles
+        t = (a->cycles | 1) + 2 * (clocks - 1) - a->cycles + 1;
+        if (t < quiet)
+            quiet = t;
+    }
+    // Frame IRQ raised at the last step of 4 step sequence.
+    // Frame counter error only delays the steps, it is safe to ignore
+    if (!a->frame_counter.mode && !a->frame_counter.inhibit_irq)
+    {
+        uint32_t steps = (3 - a->seq_step % 4) % 4;
+        t = a->next_frame_cycle + steps * a->cycles_per_frame - a->cycles + 1;
+        if (t < quiet)
+            quiet = t;
+    }
+    return quiet;
+}
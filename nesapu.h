@@ -102,7 +102,7 @@ typedef struct noise_s
 typedef struct dmc_s
 {
     bool enabled;
-    nesbus_t* bus;  // DMC need bus access
+    nesbus_t* bus;  // DMC need bus access, host side, kept by nesapu_copy_state
     bool irq_enabled;
     bool loop;
     uint8_t output_value;
@@ -132,6 +132,10 @@ typedef struct frame_counter_s
 } frame_counter_t;
 
 
+#define NESAPU_REG_BASE     0x4000
+#define NESAPU_REG_COUNT    0x18    // $4000 - $4017
+
+
 typedef struct nesapu_ctx_s
 {
     bool format;        // true: PAL, false: NTSC
@@ -146,15 +150,10 @@ typedef struct nesapu_ctx_s
     uint32_t next_frame_cycle;
     int32_t frame_cycle_error;
     int32_t accumulated_frame_cycle_error;
-    // registers
-    uint8_t reg4000, reg4001, reg4002, reg4003; // Pulse1
-    uint8_t reg4004, reg4005, reg4006, reg4007; // Pulse 2
-    uint8_t reg4008, reg4009, reg400a, reg400b; // Triangle
-    uint8_t reg400c, reg400d, reg400e, reg400f; // Noise
-    uint8_t reg4010, reg4011, reg4012, reg4013; // DMC
-    uint8_t reg4017;    // All 
-    // Pulse channel
-    pulse_t pulse1, pulse2;
+    // registers, last value written to NESAPU_REG_BASE + index
+    uint8_t reg[NESAPU_REG_COUNT];
+    // Pulse channels 1 and 2
+    pulse_t pulse[2];
     // Triangle channel
     triangle_t triangle;
     // Noise channel
@@ -166,14 +165,38 @@ typedef struct nesapu_ctx_s
 } nesapu_t;
 
 
+//
+// Channel outputs recorded at sample points, structure of arrays so that whole blocks
+// go through the mixer at once
+//
+#define NESAPU_OUTPUT_BLOCK 256
+
+typedef struct nesapu_outputs_s
+{
+    int count;
+    uint32_t clock[NESAPU_OUTPUT_BLOCK];    // caller's sample time
+    uint8_t pulse1[NESAPU_OUTPUT_BLOCK];
+    uint8_t pulse2[NESAPU_OUTPUT_BLOCK];
+    uint8_t triangle[NESAPU_OUTPUT_BLOCK];
+    uint8_t noise[NESAPU_OUTPUT_BLOCK];
+    uint8_t dmc[NESAPU_OUTPUT_BLOCK];
+} nesapu_outputs_t;
+
+
 nesapu_t * nesapu_create(bool format, uint32_t clock, uint32_t srate);
 void nesapu_destroy(nesapu_t *ctx);
 bool nesapu_attach_bus(nesapu_t *apu, nesbus_t *bus);
+void nesapu_copy_state(nesapu_t *ctx, const nesapu_t *src);
 void nesapu_reset(nesapu_t *ctx);
 void nesapu_clock(nesapu_t *ctx);
+void nesapu_run(nesapu_t *ctx, uint32_t cycles);
 nesfloat_t nesapu_sample(nesapu_t *ctx);
+uint16_t nesapu_mixer_index(nesapu_t *ctx);
+bool nesapu_record_outputs(nesapu_t *ctx, nesapu_outputs_t *out, uint32_t clock);
+void nesapu_mix_outputs(const nesapu_outputs_t *out, int16_t *samples);
 bool nesapu_irq_requested(nesapu_t *ctx);
 bool nesapu_dmc_stall_cpu(nesapu_t *ctx);
+uint32_t nesapu_quiet_cycles(nesapu_t *ctx);
 
 
 #ifdef __cplusplus
@@ -6,7 +6,11 @@
 
 nesbus_t* nesbus_create(int max_read, int max_write)
 {
-    nesbus_t* c = (nesbus_t *)malloc(sizeof(nesbus_t));
+    int i;
+    nesbus_t* c;
+    if ((max_read > NESBUS_MAX_HANDLERS) || (max_write > NESBUS_MAX_HANDLERS))
+        return 0;
+    c = (nesbus_t *)malloc(sizeof(nesbus_t));
     if (0 == c)
         return 0;
     memset(c, 0, sizeof(nesbus_t));
@@ -22,10 +26,28 @@ nesbus_t* nesbus_create(int max_read, int max_write)
         nesbus_destroy(c);
         return 0;
     }
+    c->read_map = (uint8_t *)malloc(NESBUS_PAGE_COUNT * max_read);
+    if (0 == c->read_map)
+    {
+        nesbus_destroy(c);
+        return 0;
+    }
+    c->write_map = (uint8_t *)malloc(NESBUS_PAGE_COUNT * max_write);
+    if (0 == c->write_map)
+    {
+        nesbus_destroy(c);
+        return 0;
+    }
     memset(c->read_table, 0, sizeof(nesbus_read_handler_t) * max_read);
     memset(c->write_table, 0, sizeof(nesbus_write_handler_t) * max_write);
     c->read_table_max = max_read;
     c->write_table_max = max_write;
+    // Each page can hold every handler
+    for (i = 0; i < NESBUS_PAGE_COUNT; ++i)
+    {
+        c->read_pages[i].index = c->read_map + i * max_read;
+        c->write_pages[i].index = c->write_map + i * max_write;
+    }
     return c;
 }
 
@@ -38,11 +60,51 @@ void nesbus_destroy(nesbus_t* c)
             free(c->read_table);
         if (c->write_table)
             free(c->write_table);
+        if (c->read_map)
+            free(c->read_map);
+        if (c->write_map)
+            free(c->write_map);
         free(c);
     }
 }
 
 
+// Add handler to all pages overlapping lo--hi
+static void map_handler(nesbus_page_t* pages, uint8_t** direct, uint16_t lo, uint16_t hi, uint8_t* mem, int index)
+{
+    int page;
+    uint32_t base;
+    if (lo > hi)
+        return;
+    for (page = lo / NESBUS_PAGE_SIZE; page <= hi / NESBUS_PAGE_SIZE; ++page)
+    {
+        pages[page].index[pages[page].count] = (uint8_t)index;
+        ++(pages[page].count);
+        // Page can be accessed directly if this memory region is the only handler and covers the whole page
+        base = (uint32_t)page * NESBUS_PAGE_SIZE;
+        if ((1 == pages[page].count) && (0 != mem) && (lo <= base) && (hi >= base + NESBUS_PAGE_SIZE - 1))
+            direct[page] = mem + (base - lo);
+        else
+            direct[page] = 0;
+    }
+}
+
+
+// Update direct page pointers of memory region lo--hi after its base pointer changed
+static void remap_direct(uint8_t** direct, uint16_t lo, uint16_t hi, uint8_t* mem)
+{
+    int page;
+    if (lo > hi)
+        return;
+    for (page = lo / NESBUS_PAGE_SIZE; page <= hi / NESBUS_PAGE_SIZE; ++page)
+    {
+        // non-zero only if the region is the only handler on the page
+        if (direct[page])
+            direct[page] = mem + ((uint32_t)page * NESBUS_PAGE_SIZE - lo);
+    }
+}
+
+
 bool nesbus_add_read_handler(nesbus_t* c, const char* tag, uint16_t lo, uint16_t hi, bool (*handler)(uint16_t, uint8_t*, void*, uint8_t owner), void* cookie)
 {
     if (0 == c)
@@ -55,8 +117,11 @@ bool nesbus_add_read_handler(nesbus_t* c, const char* tag, uint16_t lo, uint16_t
         .lo = lo,
         .hi = hi,
         .cookie = cookie,
-        .fn = handler
+        .fn = handler,
+        .mem = 0
     };
+    if (handler)
+        map_handler(c->read_pages, c->read_direct, lo, hi, 0, c->read_table_cur);
     ++(c->read_table_cur);
     return true;
 }
@@ -74,18 +139,97 @@ bool nesbus_add_write_handler(nesbus_t* c, const char* tag, uint16_t lo, uint16_
         .lo = lo,
         .hi = hi,
         .cookie = cookie,
-        .fn = handler
+        .fn = handler,
+        .mem = 0
     };
+    if (handler)
+        map_handler(c->write_pages, c->write_direct, lo, hi, 0, c->write_table_cur);
     ++(c->write_table_cur);
     return true;
 }
 
 
+// Map mem[0]--mem[hi - lo] to address lo--hi, readable and (unless read_only) writable
+bool nesbus_add_memory(nesbus_t* c, const char* tag, uint16_t lo, uint16_t hi, uint8_t* mem, bool read_only)
+{
+    if ((0 == c) || (0 == mem))
+        return false;
+    if (c->read_table_cur >= c->read_table_max)
+        return false;
+    if (!read_only && (c->write_table_cur >= c->write_table_max))
+        return false;
+    c->read_table[c->read_table_cur] = (nesbus_read_handler_t)
+    {
+        .tag = tag,
+        .lo = lo,
+        .hi = hi,
+        .cookie = 0,
+        .fn = 0,
+        .mem = mem
+    };
+    map_handler(c->read_pages, c->read_direct, lo, hi, mem, c->read_table_cur);
+    ++(c->read_table_cur);
+    if (!read_only)
+    {
+        c->write_table[c->write_table_cur] = (nesbus_write_handler_t)
+        {
+            .tag = tag,
+            .lo = lo,
+            .hi = hi,
+            .cookie = 0,
+            .fn = 0,
+            .mem = mem
+        };
+        map_handler(c->write_pages, c->write_direct, lo, hi, mem, c->write_table_cur);
+        ++(c->write_table_cur);
+    }
+    return true;
+}
+
+
+// Point memory region(s) starting at lo to a new base pointer, e.g. for bank switching
+bool nesbus_remap_memory(nesbus_t* c, uint16_t lo, uint8_t* mem)
+{
+    int i;
+    bool r = false;
+    if ((0 == c) || (0 == mem))
+        return false;
+    for (i = 0; i < c->read_table_cur; ++i)
+    {
+        if ((0 != c->read_table[i].mem) && (lo == c->read_table[i].lo))
+        {
+            c->read_table[i].mem = mem;
+            remap_direct(c->read_direct, lo, c->read_table[i].hi, mem);
+            r = true;
+        }
+    }
+    for (i = 0; i < c->write_table_cur; ++i)
+    {
+        if ((0 != c->write_table[i].mem) && (lo == c->write_table[i].lo))
+        {
+            c->write_table[i].mem = mem;
+            remap_direct(c->write_direct, lo, c->write_table[i].hi, mem);
+            r = true;
+        }
+    }
+    return r;
+}
+
+
 void nesbus_clear_handlers(nesbus_t* c)
 {
+    int i;
     if (0 == c)
         return;
-    memset(c, 0, sizeof(nesbus_t));
+    c->read_table_cur = 0;
+    c->write_table_cur = 0;
+    for (i = 0; i < NESBUS_PAGE_COUNT; ++i)
+    {
+        c->read_pages[i].count = 0;
+        c->write_pages[i].count = 0;
+        c->read_direct[i] = 0;
+        c->write_direct[i] = 0;
+    }
 }
 
 
@@ -97,31 +241,39 @@ void nesbus_dump_handlers(nesbus_t* c)
     NSF_PRINTF("NSF: bus read handlers:\n");
     for (i = 0; i < c->read_table_cur; ++i)
     {
-        if (0 != c->read_table[i].fn)
+        if ((0 != c->read_table[i].fn) || (0 != c->read_table[i].mem))
         {
             if (0 != c->read_table[i].tag)
             {
-                NSF_PRINTF("(%02d): 0x%04x--0x%04x (%s)\n", i, c->read_table[i].lo, c->read_table[i].hi, c->read_table[i].tag);
+                NSF_PRINTF("(%02d): 0x%04x--0x%04x (%s)%s\n", i, c->read_table[i].lo, c->read_table[i].hi, c->read_table[i].tag, c->read_table[i].mem ? " [MEM]" : "");
             }
-            else
+            else if (0 != c->read_table[i].fn)
             {
                 NSF_PRINTF("(%02d): 0x%04x--0x%04x (%p)\n", i, c->read_table[i].lo, c->read_table[i].hi, c->read_table[i].fn);
             }
+            else
+            {
+                NSF_PRINTF("(%02d): 0x%04x--0x%04x (%p) [MEM]\n", i, c->read_table[i].lo, c->read_table[i].hi, c->read_table[i].mem);
+            }
         }
     }
     NSF_PRINTF("NSF: bus write handlers:\n");
     for (i = 0; i < c->write_table_cur; ++i)
     {
-        if (c->write_table[i].fn != 0)
+        if ((c->write_table[i].fn != 0) || (c->write_table[i].mem != 0))
         {
             if (c->write_table[i].tag != 0)
             {
-                NSF_PRINTF("(%02d): 0x%04x--0x%04x (%s)\n", i, c->write_table[i].lo, c->write_table[i].hi, c->write_table[i].tag);
+                NSF_PRINTF("(%02d): 0x%04x--0x%04x (%s)%s\n", i, c->write_table[i].lo, c->write_table[i].hi, c->write_table[i].tag, c->write_table[i].mem ? " [MEM]" : "");
             }
-            else
+            else if (c->write_table[i].fn != 0)
             {
                 NSF_PRINTF("(%02d): 0x%04x--0x%04x (%p)\n", i, c->write_table[i].lo, c->write_table[i].hi, c->write_table[i].fn);
             }
+            else
+            {
+                NSF_PRINTF("(%02d): 0x%04x--0x%04x (%p) [MEM]\n", i, c->write_table[i].lo, c->write_table[i].hi, c->write_table[i].mem);
+            }
         }
     }
 }
@@ -132,25 +284,44 @@ uint8_t nesbus_read(nesbus_t* c, uint16_t addr, uint8_t owner)
     int i;
     bool r = false;
     uint8_t val = 0, tval;
+    uint8_t* direct;
+    const nesbus_page_t* page;
+    const nesbus_read_handler_t* h;
     
     if (0 == c)
         return 0;
 
-    // loop through all reader functions.
+    // page mapped to a single memory region
+    direct = c->read_direct[addr / NESBUS_PAGE_SIZE];
+    if (direct)
+        return direct[addr & (NESBUS_PAGE_SIZE - 1)];
+
+    // loop through reader functions mapped to the page of addr.
     // First reader returns true will set the output value
-    for (i = 0; i < c->read_table_cur; ++i)
+#ifdef NESCPU_PROFILE
+    ++(c->handler_reads[addr / NESBUS_PAGE_SIZE]);
+#endif
+    page = &(c->read_pages[addr / NESBUS_PAGE_SIZE]);
+    for (i = 0; i < page->count; ++i)
     {
-        if (c->read_table[i].fn != 0)
+        h = &(c->read_table[page->index[i]]);
+        if ((addr >= h->lo) && (addr <= h->hi))
         {
-            if ((addr >= c->read_table[i].lo) && (addr <= c->read_table[i].hi))
+            if (h->mem)
+            {
+                tval = h->mem[addr - h->lo];
+                if (!r)
+                {
+                    val = tval;
+                    r = true;
+                }
+            }
+            else if (h->fn(addr, &tval, h->cookie, owner))
             {
-                if (c->read_table[i].fn(addr, &tval, c->read_table[i].cookie, owner))
+                if (!r)
                 {
-                    if (!r)
-                    {
-                        val = tval;
-                        r = true;
-                    }
+                    val = tval;
+                    r = true;
                 }
             }
         }
@@ -165,22 +336,58 @@ uint8_t nesbus_read(nesbus_t* c, uint16_t addr, uint8_t owner)
 }
 
 
+// Read without going through handlers, only succeeds if the page is mapped to a single memory
+// region. Such read has no side effect and the value can only change by writes to the bus.
+bool nesbus_peek(nesbus_t* c, uint16_t addr, uint8_t* val)
+{
+    uint8_t* direct;
+    if (0 == c)
+        return false;
+    direct = c->read_direct[addr / NESBUS_PAGE_SIZE];
+    if (0 == direct)
+        return false;
+    *val = direct[addr & (NESBUS_PAGE_SIZE - 1)];
+    return true;
+}
+
+
 void nesbus_write(nesbus_t* c, uint16_t addr, uint8_t val)
 {
     int i;
     bool r = false;
+    uint8_t* direct;
+    const nesbus_page_t* page;
+    const nesbus_write_handler_t* h;
 
     if (0 == c)
         return;
 
-    // loop through all writer functions.
-    for (i = 0; i < c->write_table_cur; ++i)
+    // page mapped to a single memory region
+    direct = c->write_direct[addr / NESBUS_PAGE_SIZE];
+    if (direct)
+    {
+        direct[addr & (NESBUS_PAGE_SIZE - 1)] = val;
+        return;
+    }
+
+    // loop through writer functions mapped to the page of addr.
+#ifdef NESCPU_PROFILE
+    ++(c->handler_writes[addr / NESBUS_PAGE_SIZE]);
+#endif
+    page = &(c->write_pages[addr / NESBUS_PAGE_SIZE]);
+    for (i = 0; i < page->count; ++i)
     {
-        if (c->write_table[i].fn != 0)
+        h = &(c->write_table[page->index[i]]);
+        if ((addr >= h->lo) && (addr <= h->hi))
         {
-            if ((addr >= c->write_table[i].lo) && (addr <= c->write_table[i].hi))
+            if (h->mem)
+            {
+                h->mem[addr - h->lo] = val;
+                r = true;
+            }
+            else
             {
-                r = c->write_table[i].fn(addr, val, c->write_table[i].cookie) | r;
+                r = h->fn(addr, val, h->cookie) | r;
             }
         }
     }
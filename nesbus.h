@@ -12,12 +12,17 @@ extern "C" {
 #define BUS_OWNER_APU   2
 #define BUS_OWNER_EXT   3
 
+#define NESBUS_PAGE_SIZE    256     // dispatch map granularity
+#define NESBUS_PAGE_COUNT   256     // 64K address space / NESBUS_PAGE_SIZE
+#define NESBUS_MAX_HANDLERS 255     // handler indices are stored as uint8_t in the page map
+
 typedef struct nesbus_read_handler_s
 {
     const char* tag;
     uint16_t lo, hi;
     void* cookie;
     bool (*fn)(uint16_t addr, uint8_t* rval, void *cookie, uint8_t owner);  // read function, return true if succeeded
+    uint8_t* mem;   // memory backed region (fn is 0), mem[0] is at lo
 } nesbus_read_handler_t;
 
 
@@ -27,16 +32,39 @@ typedef struct nesbus_write_handler_s
     uint16_t lo, hi;
     void* cookie;
     bool (*fn)(uint16_t addr, uint8_t val, void *cookie);  // write function, return true if succeeded
+    uint8_t* mem;   // memory backed region (fn is 0), mem[0] is at lo
 } nesbus_write_handler_t;
 
 
 
+// Handlers overlapping one page of address space
+typedef struct nesbus_page_s
+{
+    uint8_t count;      // number of handlers in index
+    uint8_t* index;     // index into read/write table, in registration order
+} nesbus_page_t;
+
+
 typedef struct nesbus_ctx_s
 {
     nesbus_read_handler_t* read_table;
     int read_table_max, read_table_cur;
     nesbus_write_handler_t* write_table;
     int write_table_max, write_table_cur;
+    // Page indexed dispatch map, built when handlers are added
+    nesbus_page_t read_pages[NESBUS_PAGE_COUNT];
+    nesbus_page_t write_pages[NESBUS_PAGE_COUNT];
+    uint8_t* read_map;      // storage of read_pages[].index, read_table_max entries per page
+    uint8_t* write_map;     // storage of write_pages[].index, write_table_max entries per page
+    // Pages covered entirely by a single memory backed region are accessed directly,
+    // read_direct[page][addr & 0xFF], without going through the handler table
+    uint8_t* read_direct[NESBUS_PAGE_COUNT];
+    uint8_t* write_direct[NESBUS_PAGE_COUNT];
+#ifdef NESCPU_PROFILE
+    // Accesses (any owner) dispatched through the handler table per page, reported by the CPU profile
+    uint64_t handler_reads[NESBUS_PAGE_COUNT];
+    uint64_t handler_writes[NESBUS_PAGE_COUNT];
+#endif
 } nesbus_t;
 
 
@@ -44,11 +72,14 @@ nesbus_t* nesbus_create(int max_read, int max_write);
 void nesbus_destroy(nesbus_t* ctx);
 bool nesbus_add_read_handler(nesbus_t* ctx, const char* tag, uint16_t lo, uint16_t hi, bool (*handler)(uint16_t, uint8_t*, void*, uint8_t owner), void* cookie);
 bool nesbus_add_write_handler(nesbus_t* ctx, const char* tag, uint16_t lo, uint16_t hi, bool (*handler)(uint16_t, uint8_t, void*), void* cookie);
+bool nesbus_add_memory(nesbus_t* ctx, const char* tag, uint16_t lo, uint16_t hi, uint8_t* mem, bool read_only);
+bool nesbus_remap_memory(nesbus_t* ctx, uint16_t lo, uint8_t* mem);
 void nesbus_clear_handlers(nesbus_t* ctx);
 void nesbus_dump_handlers(nesbus_t* ctx);
 
 uint8_t nesbus_read(nesbus_t* ctx, uint16_t address, uint8_t owner);
 void nesbus_write(nesbus_t* ctx, uint16_t address, uint8_t value);
+bool nesbus_peek(nesbus_t* ctx, uint16_t address, uint8_t* value);
 
 
 
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
 #include "nescpu.h"
 
 
@@ -78,15 +79,30 @@
 #define BASE_STACK     0x100
 
 
+#ifdef NESCPU_PROFILE
+# define PROFILE_INSTRUCTION(c, pc, op, cycles) do { if ((c)->profile) profile_instruction((c)->profile, (pc), (op), (cycles)); } while (0)
+# define PROFILE_COUNT(c, field, n) do { if ((c)->profile) (c)->profile->field += (n); } while (0)
+#else
+# define PROFILE_INSTRUCTION(c, pc, op, cycles) ((void)0)
+# define PROFILE_COUNT(c, field, n) ((void)0)
+#endif
+
+
 // Forward declaraction of helpers
 static void push16(nescpu_t * c, uint16_t val);
 static void push8(nescpu_t * c, uint8_t val);
+#ifdef NESCPU_SWITCH_CORE
+static inline uint32_t run_switch(nescpu_t* c, uint32_t cycle_budget, bool in_run);
+#else
 static uint16_t pop16(nescpu_t * c);
 static uint8_t pop8(nescpu_t * c);
 static uint16_t load_operand(nescpu_t * c);
 static void store_value(nescpu_t * c, uint16_t val);
+#endif
 
 
+#ifndef NESCPU_SWITCH_CORE
+
 //
 // CPU Instruction and Operations
 //
@@ -1147,6 +1163,9 @@ static const op_impl_fp optable[256] =
 /* F */      BEQ,  SBC,  JAM,  ISB,  NOP,  SBC,  INC,  ISB,  SED,  SBC,  NOP,  ISB,  NOP,  SBC,  INC,  ISB  /* F */
 };
 
+#endif  // NESCPU_SWITCH_CORE
+
+
 static const uint32_t cycletable[256] = {
 /*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |     */
 /* 0 */      7,    6,    2,    8,    3,    3,    5,    5,    3,    2,    2,    2,    4,    4,    6,    6,  /* 0 */
@@ -1169,6 +1188,45 @@ static const uint32_t cycletable[256] = {
 
 
 
+#ifdef NESCPU_PROFILE
+
+// opcode -> mnemonic
+static const char* const op_names[256] =
+{
+/* 0 */    "BRK", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO", "PHP", "ORA", "ASL", "NOP", "NOP", "ORA", "ASL", "SLO", /* 0 */
+/* 1 */    "BPL", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO", "CLC", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO", /* 1 */
+/* 2 */    "JSR", "AND", "NOP", "RLA", "BIT", "AND", "ROL", "RLA", "PLP", "AND", "ROL", "NOP", "BIT", "AND", "ROL", "RLA", /* 2 */
+/* 3 */    "BMI", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA", "SEC", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA", /* 3 */
+/* 4 */    "RTI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE", "PHA", "EOR", "LSR", "NOP", "JMP", "EOR", "LSR", "SRE", /* 4 */
+/* 5 */    "BVC", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE", "CLI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE", /* 5 */
+/* 6 */    "RTS", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA", "PLA", "ADC", "ROR", "NOP", "JMP", "ADC", "ROR", "RRA", /* 6 */
+/* 7 */    "BVS", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA", "SEI", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA", /* 7 */
+/* 8 */    "NOP", "STA", "NOP", "SAX", "STY", "STA", "STX", "SAX", "DEY", "NOP", "TXA", "NOP", "STY", "STA", "STX", "SAX", /* 8 */
+/* 9 */    "BCC", "STA", "NOP", "NOP", "STY", "STA", "STX", "SAX", "TYA", "STA", "TXS", "NOP", "NOP", "STA", "NOP", "NOP", /* 9 */
+/* A */    "LDY", "LDA", "LDX", "LAX", "LDY", "LDA", "LDX", "LAX", "TAY", "LDA", "TAX", "NOP", "LDY", "LDA", "LDX", "LAX", /* A */
+/* B */    "BCS", "LDA", "NOP", "LAX", "LDY", "LDA", "LDX", "LAX", "CLV", "LDA", "TSX", "LAX", "LDY", "LDA", "LDX", "LAX", /* B */
+/* C */    "CPY", "CMP", "NOP", "DCP", "CPY", "CMP", "DEC", "DCP", "INY", "CMP", "DEX", "NOP", "CPY", "CMP", "DEC", "DCP", /* C */
+/* D */    "BNE", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP", "CLD", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP", /* D */
+/* E */    "CPX", "SBC", "NOP", "ISB", "CPX", "SBC", "INC", "ISB", "INX", "SBC", "NOP", "SBC", "CPX", "SBC", "INC", "ISB", /* E */
+/* F */    "BEQ", "SBC", "JAM", "ISB", "NOP", "SBC", "INC", "ISB", "SED", "SBC", "NOP", "ISB", "NOP", "SBC", "INC", "ISB"  /* F */
+};
+
+
+// count an executed instruction
+static void profile_instruction(nescpu_profile_t* prof, uint16_t pc, uint8_t op, uint8_t cycles)
+{
+    ++(prof->op_count[op]);
+    prof->op_cycles[op] += cycles;
+    ++(prof->pc_count[pc]);
+    prof->pc_cycles[pc] += cycles;
+    prof->pc_op[pc] = op;
+    ++(prof->phase_count[prof->phase]);
+    prof->phase_cycles[prof->phase] += cycles;
+}
+
+#endif  // NESCPU_PROFILE
+
+
 //
 // Helpers
 //
@@ -1190,6 +1248,99 @@ static void push8(nescpu_t* c, uint8_t val)
 }
 
 
+// Idle loop: JMP or branch to itself, or a load from memory followed by a branch back to the load
+// (e.g. waiting for a flag set by IRQ handler). Nothing inside the loop changes memory or registers,
+// so it runs unchanged until an interrupt and nescpu_run can skip whole iterations.
+typedef struct idle_loop_s
+{
+    uint32_t period;    // cycles per iteration
+    uint8_t load;       // load opcode at loop start, 0 if none
+    uint8_t value;      // value loaded
+    uint8_t status;     // STATUS after the load
+} idle_loop_t;
+
+
+// Test if instruction op at from, taking cycles and jumping back to pc, closes an idle loop
+static bool find_idle_loop(nesbus_t* bus, uint16_t from, uint16_t pc, uint8_t op, uint8_t cycles, uint8_t a, uint8_t status, idle_loop_t* loop)
+{
+    uint8_t code[3], flag;
+    uint16_t addr;
+    if ((0x4C != op) && (0x10 != (op & 0x1F)))
+        return false;
+    // loop code must be in memory, checking first and last byte covers the pages it spans
+    if (!nesbus_peek(bus, pc, &code[0]) || !nesbus_peek(bus, from + ((0x4C == op) ? 2 : 1), &code[2]))
+        return false;
+    if (pc == from)
+    {
+        // JMP $abs or Bxx to itself
+        loop->period = cycles;
+        loop->load = 0;
+        return true;
+    }
+    // Bxx back to a 2 or 3 byte load
+    if ((0x4C == op) || (from - pc > 3))
+        return false;
+    nesbus_peek(bus, pc + 1, &code[1]);
+    switch (code[0])
+    {
+    case 0xA5: case 0xA6: case 0xA4: case 0x24:     // LDA/LDX/LDY/BIT $zp
+        if (from - pc != 2)
+            return false;
+        addr = code[1];
+        break;
+    case 0xAD: case 0xAE: case 0xAC: case 0x2C:     // LDA/LDX/LDY/BIT $abs
+        if (from - pc != 3)
+            return false;
+        nesbus_peek(bus, pc + 2, &code[2]);
+        addr = (uint16_t)code[1] | ((uint16_t)code[2] << 8);
+        break;
+    default:
+        return false;
+    }
+    if (!nesbus_peek(bus, addr, &loop->value))
+        return false;
+    // flags after the load
+    if (0x24 == (code[0] & 0xF7))     // BIT
+    {
+        status = (status & ~FLAG_Z) | ((a & loop->value) ? 0 : FLAG_Z);
+        status = (status & 0x3F) | (loop->value & 0xC0);
+    }
+    else
+    {
+        status = (status & ~(FLAG_Z | FLAG_N)) | (loop->value ? 0 : FLAG_Z) | (loop->value & FLAG_N);
+    }
+    // branch must be taken again, bit 7-6 selects flag, bit 5 is the value to branch on
+    switch (op & 0xC0)
+    {
+    case 0x00: flag = FLAG_N; break;
+    case 0x40: flag = FLAG_V; break;
+    case 0x80: flag = FLAG_C; break;
+    default:   flag = FLAG_Z; break;
+    }
+    if ((0 != (status & flag)) != (0 != (op & 0x20)))
+        return false;
+    loop->period = cycletable[code[0]] + cycles;
+    loop->load = code[0];
+    loop->status = status;
+    return true;
+}
+
+
+// Registers after skipping iterations of idle loop, the load sets the same value every time
+static void apply_idle_loop(const idle_loop_t* loop, uint8_t* a, uint8_t* x, uint8_t* y, uint8_t* status)
+{
+    switch (loop->load)
+    {
+    case 0xA5: case 0xAD: *a = loop->value; break;
+    case 0xA6: case 0xAE: *x = loop->value; break;
+    case 0xA4: case 0xAC: *y = loop->value; break;
+    case 0: return;
+    }
+    *status = loop->status;
+}
+
+
+#ifndef NESCPU_SWITCH_CORE
 // pop 16-bit from stack
 static uint16_t pop16(nescpu_t* c)
 {
@@ -1230,6 +1381,29 @@ static void store_value(nescpu_t* c, uint16_t val)
 }
 
 
+// fetch and execute one instruction, set cycles it takes
+static void execute(nescpu_t* c)
+{
+#ifdef NESCPU_PROFILE
+    uint16_t pc = c->PC;
+#endif
+    c->opcode = nesbus_read(c->bus, c->PC, BUS_OWNER_CPU);
+    SET_U(c);    // Always set U flag
+    ++(c->PC);
+    c->cycles = cycletable[c->opcode];
+    c->add_cycle_op = false;
+    c->add_cycle_addr = false;
+    (*addrtable[c->opcode])(c); // Set addresing mode
+    (*optable[c->opcode])(c);    // Call instruction
+    c->cycles += (c->add_cycle_op & c->add_cycle_addr) ? 1 : 0;
+    SET_U(c);    // Always set U flag
+    PROFILE_INSTRUCTION(c, pc, c->opcode, c->cycles);
+}
+
+
+#endif  // NESCPU_SWITCH_CORE
+
+
 //
 // Exported functions
 //
@@ -1240,6 +1414,9 @@ nescpu_t* nescpu_create()
     if (c != 0)
     {
         memset(c, 0, sizeof(nescpu_t));
+#ifdef NESCPU_PROFILE
+        c->profile = calloc(1, sizeof(nescpu_profile_t));   // no profile if out of memory
+#endif
     }
     return c;
 }
@@ -1247,7 +1424,12 @@ nescpu_t* nescpu_create()
 
 void nescpu_destroy(nescpu_t* c)
 {
-    if (c) free(c);
+    if (0 == c)
+        return;
+#ifdef NESCPU_PROFILE
+    if (c->profile) free(c->profile);
+#endif
+    free(c);
 }
 
 
@@ -1258,6 +1440,28 @@ void nescpu_attach_bus(nescpu_t* c, nesbus_t* bus)
 }
 
 
+// Copy emulation state (registers, timing) from src. Host side fields of ctx (bus connection,
+// profile buffer) are kept, any pointer added to nescpu_t must be kept here too.
+void nescpu_copy_state(nescpu_t* c, const nescpu_t* src)
+{
+    nesbus_t* bus;
+#ifdef NESCPU_PROFILE
+    nescpu_profile_t* profile;
+#endif
+    if ((0 == c) || (0 == src))
+        return;
+    bus = c->bus;
+#ifdef NESCPU_PROFILE
+    profile = c->profile;
+#endif
+    *c = *src;
+    c->bus = bus;
+#ifdef NESCPU_PROFILE
+    c->profile = profile;
+#endif
+}
+
+
 void nescpu_reset(nescpu_t* c, bool reset_to_fffc)
 {
     if (0 == c)
@@ -1276,6 +1480,8 @@ void nescpu_reset(nescpu_t* c, bool reset_to_fffc)
     SET_I(c);         // enable interrupt
     c->cycles = 7;    // reset take 7 cycles
     c->jammed = false;
+    c->run_cycles = 0;
+    c->run_break = false;
 }
 
 
@@ -1293,6 +1499,7 @@ void nescpu_irq(nescpu_t* c)
     push8(c, c->STATUS);
     c->PC = (uint16_t)nesbus_read(c->bus, 0xFFFE, BUS_OWNER_CPU) | ((uint16_t)nesbus_read(c->bus, 0xFFFF, BUS_OWNER_CPU) << 8);
     c->cycles = 7;
+    PROFILE_COUNT(c, irq_count, 1);
 }
 
 
@@ -1308,6 +1515,7 @@ void nescpu_nmi(nescpu_t* c)
     push8(c, c->STATUS);
     c->PC = (uint16_t)nesbus_read(c->bus, 0xFFFA, BUS_OWNER_CPU) | ((uint16_t)nesbus_read(c->bus, 0xFFFB, BUS_OWNER_CPU) << 8);
     c->cycles = 8;
+    PROFILE_COUNT(c, nmi_count, 1);
 }
 
 
@@ -1320,20 +1528,17 @@ bool nescpu_clock(nescpu_t* c)
     {
         if (!c->jammed)
         {
-            c->opcode = nesbus_read(c->bus, c->PC, BUS_OWNER_CPU);
-            SET_U(c);    // Always set U flag
-            ++(c->PC);
-            c->cycles = cycletable[c->opcode];
-            c->add_cycle_op = false;
-            c->add_cycle_addr = false;
-            (*addrtable[c->opcode])(c); // Set addresing mode
-            (*optable[c->opcode])(c);    // Call instruction
-            c->cycles += (c->add_cycle_op & c->add_cycle_addr) ? 1 : 0;
-            SET_U(c);    // Always set U flag
+#ifdef NESCPU_SWITCH_CORE
+            run_switch(c, 1, false);
+            return (c->jammed);
+#else
+            execute(c);
+#endif
         }
         else
         {
             // CPU is JAMed
+            PROFILE_COUNT(c, jam_cycles, 1);
             c->cycles = 1;  // will reduce to 0 below 
         }
     }
@@ -1342,6 +1547,546 @@ bool nescpu_clock(nescpu_t* c)
 }
 
 
+#ifdef NESCPU_SWITCH_CORE
+
+/*
+    Switch core: one switch over the opcode with addressing mode and operation fused into each
+    case, registers kept in locals for the whole run. Same bus accesses, flags and cycles as the
+    table core, including its handling of undocumented instructions.
+ */
+
+#define RD(addr)        nesbus_read(bus, (uint16_t)(addr), BUS_OWNER_CPU)
+#define WR(addr, val)   nesbus_write(bus, (uint16_t)(addr), (uint8_t)(val))
+
+// flags from 16-bit result, same as CALC_Z/CALC_N/CALC_C
+#define SW_ZN(n)        p = (uint8_t)((p & ~(FLAG_Z | FLAG_N)) | (((n) & 0x00FF) ? 0 : FLAG_Z) | ((n) & 0x0080))
+#define SW_C(n)         p = (uint8_t)((p & ~FLAG_C) | (((n) & 0xFF00) ? FLAG_C : 0))
+#define SW_C0(n)        p = (uint8_t)((p & ~FLAG_C) | ((n) & FLAG_C))
+
+// stack
+#define PUSH8(val)      do { WR(BASE_STACK + sp, (val)); --sp; } while (0)
+#define PUSH16(val)     do { WR(BASE_STACK + sp, ((val) >> 8) & 0xFF); WR(BASE_STACK + ((sp - 1) & 0xFF), (val) & 0xFF); sp -= 2; } while (0)
+#define POP8(dst)       do { ++sp; (dst) = RD(BASE_STACK + sp); } while (0)
+#define POP16(dst)      do { (dst) = RD(BASE_STACK + ((sp + 1) & 0xFF)); (dst) |= (uint16_t)RD(BASE_STACK + ((sp + 2) & 0xFF)) << 8; sp += 2; } while (0)
+#define READ16(dst, addr) do { (dst) = RD(addr); (dst) |= (uint16_t)RD((addr) + 1) << 8; } while (0)
+
+// addressing modes, set ea and cross (page crossed)
+#define AM_IMM()    do { ea = pc; ++pc; } while (0)
+#define AM_ZP()     do { ea = RD(pc); ++pc; } while (0)
+#define AM_ZPX()    do { ea = (RD(pc) + x) & 0x00FF; ++pc; } while (0)
+#define AM_ZPY()    do { ea = (RD(pc) + y) & 0x00FF; ++pc; } while (0)
+#define AM_ABSO()   do { READ16(ea, pc); pc += 2; } while (0)
+#define AM_ABSX()   do { READ16(ea, pc); cross = ((ea & 0x00FF) + x) > 0x00FF; ea += x; pc += 2; } while (0)
+#define AM_ABSY()   do { READ16(ea, pc); cross = ((ea & 0x00FF) + y) > 0x00FF; ea += y; pc += 2; } while (0)
+#define AM_IND()    do { READ16(t, pc); ea = RD(t); ea |= (uint16_t)RD((t & 0xFF00) | ((t + 1) & 0x00FF)) << 8; pc += 2; } while (0)
+#define AM_INDX()   do { t = (RD(pc) + x) & 0x00FF; ++pc; ea = RD(t); ea |= (uint16_t)RD((t + 1) & 0x00FF) << 8; } while (0)
+#define AM_INDY()   do { t = RD(pc); ++pc; ea = RD(t); ea |= (uint16_t)RD((t + 1) & 0x00FF) << 8; cross = ((ea & 0x00FF) + y) > 0x00FF; ea += y; } while (0)
+
+// operations
+#define SW_ADC(val) do { v = (val); t = (uint16_t)a + v + (p & FLAG_C); SW_C(t); SW_ZN(t); p = (uint8_t)((p & ~FLAG_V) | ((((t ^ a) & (t ^ v)) & 0x0080) ? FLAG_V : 0)); a = (uint8_t)t; } while (0)
+#define SW_CMP(r)   do { v = RD(ea); p = (uint8_t)((p & ~(FLAG_C | FLAG_Z | FLAG_N)) | (((r) >= v) ? FLAG_C : 0) | (((r) == v) ? FLAG_Z : 0) | (((r) - v) & 0x0080)); } while (0)
+#define SW_BRANCH(cond) do { t = RD(pc); ++pc; if (t & 0x80) t |= 0xFF00; if (cond) { ++cyc; v = pc + t; if ((v & 0xFF00) != (pc & 0xFF00)) ++cyc; pc = v; } } while (0)
+
+#define OP_ADC()    do { SW_ADC(RD(ea)); cyc += cross; } while (0)
+#define OP_SBC()    do { SW_ADC(RD(ea) ^ 0x00FF); cyc += cross; } while (0)
+#define OP_AND()    do { a &= RD(ea); SW_ZN(a); cyc += cross; } while (0)
+#define OP_ORA()    do { a |= RD(ea); SW_ZN(a); cyc += cross; } while (0)
+#define OP_EOR()    do { a ^= RD(ea); SW_ZN(a); cyc += cross; } while (0)
+#define OP_CMP()    do { SW_CMP(a); cyc += cross; } while (0)
+#define OP_CPX()    SW_CMP(x)
+#define OP_CPY()    SW_CMP(y)
+#define OP_BIT()    do { v = RD(ea); p = (uint8_t)((p & ~FLAG_Z) | ((a & v) ? 0 : FLAG_Z)); p = (uint8_t)((p & 0x3F) | (v & 0xC0)); } while (0)
+#define OP_LDA()    do { a = RD(ea); SW_ZN(a); cyc += cross; } while (0)
+#define OP_LDX()    do { x = RD(ea); SW_ZN(x); cyc += cross; } while (0)
+#define OP_LDY()    do { y = RD(ea); SW_ZN(y); cyc += cross; } while (0)
+#define OP_STA()    WR(ea, a)
+#define OP_STX()    WR(ea, x)
+#define OP_STY()    WR(ea, y)
+#define OP_ASL()    do { v = RD(ea) << 1; SW_C(v); SW_ZN(v); WR(ea, v); } while (0)
+#define OP_ASL_A()  do { v = a << 1; SW_C(v); SW_ZN(v); a = (uint8_t)v; } while (0)
+#define OP_LSR()    do { v = RD(ea); SW_C0(v); v >>= 1; SW_ZN(v); WR(ea, v); } while (0)
+#define OP_LSR_A()  do { v = a; SW_C0(v); v >>= 1; SW_ZN(v); a = (uint8_t)v; } while (0)
+#define OP_ROL()    do { v = (RD(ea) << 1) | (p & FLAG_C); SW_C(v); SW_ZN(v); WR(ea, v); } while (0)
+#define OP_ROL_A()  do { v = (a << 1) | (p & FLAG_C); SW_C(v); SW_ZN(v); a = (uint8_t)v; } while (0)
+#define OP_ROR()    do { v = RD(ea); t = (v >> 1) | ((p & FLAG_C) << 7); SW_C0(v); SW_ZN(t); WR(ea, t); } while (0)
+#define OP_ROR_A()  do { v = a; t = (v >> 1) | ((p & FLAG_C) << 7); SW_C0(v); SW_ZN(t); a = (uint8_t)t; } while (0)
+#define OP_INC()    do { v = RD(ea) + 1; SW_ZN(v); WR(ea, v); } while (0)
+#define OP_DEC()    do { v = RD(ea) - 1; SW_ZN(v); WR(ea, v); } while (0)
+#define OP_INX()    do { ++x; SW_ZN(x); } while (0)
+#define OP_INY()    do { ++y; SW_ZN(y); } while (0)
+#define OP_DEX()    do { --x; SW_ZN(x); } while (0)
+#define OP_DEY()    do { --y; SW_ZN(y); } while (0)
+#define OP_TAX()    do { x = a; SW_ZN(x); } while (0)
+#define OP_TAY()    do { y = a; SW_ZN(y); } while (0)
+#define OP_TSX()    do { x = sp; SW_ZN(x); } while (0)
+#define OP_TXA()    do { a = x; SW_ZN(a); } while (0)
+#define OP_TYA()    do { a = y; SW_ZN(a); } while (0)
+#define OP_TXS()    sp = x
+#define OP_CLC()    p &= ~FLAG_C
+#define OP_CLD()    p &= ~FLAG_D
+#define OP_CLI()    p &= ~FLAG_I
+#define OP_CLV()    p &= ~FLAG_V
+#define OP_SEC()    p |= FLAG_C
+#define OP_SED()    p |= FLAG_D
+#define OP_SEI()    p |= FLAG_I
+#define OP_PHA()    PUSH8(a)
+#define OP_PHP()    PUSH8(p | FLAG_B)
+#define OP_PLA()    do { POP8(a); SW_ZN(a); } while (0)
+#define OP_PLP()    do { POP8(p); p = (uint8_t)((p | FLAG_U) & ~FLAG_B); } while (0)
+#define OP_JMP()    pc = ea
+#define OP_JSR()    do { t = pc - 1; PUSH16(t); pc = ea; } while (0)
+#define OP_RTS()    do { POP16(t); pc = t + 1; } while (0)
+#define OP_RTI()    do { POP8(p); p = (uint8_t)((p | FLAG_U) & ~FLAG_B); POP16(pc); } while (0)
+#define OP_BRK()    do { ++pc; PUSH16(pc); PUSH8(p | FLAG_B); p |= FLAG_I; READ16(pc, 0xFFFE); } while (0)
+#define OP_BCC()    SW_BRANCH(0 == (p & FLAG_C))
+#define OP_BCS()    SW_BRANCH(p & FLAG_C)
+#define OP_BEQ()    SW_BRANCH(p & FLAG_Z)
+#define OP_BNE()    SW_BRANCH(0 == (p & FLAG_Z))
+#define OP_BMI()    SW_BRANCH(p & FLAG_N)
+#define OP_BPL()    SW_BRANCH(0 == (p & FLAG_N))
+#define OP_BVC()    SW_BRANCH(0 == (p & FLAG_V))
+#define OP_BVS()    SW_BRANCH(p & FLAG_V)
+#define OP_NOP()
+#define OP_NOP_X()  cyc += cross
+#define OP_JAM()    c->jammed = true
+#ifdef USE_UNDOCUMENTED_INSTRUCTIONS
+// combined instructions read the operand again for their second half and get no page cross penalty
+#define OP_LAX()    do { a = RD(ea); SW_ZN(a); x = RD(ea); SW_ZN(x); cyc += cross; } while (0)
+#define OP_SAX()    do { WR(ea, a); WR(ea, x); WR(ea, a & x); } while (0)
+#define OP_DCP()    do { OP_DEC(); SW_CMP(a); } while (0)
+#define OP_ISB()    do { OP_INC(); SW_ADC(RD(ea) ^ 0x00FF); } while (0)
+#define OP_SLO()    do { OP_ASL(); a |= RD(ea); SW_ZN(a); } while (0)
+#define OP_RLA()    do { OP_ROL(); a &= RD(ea); SW_ZN(a); } while (0)
+#define OP_SRE()    do { OP_LSR(); a ^= RD(ea); SW_ZN(a); } while (0)
+#define OP_RRA()    do { OP_ROR(); SW_ADC(RD(ea)); } while (0)
+#else
+#define OP_LAX()
+#define OP_SAX()
+#define OP_DCP()
+#define OP_ISB()
+#define OP_SLO()
+#define OP_RLA()
+#define OP_SRE()
+#define OP_RRA()
+#endif
+
+
+// Switch core run loop, in_run is false when called from nescpu_clock which leaves run state alone
+static inline uint32_t run_switch(nescpu_t* c, uint32_t cycle_budget, bool in_run)
+{
+    uint32_t done = 0, n;
+    nesbus_t *bus;
+    uint16_t pc, ea, v, t, from;
+    uint8_t a, x, y, sp, p, op, cyc, cycles, status;
+    bool cross;
+    idle_loop_t loop;
+    if (0 == c)
+        return cycle_budget;
+    if (in_run)
+        c->run_break = false;
+    bus = c->bus;
+    pc = c->PC; a = c->A; x = c->X; y = c->Y; sp = c->SP; p = c->STATUS;
+    cycles = c->cycles;
+    while (done < cycle_budget)
+    {
+        if (cycles == 0)
+        {
+            if (c->jammed)
+            {
+                // JAMed CPU does nothing for the rest of the run
+                PROFILE_COUNT(c, jam_cycles, cycle_budget - done);
+                done = cycle_budget;
+                break;
+            }
+            if (in_run)
+                c->run_cycles = done;
+            status = p;
+            from = pc;
+            op = RD(pc);
+            p |= FLAG_U;
+            ++pc;
+            cyc = (uint8_t)cycletable[op];
+            cross = false;
+            switch (op)
+            {
+            case 0x00: OP_BRK(); break;
+            case 0x01: AM_INDX(); OP_ORA(); break;
+            case 0x02: OP_NOP(); break;
+            case 0x03: AM_INDX(); OP_SLO(); break;
+            case 0x04: AM_ZP(); OP_NOP(); break;
+            case 0x05: AM_ZP(); OP_ORA(); break;
+            case 0x06: AM_ZP(); OP_ASL(); break;
+            case 0x07: AM_ZP(); OP_SLO(); break;
+            case 0x08: OP_PHP(); break;
+            case 0x09: AM_IMM(); OP_ORA(); break;
+            case 0x0A: OP_ASL_A(); break;
+            case 0x0B: AM_IMM(); OP_NOP(); break;
+            case 0x0C: AM_ABSO(); OP_NOP(); break;
+            case 0x0D: AM_ABSO(); OP_ORA(); break;
+            case 0x0E: AM_ABSO(); OP_ASL(); break;
+            case 0x0F: AM_ABSO(); OP_SLO(); break;
+            case 0x10: OP_BPL(); break;
+            case 0x11: AM_INDY(); OP_ORA(); break;
+            case 0x12: OP_NOP(); break;
+            case 0x13: AM_INDY(); OP_SLO(); break;
+            case 0x14: AM_ZPX(); OP_NOP(); break;
+            case 0x15: AM_ZPX(); OP_ORA(); break;
+            case 0x16: AM_ZPX(); OP_ASL(); break;
+            case 0x17: AM_ZPX(); OP_SLO(); break;
+            case 0x18: OP_CLC(); break;
+            case 0x19: AM_ABSY(); OP_ORA(); break;
+            case 0x1A: OP_NOP(); break;
+            case 0x1B: AM_ABSY(); OP_SLO(); break;
+            case 0x1C: AM_ABSX(); OP_NOP_X(); break;
+            case 0x1D: AM_ABSX(); OP_ORA(); break;
+            case 0x1E: AM_ABSX(); OP_ASL(); break;
+            case 0x1F: AM_ABSX(); OP_SLO(); break;
+            case 0x20: AM_ABSO(); OP_JSR(); break;
+            case 0x21: AM_INDX(); OP_AND(); break;
+            case 0x22: OP_NOP(); break;
+            case 0x23: AM_INDX(); OP_RLA(); break;
+            case 0x24: AM_ZP(); OP_BIT(); break;
+            case 0x25: AM_ZP(); OP_AND(); break;
+            case 0x26: AM_ZP(); OP_ROL(); break;
+            case 0x27: AM_ZP(); OP_RLA(); break;
+            case 0x28: OP_PLP(); break;
+            case 0x29: AM_IMM(); OP_AND(); break;
+            case 0x2A: OP_ROL_A(); break;
+            case 0x2B: AM_IMM(); OP_NOP(); break;
+            case 0x2C: AM_ABSO(); OP_BIT(); break;
+            case 0x2D: AM_ABSO(); OP_AND(); break;
+            case 0x2E: AM_ABSO(); OP_ROL(); break;
+            case 0x2F: AM_ABSO(); OP_RLA(); break;
+            case 0x30: OP_BMI(); break;
+            case 0x31: AM_INDY(); OP_AND(); break;
+            case 0x32: OP_NOP(); break;
+            case 0x33: AM_INDY(); OP_RLA(); break;
+            case 0x34: AM_ZPX(); OP_NOP(); break;
+            case 0x35: AM_ZPX(); OP_AND(); break;
+            case 0x36: AM_ZPX(); OP_ROL(); break;
+            case 0x37: AM_ZPX(); OP_RLA(); break;
+            case 0x38: OP_SEC(); break;
+            case 0x39: AM_ABSY(); OP_AND(); break;
+            case 0x3A: OP_NOP(); break;
+            case 0x3B: AM_ABSY(); OP_RLA(); break;
+            case 0x3C: AM_ABSX(); OP_NOP_X(); break;
+            case 0x3D: AM_ABSX(); OP_AND(); break;
+            case 0x3E: AM_ABSX(); OP_ROL(); break;
+            case 0x3F: AM_ABSX(); OP_RLA(); break;
+            case 0x40: OP_RTI(); break;
+            case 0x41: AM_INDX(); OP_EOR(); break;
+            case 0x42: OP_NOP(); break;
+            case 0x43: AM_INDX(); OP_SRE(); break;
+            case 0x44: AM_ZP(); OP_NOP(); break;
+            case 0x45: AM_ZP(); OP_EOR(); break;
+            case 0x46: AM_ZP(); OP_LSR(); break;
+            case 0x47: AM_ZP(); OP_SRE(); break;
+            case 0x48: OP_PHA(); break;
+            case 0x49: AM_IMM(); OP_EOR(); break;
+            case 0x4A: OP_LSR_A(); break;
+            case 0x4B: AM_IMM(); OP_NOP(); break;
+            case 0x4C: AM_ABSO(); OP_JMP(); break;
+            case 0x4D: AM_ABSO(); OP_EOR(); break;
+            case 0x4E: AM_ABSO(); OP_LSR(); break;
+            case 0x4F: AM_ABSO(); OP_SRE(); break;
+            case 0x50: OP_BVC(); break;
+            case 0x51: AM_INDY(); OP_EOR(); break;
+            case 0x52: OP_NOP(); break;
+            case 0x53: AM_INDY(); OP_SRE(); break;
+            case 0x54: AM_ZPX(); OP_NOP(); break;
+            case 0x55: AM_ZPX(); OP_EOR(); break;
+            case 0x56: AM_ZPX(); OP_LSR(); break;
+            case 0x57: AM_ZPX(); OP_SRE(); break;
+            case 0x58: OP_CLI(); break;
+            case 0x59: AM_ABSY(); OP_EOR(); break;
+            case 0x5A: OP_NOP(); break;
+            case 0x5B: AM_ABSY(); OP_SRE(); break;
+            case 0x5C: AM_ABSX(); OP_NOP_X(); break;
+            case 0x5D: AM_ABSX(); OP_EOR(); break;
+            case 0x5E: AM_ABSX(); OP_LSR(); break;
+            case 0x5F: AM_ABSX(); OP_SRE(); break;
+            case 0x60: OP_RTS(); break;
+            case 0x61: AM_INDX(); OP_ADC(); break;
+            case 0x62: OP_NOP(); break;
+            case 0x63: AM_INDX(); OP_RRA(); break;
+            case 0x64: AM_ZP(); OP_NOP(); break;
+            case 0x65: AM_ZP(); OP_ADC(); break;
+            case 0x66: AM_ZP(); OP_ROR(); break;
+            case 0x67: AM_ZP(); OP_RRA(); break;
+            case 0x68: OP_PLA(); break;
+            case 0x69: AM_IMM(); OP_ADC(); break;
+            case 0x6A: OP_ROR_A(); break;
+            case 0x6B: AM_IMM(); OP_NOP(); break;
+            case 0x6C: AM_IND(); OP_JMP(); break;
+            case 0x6D: AM_ABSO(); OP_ADC(); break;
+            case 0x6E: AM_ABSO(); OP_ROR(); break;
+            case 0x6F: AM_ABSO(); OP_RRA(); break;
+            case 0x70: OP_BVS(); break;
+            case 0x71: AM_INDY(); OP_ADC(); break;
+            case 0x72: OP_NOP(); break;
+            case 0x73: AM_INDY(); OP_RRA(); break;
+            case 0x74: AM_ZPX(); OP_NOP(); break;
+            case 0x75: AM_ZPX(); OP_ADC(); break;
+            case 0x76: AM_ZPX(); OP_ROR(); break;
+            case 0x77: AM_ZPX(); OP_RRA(); break;
+            case 0x78: OP_SEI(); break;
+            case 0x79: AM_ABSY(); OP_ADC(); break;
+            case 0x7A: OP_NOP(); break;
+            case 0x7B: AM_ABSY(); OP_RRA(); break;
+            case 0x7C: AM_ABSX(); OP_NOP_X(); break;
+            case 0x7D: AM_ABSX(); OP_ADC(); break;
+            case 0x7E: AM_ABSX(); OP_ROR(); break;
+            case 0x7F: AM_ABSX(); OP_RRA(); break;
+            case 0x80: AM_IMM(); OP_NOP(); break;
+            case 0x81: AM_INDX(); OP_STA(); break;
+            case 0x82: AM_IMM(); OP_NOP(); break;
+            case 0x83: AM_INDX(); OP_SAX(); break;
+            case 0x84: AM_ZP(); OP_STY(); break;
+            case 0x85: AM_ZP(); OP_STA(); break;
+            case 0x86: AM_ZP(); OP_STX(); break;
+            case 0x87: AM_ZP(); OP_SAX(); break;
+            case 0x88: OP_DEY(); break;
+            case 0x89: AM_IMM(); OP_NOP(); break;
+            case 0x8A: OP_TXA(); break;
+            case 0x8B: AM_IMM(); OP_NOP(); break;
+            case 0x8C: AM_ABSO(); OP_STY(); break;
+            case 0x8D: AM_ABSO(); OP_STA(); break;
+            case 0x8E: AM_ABSO(); OP_STX(); break;
+            case 0x8F: AM_ABSO(); OP_SAX(); break;
+            case 0x90: OP_BCC(); break;
+            case 0x91: AM_INDY(); OP_STA(); break;
+            case 0x92: OP_NOP(); break;
+            case 0x93: AM_INDY(); OP_NOP(); break;
+            case 0x94: AM_ZPX(); OP_STY(); break;
+            case 0x95: AM_ZPX(); OP_STA(); break;
+            case 0x96: AM_ZPY(); OP_STX(); break;
+            case 0x97: AM_ZPY(); OP_SAX(); break;
+            case 0x98: OP_TYA(); break;
+            case 0x99: AM_ABSY(); OP_STA(); break;
+            case 0x9A: OP_TXS(); break;
+            case 0x9B: AM_ABSY(); OP_NOP(); break;
+            case 0x9C: AM_ABSX(); OP_NOP(); break;
+            case 0x9D: AM_ABSX(); OP_STA(); break;
+            case 0x9E: AM_ABSY(); OP_NOP(); break;
+            case 0x9F: AM_ABSY(); OP_NOP(); break;
+            case 0xA0: AM_IMM(); OP_LDY(); break;
+            case 0xA1: AM_INDX(); OP_LDA(); break;
+            case 0xA2: AM_IMM(); OP_LDX(); break;
+            case 0xA3: AM_INDX(); OP_LAX(); break;
+            case 0xA4: AM_ZP(); OP_LDY(); break;
+            case 0xA5: AM_ZP(); OP_LDA(); break;
+            case 0xA6: AM_ZP(); OP_LDX(); break;
+            case 0xA7: AM_ZP(); OP_LAX(); break;
+            case 0xA8: OP_TAY(); break;
+            case 0xA9: AM_IMM(); OP_LDA(); break;
+            case 0xAA: OP_TAX(); break;
+            case 0xAB: AM_IMM(); OP_NOP(); break;
+            case 0xAC: AM_ABSO(); OP_LDY(); break;
+            case 0xAD: AM_ABSO(); OP_LDA(); break;
+            case 0xAE: AM_ABSO(); OP_LDX(); break;
+            case 0xAF: AM_ABSO(); OP_LAX(); break;
+            case 0xB0: OP_BCS(); break;
+            case 0xB1: AM_INDY(); OP_LDA(); break;
+            case 0xB2: OP_NOP(); break;
+            case 0xB3: AM_INDY(); OP_LAX(); break;
+            case 0xB4: AM_ZPX(); OP_LDY(); break;
+            case 0xB5: AM_ZPX(); OP_LDA(); break;
+            case 0xB6: AM_ZPY(); OP_LDX(); break;
+            case 0xB7: AM_ZPY(); OP_LAX(); break;
+            case 0xB8: OP_CLV(); break;
+            case 0xB9: AM_ABSY(); OP_LDA(); break;
+            case 0xBA: OP_TSX(); break;
+            case 0xBB: AM_ABSY(); OP_LAX(); break;
+            case 0xBC: AM_ABSX(); OP_LDY(); break;
+            case 0xBD: AM_ABSX(); OP_LDA(); break;
+            case 0xBE: AM_ABSY(); OP_LDX(); break;
+            case 0xBF: AM_ABSY(); OP_LAX(); break;
+            case 0xC0: AM_IMM(); OP_CPY(); break;
+            case 0xC1: AM_INDX(); OP_CMP(); break;
+            case 0xC2: AM_IMM(); OP_NOP(); break;
+            case 0xC3: AM_INDX(); OP_DCP(); break;
+            case 0xC4: AM_ZP(); OP_CPY(); break;
+            case 0xC5: AM_ZP(); OP_CMP(); break;
+            case 0xC6: AM_ZP(); OP_DEC(); break;
+            case 0xC7: AM_ZP(); OP_DCP(); break;
+            case 0xC8: OP_INY(); break;
+            case 0xC9: AM_IMM(); OP_CMP(); break;
+            case 0xCA: OP_DEX(); break;
+            case 0xCB: AM_IMM(); OP_NOP(); break;
+            case 0xCC: AM_ABSO(); OP_CPY(); break;
+            case 0xCD: AM_ABSO(); OP_CMP(); break;
+            case 0xCE: AM_ABSO(); OP_DEC(); break;
+            case 0xCF: AM_ABSO(); OP_DCP(); break;
+            case 0xD0: OP_BNE(); break;
+            case 0xD1: AM_INDY(); OP_CMP(); break;
+            case 0xD2: OP_NOP(); break;
+            case 0xD3: AM_INDY(); OP_DCP(); break;
+            case 0xD4: AM_ZPX(); OP_NOP(); break;
+            case 0xD5: AM_ZPX(); OP_CMP(); break;
+            case 0xD6: AM_ZPX(); OP_DEC(); break;
+            case 0xD7: AM_ZPX(); OP_DCP(); break;
+            case 0xD8: OP_CLD(); break;
+            case 0xD9: AM_ABSY(); OP_CMP(); break;
+            case 0xDA: OP_NOP(); break;
+            case 0xDB: AM_ABSY(); OP_DCP(); break;
+            case 0xDC: AM_ABSX(); OP_NOP_X(); break;
+            case 0xDD: AM_ABSX(); OP_CMP(); break;
+            case 0xDE: AM_ABSX(); OP_DEC(); break;
+            case 0xDF: AM_ABSX(); OP_DCP(); break;
+            case 0xE0: AM_IMM(); OP_CPX(); break;
+            case 0xE1: AM_INDX(); OP_SBC(); break;
+            case 0xE2: AM_IMM(); OP_NOP(); break;
+            case 0xE3: AM_INDX(); OP_ISB(); break;
+            case 0xE4: AM_ZP(); OP_CPX(); break;
+            case 0xE5: AM_ZP(); OP_SBC(); break;
+            case 0xE6: AM_ZP(); OP_INC(); break;
+            case 0xE7: AM_ZP(); OP_ISB(); break;
+            case 0xE8: OP_INX(); break;
+            case 0xE9: AM_IMM(); OP_SBC(); break;
+            case 0xEA: OP_NOP(); break;
+            case 0xEB: AM_IMM(); OP_SBC(); break;
+            case 0xEC: AM_ABSO(); OP_CPX(); break;
+            case 0xED: AM_ABSO(); OP_SBC(); break;
+            case 0xEE: AM_ABSO(); OP_INC(); break;
+            case 0xEF: AM_ABSO(); OP_ISB(); break;
+            case 0xF0: OP_BEQ(); break;
+            case 0xF1: AM_INDY(); OP_SBC(); break;
+            case 0xF2: OP_JAM(); break;
+            case 0xF3: AM_INDY(); OP_ISB(); break;
+            case 0xF4: AM_ZPX(); OP_NOP(); break;
+            case 0xF5: AM_ZPX(); OP_SBC(); break;
+            case 0xF6: AM_ZPX(); OP_INC(); break;
+            case 0xF7: AM_ZPX(); OP_ISB(); break;
+            case 0xF8: OP_SED(); break;
+            case 0xF9: AM_ABSY(); OP_SBC(); break;
+            case 0xFA: OP_NOP(); break;
+            case 0xFB: AM_ABSY(); OP_ISB(); break;
+            case 0xFC: AM_ABSX(); OP_NOP_X(); break;
+            case 0xFD: AM_ABSX(); OP_SBC(); break;
+            case 0xFE: AM_ABSX(); OP_INC(); break;
+            case 0xFF: AM_ABSX(); OP_ISB(); break;
+            }
+            p |= FLAG_U;
+            PROFILE_INSTRUCTION(c, from, op, cyc);
+            cycles = cyc - 1;
+            ++done;
+            if (in_run && (status & FLAG_I) && !(p & FLAG_I))
+                c->run_break = true;    // pending IRQ may be taken now
+            if (c->run_break)
+                break;
+            // backward jump into idle loop, skip whole iterations fitting in the rest of the run
+            if (in_run && (pc <= from) && (cycle_budget - done > cycles) &&
+                find_idle_loop(bus, from, pc, op, cyc, a, p, &loop))
+            {
+                n = (cycle_budget - done - cycles) / loop.period;
+                if (n > 0)
+                {
+                    apply_idle_loop(&loop, &a, &x, &y, &p);
+                    done += n * loop.period;
+                    PROFILE_COUNT(c, idle_cycles, n * loop.period);
+                }
+            }
+        }
+        else
+        {
+            // finish cycles of current instruction
+            n = cycle_budget - done;
+            if (n > cycles)
+                n = cycles;
+            cycles -= (uint8_t)n;
+            done += n;
+        }
+    }
+    c->PC = pc; c->A = a; c->X = x; c->Y = y; c->SP = sp; c->STATUS = p;
+    c->cycles = cycles;
+    return done;
+}
+
+
+// Run CPU for up to cycle_budget cycles, same behavior as the table core nescpu_run below
+uint32_t nescpu_run(nescpu_t* c, uint32_t cycle_budget)
+{
+    return run_switch(c, cycle_budget, true);
+}
+
+#else
+
+
+// Run CPU for up to cycle_budget cycles, same as calling nescpu_clock cycle_budget times.
+// Instruction is executed in its first cycle, c->run_cycles tells which cycle of the run it is.
+// Run stops early (right after the executing cycle) if the instruction clears I flag or
+// nescpu_break_run() is called during the instruction (e.g. by a bus device).
+// A JAMed CPU or one spinning in an idle loop is fast forwarded, not executed cycle by cycle.
+// Returns cycles consumed.
+uint32_t nescpu_run(nescpu_t* c, uint32_t cycle_budget)
+{
+    uint32_t done = 0, n;
+    uint16_t from;
+    uint8_t status;
+    idle_loop_t loop;
+    if (0 == c)
+        return cycle_budget;
+    c->run_break = false;
+    while (done < cycle_budget)
+    {
+        if (c->cycles == 0)
+        {
+            if (c->jammed)
+            {
+                // JAMed CPU does nothing for the rest of the run
+                PROFILE_COUNT(c, jam_cycles, cycle_budget - done);
+                done = cycle_budget;
+                break;
+            }
+            c->run_cycles = done;
+            status = c->STATUS;
+            from = c->PC;
+            execute(c);
+            --(c->cycles);
+            ++done;
+            if ((status & FLAG_I) && !(c->STATUS & FLAG_I))
+                c->run_break = true;    // pending IRQ may be taken now
+            if (c->run_break)
+                break;
+            // backward jump into idle loop, skip whole iterations fitting in the rest of the run
+            if ((c->PC <= from) && (cycle_budget - done > c->cycles) &&
+                find_idle_loop(c->bus, from, c->PC, c->opcode, c->cycles + 1, c->A, c->STATUS, &loop))
+            {
+                n = (cycle_budget - done - c->cycles) / loop.period;
+                if (n > 0)
+                {
+                    apply_idle_loop(&loop, &(c->A), &(c->X), &(c->Y), &(c->STATUS));
+                    done += n * loop.period;
+                    PROFILE_COUNT(c, idle_cycles, n * loop.period);
+                }
+            }
+        }
+        else
+        {
+            // finish cycles of current instruction
+            n = cycle_budget - done;
+            if (n > c->cycles)
+                n = c->cycles;
+            c->cycles -= (uint8_t)n;
+            done += n;
+        }
+    }
+    return done;
+}
+
+
+#endif  // NESCPU_SWITCH_CORE
+
+
+// Called during nescpu_run, stop the run after current instruction
+void nescpu_break_run(nescpu_t* c)
+{
+    if (0 == c)
+        return;
+    c->run_break = true;
+}
+
+
 bool nescpu_is_completed(nescpu_t* c)
 {
     if (0 == c)
@@ -1358,6 +2103,14 @@ bool nescpu_is_jammed(nescpu_t* c)
 }
 
 
+bool nescpu_irq_inhibited(nescpu_t* c)
+{
+    if (0 == c)
+        return true;
+    return ((c->STATUS & FLAG_I) == FLAG_I);
+}
+
+
 void nescpu_unjam(nescpu_t* c)
 {
     if (0 == c)
@@ -1374,6 +2127,7 @@ void nescpu_skip_cycles(nescpu_t* c, int cycles)
     if (0 == c)
         return;
     c->cycles += cycles;
+    PROFILE_COUNT(c, stall_cycles, cycles);
 }
 
 
@@ -1431,3 +2185,181 @@ void nescpu_set_sp(nescpu_t* c, uint8_t sp)
         return;
     c->SP = sp;
 }
+
+
+#ifdef NESCPU_PROFILE
+
+void nescpu_profile_reset(nescpu_t* c)
+{
+    if ((0 == c) || (0 == c->profile))
+        return;
+    memset(c->profile, 0, sizeof(nescpu_profile_t));
+    if (c->bus)
+    {
+        memset(c->bus->handler_reads, 0, sizeof(c->bus->handler_reads));
+        memset(c->bus->handler_writes, 0, sizeof(c->bus->handler_writes));
+    }
+}
+
+
+// Following instructions are counted as phase (NESCPU_PROFILE_INIT/NESCPU_PROFILE_PLAY)
+void nescpu_profile_phase(nescpu_t* c, int phase)
+{
+    if ((0 == c) || (0 == c->profile) || (phase < 0) || (phase >= NESCPU_PROFILE_PHASES))
+        return;
+    c->profile->phase = phase;
+}
+
+
+const nescpu_profile_t* nescpu_get_profile(nescpu_t* c)
+{
+    if (0 == c)
+        return 0;
+    return c->profile;
+}
+
+
+// opcode or address with its counters, for sorting
+typedef struct profile_entry_s
+{
+    uint16_t key;
+    uint64_t count, cycles;
+} profile_entry_t;
+
+
+// most cycles first, then by key
+static int compare_profile_entry(const void* a, const void* b)
+{
+    const profile_entry_t* ea = (const profile_entry_t*)a;
+    const profile_entry_t* eb = (const profile_entry_t*)b;
+    if (ea->cycles != eb->cycles)
+        return (ea->cycles < eb->cycles) ? 1 : -1;
+    return (int)ea->key - (int)eb->key;
+}
+
+
+// Tags of handlers mapped to a page, separated by '/'
+static void handler_tags(char* buf, size_t size, const nesbus_t* bus, int page, bool write)
+{
+    const nesbus_page_t* p = write ? &(bus->write_pages[page]) : &(bus->read_pages[page]);
+    const char *tag, *prev = "";
+    size_t len = 0;
+    buf[0] = 0;
+    for (int i = 0; (i < p->count) && (len < size); ++i)
+    {
+        tag = write ? bus->write_table[p->index[i]].tag : bus->read_table[p->index[i]].tag;
+        if ((0 == tag) || (0 == strcmp(tag, prev)))
+            continue;   // one handler can be added for several ranges
+        len += snprintf(buf + len, size - len, "%s%s", len ? "/" : "", tag);
+        prev = tag;
+    }
+}
+
+
+// Write flat profile to CSV file: cycles per phase, wait and interrupt counters, bus accesses
+// dispatched to handlers (total and per page), then opcodes and addresses (max_pc hottest, 0 for
+// all) sorted by cycles. Percentages are of all cycles counted.
+bool nescpu_profile_export(nescpu_t* c, const char* fn, int max_pc)
+{
+    const nescpu_profile_t* prof;
+    profile_entry_t* entries = 0;
+    FILE* fd = 0;
+    double total;
+    int i, n;
+    bool r = false;
+    do
+    {
+        if ((0 == c) || (0 == c->profile) || (0 == fn))
+            break;
+        prof = c->profile;
+        entries = malloc(65536 * sizeof(profile_entry_t));
+        if (0 == entries)
+            break;
+        fd = fopen(fn, "w");
+        if (0 == fd)
+            break;
+        total = (double)(prof->phase_cycles[NESCPU_PROFILE_INIT] + prof->phase_cycles[NESCPU_PROFILE_PLAY] +
+                         prof->jam_cycles + prof->idle_cycles + prof->stall_cycles);
+        if (total <= 0)
+            total = 1;
+        fprintf(fd, "section,id,name,count,cycles,percent\n");
+        fprintf(fd, "phase,INIT,,%llu,%llu,%.2f\n", (unsigned long long)prof->phase_count[NESCPU_PROFILE_INIT],
+            (unsigned long long)prof->phase_cycles[NESCPU_PROFILE_INIT], prof->phase_cycles[NESCPU_PROFILE_INIT] * 100.0 / total);
+        fprintf(fd, "phase,PLAY,,%llu,%llu,%.2f\n", (unsigned long long)prof->phase_count[NESCPU_PROFILE_PLAY],
+            (unsigned long long)prof->phase_cycles[NESCPU_PROFILE_PLAY], prof->phase_cycles[NESCPU_PROFILE_PLAY] * 100.0 / total);
+        fprintf(fd, "wait,JAM,,,%llu,%.2f\n", (unsigned long long)prof->jam_cycles, prof->jam_cycles * 100.0 / total);
+        fprintf(fd, "wait,IDLE,,,%llu,%.2f\n", (unsigned long long)prof->idle_cycles, prof->idle_cycles * 100.0 / total);
+        fprintf(fd, "wait,DMC_STALL,,,%llu,%.2f\n", (unsigned long long)prof->stall_cycles, prof->stall_cycles * 100.0 / total);
+        fprintf(fd, "interrupt,IRQ,,%llu,,\n", (unsigned long long)prof->irq_count);
+        fprintf(fd, "interrupt,NMI,,%llu,,\n", (unsigned long long)prof->nmi_count);
+        // bus accesses not served by direct memory pages, e.g. APU registers, bank switching
+        if (c->bus)
+        {
+            const nesbus_t* bus = c->bus;
+            uint64_t reads = 0, writes = 0;
+            char tags[64];
+            for (i = 0; i < NESBUS_PAGE_COUNT; ++i)
+            {
+                reads += bus->handler_reads[i];
+                writes += bus->handler_writes[i];
+            }
+            fprintf(fd, "bus,HANDLER_READ,,%llu,,\n", (unsigned long long)reads);
+            fprintf(fd, "bus,HANDLER_WRITE,,%llu,,\n", (unsigned long long)writes);
+            for (i = 0; i < NESBUS_PAGE_COUNT; ++i)
+            {
+                if (bus->handler_reads[i])
+                {
+                    handler_tags(tags, sizeof(tags), bus, i, false);
+                    fprintf(fd, "handler_read,$%04X,%s,%llu,,\n", i * NESBUS_PAGE_SIZE, tags, (unsigned long long)bus->handler_reads[i]);
+                }
+                if (bus->handler_writes[i])
+                {
+                    handler_tags(tags, sizeof(tags), bus, i, true);
+                    fprintf(fd, "handler_write,$%04X,%s,%llu,,\n", i * NESBUS_PAGE_SIZE, tags, (unsigned long long)bus->handler_writes[i]);
+                }
+            }
+        }
+        // opcodes
+        n = 0;
+        for (i = 0; i < 256; ++i)
+        {
+            if (0 == prof->op_count[i])
+                continue;
+            entries[n].key = (uint16_t)i;
+            entries[n].count = prof->op_count[i];
+            entries[n].cycles = prof->op_cycles[i];
+            ++n;
+        }
+        qsort(entries, n, sizeof(profile_entry_t), compare_profile_entry);
+        for (i = 0; i < n; ++i)
+        {
+            fprintf(fd, "opcode,$%02X,%s,%llu,%llu,%.2f\n", entries[i].key, op_names[entries[i].key],
+                (unsigned long long)entries[i].count, (unsigned long long)entries[i].cycles, entries[i].cycles * 100.0 / total);
+        }
+        // addresses
+        n = 0;
+        for (i = 0; i < 65536; ++i)
+        {
+            if (0 == prof->pc_count[i])
+                continue;
+            entries[n].key = (uint16_t)i;
+            entries[n].count = prof->pc_count[i];
+            entries[n].cycles = prof->pc_cycles[i];
+            ++n;
+        }
+        qsort(entries, n, sizeof(profile_entry_t), compare_profile_entry);
+        if ((max_pc > 0) && (n > max_pc))
+            n = max_pc;
+        for (i = 0; i < n; ++i)
+        {
+            fprintf(fd, "pc,$%04X,%s,%llu,%llu,%.2f\n", entries[i].key, op_names[prof->pc_op[entries[i].key]],
+                (unsigned long long)entries[i].count, (unsigned long long)entries[i].cycles, entries[i].cycles * 100.0 / total);
+        }
+        r = !ferror(fd);
+    } while (0);
+    if (fd) fclose(fd);
+    if (entries) free(entries);
+    return r;
+}
+
+#endif  // NESCPU_PROFILE
@@ -9,27 +9,60 @@ extern "C" {
 
 #include "nesbus.h"
 
+// Execution profile phases, set by the player
+#define NESCPU_PROFILE_INIT     0
+#define NESCPU_PROFILE_PLAY     1
+#define NESCPU_PROFILE_PHASES   2
+
+#ifdef NESCPU_PROFILE
+// Execution profile, collected if NESCPU_PROFILE is defined
+typedef struct nescpu_profile_s
+{
+    uint64_t op_count[256];         // instructions executed per opcode
+    uint64_t op_cycles[256];        // cycles per opcode, including page cross and branch penalties
+    uint64_t pc_count[65536];       // instructions executed per address
+    uint64_t pc_cycles[65536];      // cycles per address
+    uint8_t pc_op[65536];           // last opcode executed at address
+    uint64_t phase_count[NESCPU_PROFILE_PHASES];    // instructions executed in INIT and PLAY
+    uint64_t phase_cycles[NESCPU_PROFILE_PHASES];   // cycles of instructions executed in INIT and PLAY
+    uint64_t jam_cycles;            // JAMed, e.g. PLAY returned and waiting for next call
+    uint64_t idle_cycles;           // fast forwarded in idle loops
+    uint64_t stall_cycles;          // added by nescpu_skip_cycles (DMC DMA)
+    uint64_t irq_count, nmi_count;  // interrupts taken
+    int phase;
+} nescpu_profile_t;
+#endif
+
 typedef struct nescpu_s
 {
     uint16_t PC;                        // register
     uint8_t SP, A, X, Y, STATUS;        // register
-    nesbus_t* bus;                      // Bus
+    nesbus_t* bus;                      // Bus, host side, kept by nescpu_copy_state
     uint16_t abs_addr, rel_addr;        // calculated address
     uint8_t opcode;                     // opcode
     bool add_cycle_op, add_cycle_addr;  // if the instruction will add additional cycle
     bool jammed;                        // if received JAM instruction
     uint8_t cycles;                     // keep track how many cycles left for current instruction
+    uint32_t run_cycles;                // cycles consumed by nescpu_run before current instruction
+    bool run_break;                     // stop nescpu_run after current instruction
+#ifdef NESCPU_PROFILE
+    nescpu_profile_t* profile;          // execution profile, host side, kept by nescpu_copy_state
+#endif
 } nescpu_t;
 
 nescpu_t * nescpu_create();
 void nescpu_destroy(nescpu_t *ctx);
 void nescpu_attach_bus(nescpu_t* ctx, nesbus_t* bus);
+void nescpu_copy_state(nescpu_t* ctx, const nescpu_t* src);
 void nescpu_reset(nescpu_t* ctx, bool reset_to_fffc);
 void nescpu_irq(nescpu_t* ctx);
 void nescpu_nmi(nescpu_t* ctx);
 bool nescpu_clock(nescpu_t* ctx);
+uint32_t nescpu_run(nescpu_t* ctx, uint32_t cycle_budget);
+void nescpu_break_run(nescpu_t* ctx);
 bool nescpu_is_completed(nescpu_t* ctx);
 bool nescpu_is_jammed(nescpu_t* ctx);
+bool nescpu_irq_inhibited(nescpu_t* ctx);
 void nescpu_unjam(nescpu_t* ctx);
 void nescpu_dump(nescpu_t* ctx);
 void nescpu_set_pc(nescpu_t* ctx, uint16_t pc);
@@ -40,6 +73,18 @@ void nescpu_set_status(nescpu_t* ctx, uint8_t status);
 void nescpu_set_sp(nescpu_t* ctx, uint8_t sp);
 void nescpu_skip_cycles(nescpu_t* ctx, int cycles);
 
+#ifdef NESCPU_PROFILE
+void nescpu_profile_reset(nescpu_t* ctx);
+void nescpu_profile_phase(nescpu_t* ctx, int phase);
+const nescpu_profile_t* nescpu_get_profile(nescpu_t* ctx);
+bool nescpu_profile_export(nescpu_t* ctx, const char* fn, int max_pc);
+#else
+#define nescpu_profile_reset(x) ((void)(x))
+#define nescpu_profile_phase(x, p) ((void)(x))
+#define nescpu_get_profile(x) ((void)(x), (const void*)0)
+#define nescpu_profile_export(x, fn, n) ((void)(x), false)
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,4 +1,8 @@
 #include "nesfloat.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+# include <emmintrin.h>
+# define NESFLOAT_SSE2
+#endif
 
 
 // Convert Fixed point number to Int16 samples
@@ -10,4 +14,23 @@ int16_t nesfloat_to_sample(nesfloat_t x)
     else if (t < -32768) s = -32768;
     else s = t;
     return s;
-}
\ No newline at end of file
+}
+
+void nesfloat_to_samples(const nesfloat_t* x, int16_t* s, int count)
+{
+    int i = 0;
+#ifdef NESFLOAT_SSE2
+    // 8 samples per loop, signed saturating pack does the clamping
+    const __m128i bias = _mm_set1_epi32(32768);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(x + i + 4));
+        lo = _mm_sub_epi32(_mm_srai_epi32(lo, NESFLOAT_FRACTIONS - 16), bias);
+        hi = _mm_sub_epi32(_mm_srai_epi32(hi, NESFLOAT_FRACTIONS - 16), bias);
+        _mm_storeu_si128((__m128i*)(s + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < count; ++i)
+        s[i] = nesfloat_to_sample(x[i]);
+}
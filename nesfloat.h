@@ -20,6 +20,8 @@ typedef int32_t nesfloat_t;
 
 
 int16_t nesfloat_to_sample(nesfloat_t x);
+// Block version of nesfloat_to_sample
+void nesfloat_to_samples(const nesfloat_t* x, int16_t* s, int count);
 
 
 #ifdef __cplusplus
@@ -10,65 +10,19 @@
 #define EMU_RAM2_BASE 0x6000
 #define EMU_RAM2_SIZE 8192
 
+#define NSF_BANK_SIZE 4096
+
 #define APU_CLOCK_NTSC 1789773
 #define APU_CLOCK_PAL  1662607
 
+// Output sample clock, blip_buf time_bits
+#define SAMPLE_CLOCK_BITS 52
+#define SAMPLE_CLOCK_UNIT ((uint64_t)1 << SAMPLE_CLOCK_BITS)
+
 // Default slient detection time (2000ms)
 #define SILENT_DETECTION_MS  2000
 
 
-//
-// Emulator RAM read/write handlers
-//
-
-static bool ram1_read(uint16_t addr, uint8_t* rval, void* cookie, uint8_t owner)
-{
-    nsf_t* c = (nsf_t*)cookie;
-    if (0 == c)
-        return false;
-    if (0 == c->ram1)
-        return false;
-    *rval = c->ram1[addr - EMU_RAM1_BASE];
-    return true;
-}
-
-
-static bool ram1_write(uint16_t addr, uint8_t val, void* cookie)
-{
-    nsf_t* c = (nsf_t*)cookie;
-    if (0 == c)
-        return false;
-    if (0 == c->ram1)
-        return false;
-    c->ram1[addr - EMU_RAM1_BASE] = val;
-    return true;
-}
-
-
-static bool ram2_read(uint16_t addr, uint8_t* rval, void* cookie, uint8_t owner)
-{
-    nsf_t* c = (nsf_t*)cookie;
-    if (0 == c)
-        return false;
-    if (0 == c->ram2)
-        return false;
-    *rval = c->ram2[addr - EMU_RAM2_BASE];
-    return true;
-}
-
-
-static bool ram2_write(uint16_t addr, uint8_t val, void* cookie)
-{
-    nsf_t* c = (nsf_t*)cookie;
-    if (0 == c)
-        return false;
-    if (0 == c->ram2)
-        return false;
-    c->ram2[addr - EMU_RAM2_BASE] = val;
-    return true;
-}
-
-
 //
 // Emulator ROM (NSF) read handlers
 //
@@ -88,6 +42,10 @@ static bool rom_read_nonbankswitched(uint16_t addr, uint8_t* rval, void* cookie,
 }
 
 
+// Mapped (read only) to banks outside of preloaded image
+static uint8_t rom_empty_bank[NSF_BANK_SIZE];
+
+
 static bool ram_write_bankswitch_reg(uint16_t addr, uint8_t val, void* cookie)
 {
     nsf_t* c = (nsf_t*)cookie;
@@ -108,7 +66,15 @@ static bool ram_write_bankswitch_reg(uint16_t addr, uint8_t val, void* cookie)
     // (val << 12) converts bank number into bank starting address
     // c->bank[0] is the offset to music data that will to be loaded to page 8 (0x8000), etc...
     int page = addr & 0x0F; // 5FF8 -> Page 8, ... etc
+    c->bank_reg[page - 8] = val;
     c->bank[page - 8] = ((int32_t)val << 12) - (c->header->load_addr & 0x0fff) ;
+    if (c->image)
+    {
+        // Preloaded image is already padded, bank n starts at (n << 12). Banks beyond the image read as 0
+        uint32_t offset = (uint32_t)val << 12;
+        c->bank_ptr[page - 8] = (offset < c->image_size) ? c->image + offset : rom_empty_bank;
+        nesbus_remap_memory(c->bus, (uint16_t)(page << 12), c->bank_ptr[page - 8]);
+    }
     return true;
 }
 
@@ -131,11 +97,93 @@ static bool rom_read_bankswitched(uint16_t addr, uint8_t* rval, void* cookie, ui
 }
 
 
+//
+// Output sample clock
+//
+// Clocks needed from start of the block to the end of sample count, same as blip_clocks_needed()
+static unsigned int sample_clocks_needed(nsf_t* c, unsigned int count)
+{
+    uint64_t needed = (uint64_t)count * SAMPLE_CLOCK_UNIT;
+    if (needed < c->sample_clock_offset)
+        return 0;
+    return (unsigned int)((needed - c->sample_clock_offset + c->sample_clock_factor - 1) / c->sample_clock_factor);
+}
+
+
+// Output sample (from start of the block) the clock belongs to
+static unsigned int sample_at_clock(nsf_t* c, unsigned int clock)
+{
+    return (unsigned int)(((uint64_t)clock * c->sample_clock_factor + c->sample_clock_offset) >> SAMPLE_CLOCK_BITS);
+}
+
+
+static void schedule_apu_sample(nsf_t* c)
+{
+    c->next_apu_sample_cycle += c->cycles_per_apu_sample;
+    c->accumulated_apu_sample_cycle_error += c->apu_sample_cycle_error;
+    if (c->accumulated_apu_sample_cycle_error & 0xffff0000) // if error >= 65536?
+    {
+        ++(c->next_apu_sample_cycle);
+        c->accumulated_apu_sample_cycle_error &= 0x0000ffff;
+    }
+}
+
+
+//
+// APU synchronization
+//
+// CPU runs ahead of APU for multiple cycles in nsf_get_samples. APU is clocked up to the
+// current CPU cycle before CPU accesses any APU register.
+static void apu_catch_up(nsf_t* c, uint32_t cycles)
+{
+    // Audio mode: stop at each APU sample cycle on the way and record channel outputs after it is
+    // clocked, render_samples mixes them at the end of the CPU run
+    while (c->apu_record && (c->next_apu_sample_cycle - c->apu_cycles < cycles - c->apu_cycles))
+    {
+        nesapu_run(c->apu, c->next_apu_sample_cycle + 1 - c->apu_cycles);
+        c->apu_cycles = c->next_apu_sample_cycle + 1;
+        nesapu_record_outputs(c->apu, &(c->apu_outputs), c->next_apu_sample_cycle - c->sample_clock_start);
+        schedule_apu_sample(c);
+    }
+    nesapu_run(c->apu, cycles - c->apu_cycles);
+    c->apu_cycles = cycles;
+}
+
+
+static bool apu_sync_read(uint16_t addr, uint8_t* rval, void* cookie, uint8_t owner)
+{
+    nsf_t* c = (nsf_t*)cookie;
+    if (c->apu_sync && (BUS_OWNER_CPU == owner))
+        apu_catch_up(c, c->cycles + c->cpu->run_cycles);
+    return false;   // let APU handle the read
+}
+
+
+static bool apu_sync_write(uint16_t addr, uint8_t val, void* cookie)
+{
+    nsf_t* c = (nsf_t*)cookie;
+    if (c->apu_sync)
+    {
+        apu_catch_up(c, c->cycles + c->cpu->run_cycles);
+        // Writes changing DMC/frame counter timing, stop CPU run so nsf_get_samples can reschedule
+        if ((0x4010 == addr) || (0x4015 == addr) || (0x4017 == addr))
+            nescpu_break_run(c->cpu);
+    }
+    return false;   // let APU handle the write
+}
+
+
 static bool sniff_apu_write_reg_wrap(uint16_t addr, uint8_t val, void* cookie)
 {
     nsf_t* c = (nsf_t*)cookie;
+    unsigned long sample = c->total_samples;
     if (c->sniff_enabled && c->sniff_write_apu_reg)
-        c->sniff_write_apu_reg(addr, val, c->sniff_param);
+    {
+        // Inside nsf_get_samples, find which sample of current block CPU is at
+        if (c->apu_sync)
+            sample += sample_at_clock(c, c->cycles - c->sample_clock_start + c->cpu->run_cycles);
+        c->sniff_write_apu_reg(addr, val, sample, c->sniff_param);
+    }
     return false;
 }
 
@@ -149,7 +197,7 @@ static bool sniff_apu_write_reg_wrap(uint16_t addr, uint8_t val, void* cookie)
 // Regarding 4015h, well... it's empirical. My experience says that setting 4015h to 0Fh
 // is required in order to get *a lot of* tunes starting playing. I don't remember of *any* broken
 // tune by setting such value. So, it's recommended *to follow* such thing. --Zepper 14:25, 29 March 2012 (PDT)
-// NSF init routine address should be placed in byte NSF_EMU_INIT_WRAP_BASE + 1 and NSF_EMU_INIT_WRAP_BASE + 2
+// NSF init routine address should be placed in byte NSF_EMU_INIT_WRAP_BASE + 8 and NSF_EMU_INIT_WRAP_BASE + 9
 #define NSF_EMU_INIT_WRAP_BASE  0x5000
 #define NSF_EMU_INIT_WRAP_SIZE  11
 static const uint8_t rom_init_wrap[NSF_EMU_INIT_WRAP_SIZE] =
@@ -161,25 +209,6 @@ static const uint8_t rom_init_wrap[NSF_EMU_INIT_WRAP_SIZE] =
     0x20, 0x00, 0x00,   // JSR $xxxx (+8 LL) (+9 HH)
     0xF2                // JAM
 };
-static bool rom_read_init_wrap(uint16_t addr, uint8_t* rval, void* cookie, uint8_t owner)
-{
-    nsf_t* c = (nsf_t*)cookie;
-    if (addr == NSF_EMU_INIT_WRAP_BASE + 8)
-    {   
-        // low byte of init address
-        *rval = (uint8_t)(c->header->init_addr & 0xFF);
-        return true;
-    }
-    if (addr == NSF_EMU_INIT_WRAP_BASE + 9)
-    {
-        // high byte of init address
-        *rval = (uint8_t)((c->header->init_addr >> 8) & 0xFF);
-        return true;
-    }
-    // address range should be gauranteed by nesbus module
-    *rval = rom_init_wrap[addr - NSF_EMU_INIT_WRAP_BASE];
-    return true;
-}
 
 
 //
@@ -187,31 +216,15 @@ static bool rom_read_init_wrap(uint16_t addr, uint8_t* rval, void* cookie, uint8
 //
 #define NSF_EMU_PLAY_WRAP_BASE  0x5020
 #define NSF_EMU_PLAY_WRAP_SIZE  4
-//static const uint8_t rom_play_wrap[NSF_EMU_PLAY_WRAP_SIZE] =
-//{
-//    0x20, 0x00, 0x00,   // JSR $xxxx
-//    0xF2                // JAM
-//};
-static bool rom_read_play_wrap(uint16_t addr, uint8_t* rval, void* cookie, uint8_t owner)
+static const uint8_t rom_play_wrap[NSF_EMU_PLAY_WRAP_SIZE] =
 {
-    nsf_t* c = (nsf_t*)cookie;
-    switch (addr)
-    {
-    case NSF_EMU_PLAY_WRAP_BASE:        // JSR
-        *rval = 0x20;
-        break;
-    case NSF_EMU_PLAY_WRAP_BASE + 1:    // low byte of init address
-        *rval = (uint8_t)(c->header->play_addr & 0xFF);
-        break;
-    case NSF_EMU_PLAY_WRAP_BASE + 2:    // high byte of init address
-        *rval = (uint8_t)((c->header->play_addr >> 8) & 0xFF);
-        break;
-    case NSF_EMU_PLAY_WRAP_BASE + 3:    // JAM
-        *rval = 0xF2;
-        break;
-    }
-    return true;
-}
+    0x20, 0x00, 0x00,   // JSR $xxxx (+1 LL) (+2 HH)
+    0xF2                // JAM
+};
+
+
+// Both wraps live in one buffer mapped as memory, from NSF_EMU_INIT_WRAP_BASE to the end of PLAY wrap
+#define NSF_EMU_WRAP_SIZE       (NSF_EMU_PLAY_WRAP_BASE + NSF_EMU_PLAY_WRAP_SIZE - NSF_EMU_INIT_WRAP_BASE)
 
 
 //
@@ -238,7 +251,7 @@ void nsf_destroy(nsf_t* c)
 }
 
 
-int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint32_t sample_rate, uint8_t oversample)
+int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint32_t sample_rate, uint8_t oversample, bool preload)
 {
     int ret, i;
     if (0 == c)
@@ -346,9 +359,9 @@ int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint
     c->accumulated_playback_cycle_error = 0;
     c->next_playback_cycle = 0;
     // Construct emulator
-    // Read:  APU 3, RAM 2, NSF 1, INIT 1, PLAY 1, Sniffer RAM 1, total 8
-    // Write: APU 3, RAM 2, BANK REG 1, Sniffer APU 3, total 8
-    c->bus = nesbus_create(10, 10);
+    // Read:  APU SYNC 1, APU 3, RAM 2, NSF 1 (preloaded bank switched 8), INIT 1, PLAY 1, total 16
+    // Write: APU SYNC 1, APU 3, RAM 2, BANK REG 1, Sniffer APU 1, total 8
+    c->bus = nesbus_create(20, 10);
     if (0 == c->bus)
     {
         ret = NSF_ERR_OUTOFMEMORY;
@@ -361,6 +374,9 @@ int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint
         goto start_exit;
     }
     nescpu_attach_bus(c->cpu, c->bus);
+    // APU sync goes before APU handlers
+    nesbus_add_read_handler(c->bus, "NSF_APU_SYNC", 0x4000, 0x4017, apu_sync_read, (void *)c);
+    nesbus_add_write_handler(c->bus, "NSF_APU_SYNC", 0x4000, 0x4017, apu_sync_write, (void *)c);
     c->apu = nesapu_create(c->format, c->format ? APU_CLOCK_PAL : APU_CLOCK_NTSC, sample_rate);
     if (0 == c->apu)
     {
@@ -378,8 +394,7 @@ int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint
         goto start_exit;
     }
     memset(c->ram1, 0, EMU_RAM1_SIZE);
-    nesbus_add_read_handler(c->bus, "RAM1", EMU_RAM1_BASE, EMU_RAM1_BASE + EMU_RAM1_SIZE - 1, ram1_read, (void*)c);
-    nesbus_add_write_handler(c->bus, "RAM1", EMU_RAM1_BASE, EMU_RAM1_BASE + EMU_RAM1_SIZE - 1, ram1_write, (void*)c);
+    nesbus_add_memory(c->bus, "RAM1", EMU_RAM1_BASE, EMU_RAM1_BASE + EMU_RAM1_SIZE - 1, c->ram1, false);
     c->ram2 = (uint8_t*)malloc(EMU_RAM2_SIZE);
     if (0 == c->ram2)
     {
@@ -387,8 +402,7 @@ int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint
         goto start_exit;
     }
     memset(c->ram2, 0, EMU_RAM2_SIZE);
-    nesbus_add_read_handler(c->bus, "RAM2", EMU_RAM2_BASE, EMU_RAM2_BASE + EMU_RAM2_SIZE - 1, ram2_read, (void*)c);
-    nesbus_add_write_handler(c->bus, "RAM2", EMU_RAM2_BASE, EMU_RAM2_BASE + EMU_RAM2_SIZE - 1, ram2_write, (void*)c);
+    nesbus_add_memory(c->bus, "RAM2", EMU_RAM2_BASE, EMU_RAM2_BASE + EMU_RAM2_SIZE - 1, c->ram2, false);
     // ROM from .nsf file
     c->bank_switched = false;   // check if NSF file uses bank switch
     for (i = 0; i < 8; ++i)
@@ -399,33 +413,87 @@ int nsf_start_emu(nsf_t* c, nsfreader_t* reader, uint16_t max_sample_count, uint
             break;
         }
     }
+    if (preload)
+    {
+        // Load music data once, bank switched image is padded so bank n starts at (n << 12)
+        uint32_t pad = c->bank_switched ? (c->header->load_addr & 0x0fff) : 0;
+        c->image_size = pad + c->music_length;
+        if (c->bank_switched)
+            c->image_size = (c->image_size + NSF_BANK_SIZE - 1) & ~(uint32_t)(NSF_BANK_SIZE - 1);
+        c->image = (uint8_t*)malloc(c->image_size);
+        if (0 == c->image)
+        {
+            ret = NSF_ERR_OUTOFMEMORY;
+            goto start_exit;
+        }
+        memset(c->image, 0, c->image_size);
+        if (c->music_length != reader->read(reader->self, c->image + pad, c->music_offset, c->music_length))
+        {
+            ret = NSF_ERR_UNSUPPORTED;
+            goto start_exit;
+        }
+    }
     if (!c->bank_switched)
     {
         // Non bank-switched NSF rom, music data from c->music is loaded to c->header->load_addr
-        nesbus_add_read_handler(c->bus, "NSF_ROM", c->header->load_addr, c->header->load_addr + c->music_length - 1, rom_read_nonbankswitched, (void*)c);
+        if (c->image)
+            nesbus_add_memory(c->bus, "NSF_ROM", c->header->load_addr, c->header->load_addr + c->music_length - 1, c->image, true);
+        else
+            nesbus_add_read_handler(c->bus, "NSF_ROM", c->header->load_addr, c->header->load_addr + c->music_length - 1, rom_read_nonbankswitched, (void*)c);
     }
     else
     {
+        if (c->image)
+        {
+            // One memory region per bank, remapped by bank switch register
+            for (i = 0; i < 8; ++i)
+            {
+                c->bank_ptr[i] = rom_empty_bank;
+                nesbus_add_memory(c->bus, "NSF_BANK", 0x8000 + i * NSF_BANK_SIZE, 0x8000 + i * NSF_BANK_SIZE + NSF_BANK_SIZE - 1, c->bank_ptr[i], true);
+            }
+        }
+        else
+        {
+            // Bank switched NSF rom can extend to full address range
+            nesbus_add_read_handler(c->bus, "NSF_BANK", 0x8000, 0xFFFF, rom_read_bankswitched, (void*)c);
+        }
         // Use bankswitch_info in the header to initialize bank switch register
         for (i = 0; i < 8; ++i)
         {
             ram_write_bankswitch_reg(0x5ff8 + i, c->header->bankswitch_info[i], (void*)c);
         }
-        // Bank switched NSF rom can extend to full address range
-        nesbus_add_read_handler(c->bus, "NSF_BANK", 0x8000, 0xFFFF, rom_read_bankswitched, (void*)c);
         // Bank switch register
         nesbus_add_write_handler(c->bus, "NSF_BANK_REG", 0x5FF8, 0x5FFF, ram_write_bankswitch_reg, (void*)c);
     }
-    // INIT wrap
-    nesbus_add_read_handler(c->bus, "NSF_INIT", NSF_EMU_INIT_WRAP_BASE, NSF_EMU_INIT_WRAP_BASE + NSF_EMU_INIT_WRAP_SIZE - 1, rom_read_init_wrap, (void*)c);
-    // PLAY wrap
-    nesbus_add_read_handler(c->bus, "NSF_PLAY", NSF_EMU_PLAY_WRAP_BASE, NSF_EMU_PLAY_WRAP_BASE + NSF_EMU_PLAY_WRAP_SIZE - 1, rom_read_play_wrap, (void*)c);
+    // INIT/PLAY wrap, patched with init/play address
+    c->wrap = (uint8_t*)malloc(NSF_EMU_WRAP_SIZE);
+    if (0 == c->wrap)
+    {
+        ret = NSF_ERR_OUTOFMEMORY;
+        goto start_exit;
+    }
+    memset(c->wrap, 0, NSF_EMU_WRAP_SIZE);
+    memcpy(c->wrap, rom_init_wrap, NSF_EMU_INIT_WRAP_SIZE);
+    c->wrap[8] = (uint8_t)(c->header->init_addr & 0xFF);
+    c->wrap[9] = (uint8_t)((c->header->init_addr >> 8) & 0xFF);
+    memcpy(c->wrap + NSF_EMU_PLAY_WRAP_BASE - NSF_EMU_INIT_WRAP_BASE, rom_play_wrap, NSF_EMU_PLAY_WRAP_SIZE);
+    c->wrap[NSF_EMU_PLAY_WRAP_BASE - NSF_EMU_INIT_WRAP_BASE + 1] = (uint8_t)(c->header->play_addr & 0xFF);
+    c->wrap[NSF_EMU_PLAY_WRAP_BASE - NSF_EMU_INIT_WRAP_BASE + 2] = (uint8_t)((c->header->play_addr >> 8) & 0xFF);
+    nesbus_add_memory(c->bus, "NSF_INIT", NSF_EMU_INIT_WRAP_BASE, NSF_EMU_INIT_WRAP_BASE + NSF_EMU_INIT_WRAP_SIZE - 1, c->wrap, true);
+    nesbus_add_memory(c->bus, "NSF_PLAY", NSF_EMU_PLAY_WRAP_BASE, NSF_EMU_PLAY_WRAP_BASE + NSF_EMU_PLAY_WRAP_SIZE - 1, c->wrap + NSF_EMU_PLAY_WRAP_BASE - NSF_EMU_INIT_WRAP_BASE, true);
     ret = NSF_ERR_SUCCESS;
     // BLIP buffer
     c->blip_buffer_size = max_sample_count;
     c->blip = blip_new(max_sample_count);
     blip_set_rates(c->blip, c->clock_rate, c->output_sample_rate);
     c->blip_last_sample = 0;
+    // Output sample clock, follows blip buffer, see blip_set_rates()/blip_clear()
+    double factor = (double)SAMPLE_CLOCK_UNIT * c->output_sample_rate / c->clock_rate;
+    c->sample_clock_factor = (uint64_t)factor;
+    if (c->sample_clock_factor < factor)
+        ++(c->sample_clock_factor);
+    c->sample_clock_offset = c->sample_clock_factor / 2;
+    c->rip_last_mix = 0xFFFF;
     // Silent detection
     c->silence_detection = true;
     c->slient_sample_target = SILENT_DETECTION_MS * c->apu_sample_rate / 1000;
@@ -449,6 +517,16 @@ void nsf_stop_emu(nsf_t* c)
         blip_delete(c->blip);
         c->blip = 0;
     }
+    if (c->image)
+    {
+        free(c->image);
+        c->image = 0;
+    }
+    if (c->wrap)
+    {
+        free(c->wrap);
+        c->wrap = 0;
+    }
     if (c->ram2)
     {
         free(c->ram2);
@@ -484,6 +562,7 @@ void nsf_stop_emu(nsf_t* c)
 
 int nsf_init_song(nsf_t* c, uint8_t song)
 {
+    int i;
     if (0 == c)
     {
         return NSF_ERR_INVALIDPARAM;
@@ -492,9 +571,35 @@ int nsf_init_song(nsf_t* c, uint8_t song)
     {
         return NSF_ERR_NOT_INITIALIZED;
     }
-    // clear ram
-    memset(c->ram1, 0, sizeof(EMU_RAM1_SIZE));
-    memset(c->ram2, 0, sizeof(EMU_RAM2_SIZE));
+    // Full reset so the emulator can be reused for any song, same state as after nsf_start_emu
+    memset(c->ram1, 0, EMU_RAM1_SIZE);
+    memset(c->ram2, 0, EMU_RAM2_SIZE);
+    if (c->bank_switched)
+    {
+        for (i = 0; i < 8; ++i)
+        {
+            ram_write_bankswitch_reg(0x5ff8 + i, c->header->bankswitch_info[i], (void*)c);
+        }
+    }
+    nesapu_reset(c->apu);
+    c->cycles = 0;
+    c->apu_cycles = 0;
+    c->apu_sync = false;
+    c->total_samples = 0;
+    c->accumulated_apu_sample_cycle_error = 0;
+    c->next_apu_sample_cycle = 0;
+    c->accumulated_playback_cycle_error = 0;
+    c->next_playback_cycle = 0;
+    blip_clear(c->blip);
+    c->blip_last_sample = 0;
+    c->sample_clock_offset = c->sample_clock_factor / 2;
+    c->sample_clock_start = 0;
+    c->rip_last_mix = 0xFFFF;
+    c->slient_sample_count = 0;
+    c->silent = false;
+    // Call INIT, CPU profile is per song
+    nescpu_profile_reset(c->cpu);
+    nescpu_profile_phase(c->cpu, NESCPU_PROFILE_INIT);
     nescpu_reset(c->cpu, false);
     nescpu_set_pc(c->cpu, NSF_EMU_INIT_WRAP_BASE);
     nescpu_set_a(c->cpu, song);                        // desired song #
@@ -505,30 +610,58 @@ int nsf_init_song(nsf_t* c, uint8_t song)
         if (nescpu_clock(c->cpu))    // nescpu_clock returns true if JAMed
             break;
     } while (1);
-    blip_clear(c->blip);
-    c->cycles = 0;
-    c->total_samples = 0;
-    c->slient_sample_count = 0;
-    c->silent = false;
+    nescpu_profile_phase(c->cpu, NESCPU_PROFILE_PLAY);
     return NSF_ERR_SUCCESS;
 }
 
 
-int nsf_get_samples(nsf_t* c, uint16_t count, int16_t* samples)
+static void count_silence(nsf_t* c, bool changed, unsigned int clock, unsigned int* needed_clocks)
 {
-    if (0 == c)
+    if (!changed)
     {
-        return NSF_ERR_INVALIDPARAM;
-    }
-    if (0 == c->cpu || 0 == c->apu || 0 == c->bus || 0 == c->ram1 || 0 == c->ram2 || 0 == c->blip)
-    {
-        return NSF_ERR_NOT_INITIALIZED;
+        ++(c->slient_sample_count);
+        if ((c->slient_sample_count >= c->slient_sample_target) && !c->silent)
+        {
+            c->silent = true;
+            // Stop at the end of current output sample
+            *needed_clocks = sample_clocks_needed(c, sample_at_clock(c, clock) + 1);
+        }
     }
-    if (count > c->blip_buffer_size)
+    else
     {
-        return NSF_ERR_INVALIDPARAM;
+        c->slient_sample_count = 0;
     }
-    unsigned int needed_clocks = (unsigned int)blip_clocks_needed(c->blip, count);
+}
+
+
+// Mix APU outputs recorded during the last CPU run into blip buffer
+static void mix_apu_outputs(nsf_t* c, unsigned int* needed_clocks)
+{
+    nesapu_outputs_t* o = &(c->apu_outputs);
+    int16_t delta;
+    nesapu_mix_outputs(o, c->apu_samples);
+    for (int k = 0; k < o->count; ++k)
+    {
+        delta = c->apu_samples[k] - c->blip_last_sample;
+        c->blip_last_sample = c->apu_samples[k];
+        if (0 != delta)
+            blip_add_delta(c->blip, o->clock[k], delta);
+        if (c->silence_detection)
+            count_silence(c, 0 != delta, o->clock[k], needed_clocks);
+    }
+    o->count = 0;
+}
+
+
+static int render_samples(nsf_t* c, uint16_t count, int16_t* samples)
+{
+    unsigned int needed_clocks = sample_clocks_needed(c, count);
+    uint32_t step, t, n;
+    c->sample_clock_start = c->cycles;
+    c->apu_cycles = c->cycles;
+    c->apu_sync = true;
+    c->apu_record = !c->rip_mode;
+    c->apu_outputs.count = 0;
     for (unsigned int i = 0; i < needed_clocks; ++i)
     {
         // Call PLAY ROUNTINE at playback rate
@@ -551,9 +684,39 @@ int nsf_get_samples(nsf_t* c, uint16_t count, int16_t* samples)
                 c->accumulated_playback_cycle_error &= 0x0000ffff;
             }
         }
-        // Clock CPU/APU
-        nescpu_clock(c->cpu);   // can clock CPU even if it is jammed
-        nesapu_clock(c->apu);   // NES APU running same clock as CPU
+        // Run CPU up to next PLAY call, APU sample or APU event (DMC stall/IRQ), whichever comes first.
+        // Events can only happen at the last cycle of the run.
+        // In audio mode APU samples are recorded on APU catch up, run up to the end of current output
+        // sample instead, that is where silence detection may stop and it bounds the recorded outputs
+        // to oversample + 1.
+        step = needed_clocks - i;
+        t = c->next_playback_cycle - c->cycles;
+        if (t < step)
+            step = t;
+        if (c->rip_mode)
+        {
+            t = c->next_apu_sample_cycle - c->cycles;
+            if (t < step)
+                step = t + 1;
+        }
+        else
+        {
+            t = sample_clocks_needed(c, sample_at_clock(c, i) + 1) - i;
+            if (t < step)
+                step = t;
+        }
+        t = nesapu_quiet_cycles(c->apu);
+        if (t < step)
+            step = t;
+        if (nesapu_irq_requested(c->apu) && !nescpu_irq_inhibited(c->cpu))
+            step = 1;   // IRQ will be taken after this cycle
+        n = nescpu_run(c->cpu, step);   // can run CPU even if it is jammed
+        // Clock APU up to the last cycle of the run, NES APU running same clock as CPU
+        apu_catch_up(c, c->cycles + n);
+        if (!c->rip_mode)
+            mix_apu_outputs(c, &needed_clocks);
+        i += n - 1;
+        c->cycles += n - 1;
         if (nesapu_dmc_stall_cpu(c->apu))
         {
             // Test if APU requested DMC transfer (stall CPU for 4 cycles)
@@ -565,47 +728,87 @@ int nsf_get_samples(nsf_t* c, uint16_t count, int16_t* samples)
             nescpu_irq(c->cpu);
         }
 
-        // Sample APU if needed
-        if (c->cycles == c->next_apu_sample_cycle)
+        // Rip mode: sample APU if needed. No synthesis, output only changes if mixer inputs change
+        if (c->rip_mode && (c->cycles == c->next_apu_sample_cycle))
         {
-            // Take sample
-            int16_t s = nesfloat_to_sample(nesapu_sample(c->apu));
-            int16_t delta = s - c->blip_last_sample;
-            c->blip_last_sample = s;
-            blip_add_delta(c->blip, i, delta);
+            uint16_t mix = nesapu_mixer_index(c->apu);
             if (c->silence_detection)
-            {
-                if (0 == delta)
-                {
-                    ++(c->slient_sample_count);
-                    if (c->slient_sample_count >= c->slient_sample_target)
-                    {
-                        c->silent = true;
-                    }
-                }
-                else
-                {
-                    c->slient_sample_count = 0;
-                }
-            }
-            // Schedule next sample
-            c->next_apu_sample_cycle = c->cycles + c->cycles_per_apu_sample;
-            c->accumulated_apu_sample_cycle_error += c->apu_sample_cycle_error;
-            if (c->accumulated_apu_sample_cycle_error & 0xffff0000) // if error >= 65536?
-            {
-                ++(c->next_apu_sample_cycle);
-                c->accumulated_apu_sample_cycle_error &= 0x0000ffff;
-            }
+                count_silence(c, mix != c->rip_last_mix, i, &needed_clocks);
+            c->rip_last_mix = mix;
+            schedule_apu_sample(c);
         }
         ++(c->cycles);
     }
-    blip_end_frame(c->blip, needed_clocks);
-    int nsamples = blip_read_samples(c->blip, (short*)samples, count, 0);    // read out sample even if silent
+    c->apu_sync = false;
+    c->apu_record = false;
+    // Same as blip_end_frame()
+    uint64_t off = (uint64_t)needed_clocks * c->sample_clock_factor + c->sample_clock_offset;
+    int nsamples = (int)(off >> SAMPLE_CLOCK_BITS);
+    c->sample_clock_offset = off & (SAMPLE_CLOCK_UNIT - 1);
+    if (!c->rip_mode)
+    {
+        blip_end_frame(c->blip, needed_clocks);
+        nsamples = blip_read_samples(c->blip, (short*)samples, nsamples, 0);    // read out sample even if silent
+    }
     c->total_samples += nsamples;
     return nsamples;
 }
 
 
+int nsf_get_samples(nsf_t* c, uint16_t count, int16_t* samples)
+{
+    int total = 0, n, r;
+    if (0 == c)
+    {
+        return NSF_ERR_INVALIDPARAM;
+    }
+    if (0 == c->cpu || 0 == c->apu || 0 == c->bus || 0 == c->ram1 || 0 == c->ram2 || 0 == c->blip)
+    {
+        return NSF_ERR_NOT_INITIALIZED;
+    }
+    if (!c->rip_mode && count > c->blip_buffer_size)
+    {
+        return NSF_ERR_INVALIDPARAM;
+    }
+    // Split into blocks: blip_buf takes at most blip_max_frame samples per frame,
+    // and in rip mode it keeps the sample clock maths in 64 bits
+    while (total < count)
+    {
+        n = count - total;
+        if (n > blip_max_frame)
+            n = blip_max_frame;
+        r = render_samples(c, (uint16_t)n, c->rip_mode ? 0 : samples + total);
+        total += r;
+        if (r < n)
+            break;  // silence detected
+    }
+    return total;
+}
+
+
+// Rip mode: nsf_get_samples() runs emulation with exact output sample timing but does not synthesize
+// audio (samples can be NULL and is not written). Silence detection works on APU channel outputs.
+int nsf_set_rip_mode(nsf_t* c, bool enable)
+{
+    if (0 == c)
+    {
+        return NSF_ERR_INVALIDPARAM;
+    }
+    if (0 == c->cpu || 0 == c->apu || 0 == c->bus || 0 == c->ram1 || 0 == c->ram2 || 0 == c->blip)
+    {
+        return NSF_ERR_NOT_INITIALIZED;
+    }
+    if (enable != c->rip_mode)
+    {
+        // Restart output sample clock
+        blip_clear(c->blip);
+        c->sample_clock_offset = c->sample_clock_factor / 2;
+        c->rip_mode = enable;
+    }
+    return NSF_ERR_SUCCESS;
+}
+
+
 int nsf_enable_slience_detect(nsf_t* c, unsigned int samples)
 {
     if (0 == c)
@@ -662,4 +865,129 @@ int nsf_dump_rom(nsf_t *c, int16_t addr, int16_t len, uint8_t *buf)
         buf[i] = nesbus_read(c->bus, addr + i, BUS_OWNER_EXT);
     }
     return NSF_ERR_SUCCESS;
-}
\ No newline at end of file
+}
+
+
+//
+// Snapshot
+//
+#define NSF_SNAPSHOT_MAGIC  0x5346534E  // "NSFS"
+
+typedef struct nsf_snapshot_s
+{
+    uint32_t magic;
+    uint32_t size;
+    // NSF identity
+    uint16_t load_addr;
+    uint16_t init_addr;
+    uint16_t play_addr;
+    uint32_t music_length;
+    // Emulator state, host side fields (bus, profile) are zero
+    nescpu_t cpu;
+    nesapu_t apu;
+    uint8_t ram1[EMU_RAM1_SIZE];
+    uint8_t ram2[EMU_RAM2_SIZE];
+    uint8_t bank_reg[8];
+    // Timing
+    uint32_t cycles;
+    unsigned long total_samples;
+    uint32_t next_apu_sample_cycle;
+    int32_t accumulated_apu_sample_cycle_error;
+    uint32_t next_playback_cycle;
+    int32_t accumulated_playback_cycle_error;
+    uint64_t sample_clock_offset;
+    int16_t blip_last_sample;
+    uint16_t rip_last_mix;
+    bool silent;
+    unsigned int slient_sample_count;
+} nsf_snapshot_t;
+
+
+size_t nsf_snapshot_size(void)
+{
+    return sizeof(nsf_snapshot_t);
+}
+
+
+int nsf_snapshot(nsf_t *c, void *buf, size_t size)
+{
+    nsf_snapshot_t *s = (nsf_snapshot_t *)buf;
+    if ((0 == c) || (0 == buf) || (size < sizeof(nsf_snapshot_t)))
+        return NSF_ERR_INVALIDPARAM;
+    if (0 == c->cpu || 0 == c->apu || 0 == c->ram1 || 0 == c->ram2)
+        return NSF_ERR_NOT_INITIALIZED;
+    s->magic = NSF_SNAPSHOT_MAGIC;
+    s->size = sizeof(nsf_snapshot_t);
+    s->load_addr = c->header->load_addr;
+    s->init_addr = c->header->init_addr;
+    s->play_addr = c->header->play_addr;
+    s->music_length = c->music_length;
+    // No host pointers in the snapshot
+    memset(&(s->cpu), 0, sizeof(nescpu_t));
+    nescpu_copy_state(&(s->cpu), c->cpu);
+    memset(&(s->apu), 0, sizeof(nesapu_t));
+    nesapu_copy_state(&(s->apu), c->apu);
+    memcpy(s->ram1, c->ram1, EMU_RAM1_SIZE);
+    memcpy(s->ram2, c->ram2, EMU_RAM2_SIZE);
+    memcpy(s->bank_reg, c->bank_reg, sizeof(s->bank_reg));
+    s->cycles = c->cycles;
+    s->total_samples = c->total_samples;
+    s->next_apu_sample_cycle = c->next_apu_sample_cycle;
+    s->accumulated_apu_sample_cycle_error = c->accumulated_apu_sample_cycle_error;
+    s->next_playback_cycle = c->next_playback_cycle;
+    s->accumulated_playback_cycle_error = c->accumulated_playback_cycle_error;
+    s->sample_clock_offset = c->sample_clock_offset;
+    s->blip_last_sample = c->blip_last_sample;
+    s->rip_last_mix = c->rip_last_mix;
+    s->silent = c->silent;
+    s->slient_sample_count = c->slient_sample_count;
+    return NSF_ERR_SUCCESS;
+}
+
+
+int nsf_restore(nsf_t *c, const void *buf, size_t size)
+{
+    const nsf_snapshot_t *s = (const nsf_snapshot_t *)buf;
+    int i;
+    if ((0 == c) || (0 == buf))
+        return NSF_ERR_INVALIDPARAM;
+    if (0 == c->cpu || 0 == c->apu || 0 == c->ram1 || 0 == c->ram2 || 0 == c->blip)
+        return NSF_ERR_NOT_INITIALIZED;
+    if ((size < sizeof(nsf_snapshot_t)) || (s->magic != NSF_SNAPSHOT_MAGIC) || (s->size != sizeof(nsf_snapshot_t)))
+        return NSF_ERR_BADSNAPSHOT;
+    if ((s->load_addr != c->header->load_addr) || (s->init_addr != c->header->init_addr)
+        || (s->play_addr != c->header->play_addr) || (s->music_length != c->music_length))
+        return NSF_ERR_BADSNAPSHOT;
+    // Bus connections and CPU profile stay with this emulator
+    nescpu_copy_state(c->cpu, &(s->cpu));
+    nesapu_copy_state(c->apu, &(s->apu));
+    memcpy(c->ram1, s->ram1, EMU_RAM1_SIZE);
+    memcpy(c->ram2, s->ram2, EMU_RAM2_SIZE);
+    if (c->bank_switched)
+    {
+        for (i = 0; i < 8; ++i)
+        {
+            ram_write_bankswitch_reg(0x5ff8 + i, s->bank_reg[i], (void*)c);
+        }
+    }
+    c->cycles = s->cycles;
+    c->apu_cycles = s->cycles;
+    c->apu_sync = false;
+    c->total_samples = s->total_samples;
+    c->next_apu_sample_cycle = s->next_apu_sample_cycle;
+    c->accumulated_apu_sample_cycle_error = s->accumulated_apu_sample_cycle_error;
+    c->next_playback_cycle = s->next_playback_cycle;
+    c->accumulated_playback_cycle_error = s->accumulated_playback_cycle_error;
+    c->blip_last_sample = s->blip_last_sample;
+    c->rip_last_mix = s->rip_last_mix;
+    c->silent = s->silent;
+    c->slient_sample_count = s->slient_sample_count;
+    // Blip buffer content is not saved, output sample clock follows the cleared blip buffer
+    // in audio mode. Rip mode does not use blip buffer and keeps exact sample positions.
+    blip_clear(c->blip);
+    if (c->rip_mode)
+        c->sample_clock_offset = s->sample_clock_offset;
+    else
+        c->sample_clock_offset = c->sample_clock_factor / 2;
+    return NSF_ERR_SUCCESS;
+}
@@ -22,6 +22,7 @@ extern "C" {
 #define NSF_ERR_UNSUPPORTED     -3
 #define NSF_ERR_NOT_INITIALIZED -4
 #define NSF_ERR_DUMPFAILED      -5
+#define NSF_ERR_BADSNAPSHOT     -6
 
 
 // Spec: https://wiki.nesdev.org/w/index.php/NSF
@@ -47,7 +48,8 @@ PACK(struct nsf_header_s
 typedef struct nsf_header_s nsf_header_t;
 
 typedef void (*apu_read_rom_cb)(uint16_t addr, void* param);
-typedef void (*apu_write_reg_cb)(uint16_t addr, uint8_t val, void* param);
+// sample: index of the output sample during which the write happens
+typedef void (*apu_write_reg_cb)(uint16_t addr, uint8_t val, unsigned long sample, void* param);
 
 typedef struct nsf_s
 {
@@ -60,6 +62,11 @@ typedef struct nsf_s
     // NSF memory
     bool bank_switched;
     uint32_t bank[8];
+    uint8_t bank_reg[8];    // bank switch register values
+    // Preloaded music data
+    uint8_t *image;         // music data, with (load_addr & 0x0fff) pad bytes in front if bank switched
+    uint32_t image_size;    // rounded up to 4K banks if bank switched
+    uint8_t *bank_ptr[8];   // 8000-FFFF, 4K per bank
     bool format;    // false - NTSC; true - PAL
     // Emulator
     nesbus_t *bus;
@@ -67,9 +74,12 @@ typedef struct nsf_s
     nesapu_t *apu;
     uint8_t *ram1;
     uint8_t *ram2;
+    uint8_t *wrap;      // INIT/PLAY wrap code
     // Clock
     uint32_t cycles;
     uint32_t clock_rate;
+    uint32_t apu_cycles;    // APU is clocked up to (not including) this cycle
+    bool apu_sync;          // APU is caught up with CPU on register access
     // Sampling
     unsigned long total_samples;
     uint32_t output_sample_rate;
@@ -80,6 +90,9 @@ typedef struct nsf_s
     uint32_t next_apu_sample_cycle;
     int32_t apu_sample_cycle_error;
     int32_t accumulated_apu_sample_cycle_error;
+    bool apu_record;                    // audio mode, APU outputs are recorded while APU catches up
+    nesapu_outputs_t apu_outputs;       // recorded during current CPU run
+    int16_t apu_samples[NESAPU_OUTPUT_BLOCK];
     // Playback control
     uint32_t playback_rate;
     uint32_t cycles_per_playback;
@@ -90,6 +103,13 @@ typedef struct nsf_s
     uint16_t blip_buffer_size;
     blip_buffer_t* blip;
     int16_t blip_last_sample;
+    // Output sample clock, same fixed point maths as blip buffer
+    uint64_t sample_clock_factor;
+    uint64_t sample_clock_offset;
+    uint32_t sample_clock_start;    // c->cycles at start of current nsf_get_samples block
+    // Rip mode, no audio synthesis
+    bool rip_mode;
+    uint16_t rip_last_mix;  // APU mixer indices of last sample
     // Slient detection
     bool silent;
     bool silence_detection;
@@ -105,15 +125,27 @@ typedef struct nsf_s
 nsf_t* nsf_create();
 void nsf_destroy(nsf_t* ctx);
 
-int nsf_start_emu(nsf_t* ctx, nsfreader_t* reader, uint16_t max_sample_count, uint32_t sample_rate, uint8_t oversample);
+// preload: load music data into memory once instead of reading through reader on every ROM access
+int nsf_start_emu(nsf_t* ctx, nsfreader_t* reader, uint16_t max_sample_count, uint32_t sample_rate, uint8_t oversample, bool preload);
 
 void nsf_stop_emu(nsf_t *ctx);
+// Start the emulator once per NSF file and call nsf_init_song for each song to play, it fully
+// resets CPU, APU, RAM, bank registers and timing before calling INIT
 int nsf_init_song(nsf_t *ctx, uint8_t song);
+// Returns number of samples generated, less than count if silence is detected
 int nsf_get_samples(nsf_t *ctx, uint16_t count, int16_t* samples);
+int nsf_set_rip_mode(nsf_t *ctx, bool enable);
 int nsf_enable_slience_detect(nsf_t *ctx, unsigned int samples);
 bool nsf_silence_detected(nsf_t *ctx);
 void nsf_enable_apu_sniffing(nsf_t *c, bool enable, apu_write_reg_cb write, void *param);
 int nsf_dump_rom(nsf_t *ctx, int16_t addr, int16_t len, uint8_t *buf);
+// Save/restore emulation state (CPU, APU, RAM, bank registers and timing) between nsf_get_samples calls.
+// The snapshot is a flat buffer of nsf_snapshot_size() bytes, only valid for the same NSF and build.
+// Settings (rip mode, silence detection, sniffing) are not part of the state. In audio mode the
+// output filter restarts on restore.
+size_t nsf_snapshot_size(void);
+int nsf_snapshot(nsf_t *ctx, void *buf, size_t size);
+int nsf_restore(nsf_t *ctx, const void *buf, size_t size);
 
 #ifdef __cplusplus
 }
@@ -1,12 +1,22 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef _WIN32
+# include <windows.h>
+# include <io.h>
+# include <fcntl.h>
+#else
+# include <pthread.h>
+#endif
 #include <cJSON.h>
 #include <cwalk.h>
 #include "platform.h"
 #include "ansicon.h"
 #include "nsf.h"
 #include "nsfreader_file.h"
+#include "nsfreader_mem.h"
+#include "nsfreader_mmap.h"
 #include "nsfrip.h"
 
 #define NSF2VGM_ERR_SUCCESS             0
@@ -29,11 +39,19 @@
 
 #define NSF_SAMPLE_RATE                 44100
 #define NSF_CACHE_SIZE                  4096
+#define NSF_RIP_BLOCK                   4000    // samples per nsf_get_samples call
+#define NSF_RIP_PROGRESS                40000   // samples between progress updates
+#define NSF_PROFILE_MAX_PC              100     // hottest addresses in CPU profile (NESCPU_PROFILE build)
+
+#define NSF2VGM_MAX_JOBS                64      // max worker threads for -j
+#define NSF2VGM_LOG_SIZE                2048    // per-track message buffer in worker mode
+#define NSF2VGM_STDIN_NAME              "<stdin>"
 
 #define NSFRIP_DEFAULT_MAX_TRACK_LENGTH     120.0
-#define NSFRIP_DEFAULT_MAX_RECORDS          100000
 #define NSFRIP_DEFAULT_MIN_SLIENCE          2
 #define NSFRIP_DEFAULT_MIN_LOOP_RECORDS     1000
+#define NSFRIP_DEFAULT_LOOP_REPEATS         0       // 0: rip to max_track_length before searching the loop
+#define NSFRIP_VGZ_LEVEL_MAX                9
 
 
 #define PRINT_ERR(...) do { printf("%s", ANSI_RED); printf(__VA_ARGS__); } while (0)
@@ -43,8 +61,14 @@
 
 static void usage()
 {
-    PRINT_ERR("%s", "Usage: nsf2vgm config.json [track no] or\n");
-    PRINT_ERR("%s", "       nsf2vgm file.nsf [track no]\n");
+    PRINT_ERR("%s", "Usage: nsf2vgm [-j N] [-z N] [-r] [-m] config.json [track no] or\n");
+    PRINT_ERR("%s", "       nsf2vgm [-j N] [-z N] [-r] [-m] file.nsf [track no] or\n");
+    PRINT_ERR("%s", "       nsf2vgm [-j N] [-z N] [-r] [-m] file1.nsf|config1.json file2.nsf|config2.json ...\n");
+    PRINT_ERR("%s", "       nsf2vgm [-j N] [-z N] [-r] [-m] - [track no] < file.nsf\n");
+    PRINT_ERR("%s", "       -j N: convert N tracks in parallel\n");
+    PRINT_ERR("%s", "       -z N: write gzip compressed .vgz at level N (1-9), 0 writes .vgm\n");
+    PRINT_ERR("%s", "       -r: drop register writes that don't change the register\n");
+    PRINT_ERR("%s", "       -m: read NSF files through a memory mapping\n");
 }
 
 
@@ -52,6 +76,8 @@ typedef struct convert_param_s
 {
     const char *base_dir;               // directory where the json or nsf is found
     const char *nsf_path;               // absolute path of NSF file
+    const uint8_t *nsf_data;            // NSF file content if already in memory (e.g. from stdin), nsf_path is only for messages
+    uint32_t nsf_size;
     int index;                          // song index
     const char *track_name;
     const char *track_file_name;
@@ -65,57 +91,206 @@ typedef struct convert_param_s
     double min_silence;                 // if the song went silent for more than min_silence seconds, consider silence detected
     bool loop_detection;                // whether to use loop detection
     unsigned long min_loop_records;     // when searching for loop, minimal loop length allowed
+    unsigned int loop_repeats;          // stop ripping once a loop repeated this many times, 0 disables
+    int vgz_level;                      // 0: write VGM, 1..9: write VGZ with this compression level
+    bool drop_redundant_writes;         // remove writes of the value a register already holds
+    char *log;                          // worker mode: messages are collected here and printed in one piece
+    size_t log_len;                     // length of messages in log
 } convert_param_t;
+
+
+typedef struct convert_job_s
+{
+    convert_param_t params;             // points to the buffers below
+    bool warn_index_err;
+    int result;
+    char base_dir[MAX_PATH_NAME];
+    char nsf_path[MAX_PATH_NAME];
+    char track_name[MAX_TRACK_NAME];
+    char track_file_name[MAX_PATH_NAME];
+    char override_out_dir[MAX_PATH_NAME];
+    char override_game_name[MAX_GAME_NAME];
+    char override_authors[MAX_AUTHOR_NAME];
+    char override_release_date[MAX_RELEASE_DATE];
+    char log[NSF2VGM_LOG_SIZE];
+    struct convert_job_s *next;
+} convert_job_t;
+
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION pool_mutex_t;
+typedef HANDLE pool_thread_t;
+# define pool_mutex_init(m)     InitializeCriticalSection(m)
+# define pool_mutex_destroy(m)  DeleteCriticalSection(m)
+# define pool_mutex_lock(m)     EnterCriticalSection(m)
+# define pool_mutex_unlock(m)   LeaveCriticalSection(m)
+# define pool_sleep_ms(ms)      Sleep(ms)
+#else
+typedef pthread_mutex_t pool_mutex_t;
+typedef pthread_t pool_thread_t;
+# define pool_mutex_init(m)     pthread_mutex_init(m, NULL)
+# define pool_mutex_destroy(m)  pthread_mutex_destroy(m)
+# define pool_mutex_lock(m)     pthread_mutex_lock(m)
+# define pool_mutex_unlock(m)   pthread_mutex_unlock(m)
+# define pool_sleep_ms(ms)      usleep((ms) * 1000)
+#endif
+
+
+// Tracks queued by process_json/process_nsf when running with -j N (N > 1)
+typedef struct convert_pool_s
+{
+    int threads;                        // worker threads, 1 converts tracks immediately
+    convert_job_t *head;                // queued jobs
+    convert_job_t *tail;
+    convert_job_t *next;                // next job to be picked by a worker
+    int total;                          // number of queued jobs
+    volatile int finished;              // number of jobs finished
+    volatile bool cancelled;            // set by main thread on ESC
+    pool_mutex_t queue_lock;            // protects next/finished
+    pool_mutex_t console_lock;          // serializes console output from workers
+} convert_pool_t;
+
+static convert_pool_t pool = { 1 };
+
+static int vgz_level = 0;               // -z N, default of "vgz_level"
+static bool drop_redundant_writes = false;  // -r, default of "drop_redundant_writes"
+static bool mmap_input = false;         // -m, map NSF files instead of reading through the block cache
+
+
+// Print a message of the conversion. In worker mode the message is collected into the
+// job log and printed with the rest of the track's messages when the track finishes.
+static void convert_print(convert_param_t *cp, const char *color, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if (NULL == cp->log)
+    {
+        if (color) fputs(color, stdout);
+        vprintf(fmt, args);
+        fputs(ANSI_ATTRIBUTE_RESET, stdout);
+        fflush(stdout);
+    }
+    else if (cp->log_len < NSF2VGM_LOG_SIZE - 1)
+    {
+        size_t room = NSF2VGM_LOG_SIZE - cp->log_len;
+        int n = snprintf(cp->log + cp->log_len, room, "%s", color ? color : "");
+        if (n > 0) cp->log_len += ((size_t)n < room) ? (size_t)n : room - 1;
+        room = NSF2VGM_LOG_SIZE - cp->log_len;
+        n = vsnprintf(cp->log + cp->log_len, room, fmt, args);
+        if (n > 0) cp->log_len += ((size_t)n < room) ? (size_t)n : room - 1;
+        room = NSF2VGM_LOG_SIZE - cp->log_len;
+        n = snprintf(cp->log + cp->log_len, room, "%s", ANSI_ATTRIBUTE_RESET);
+        if (n > 0) cp->log_len += ((size_t)n < room) ? (size_t)n : room - 1;
+    }
+    va_end(args);
+}
  
 
-static int convert_nsf(convert_param_t *cp, bool warn_index_err)
+// Emulator started on one NSF file, reused by the tracks converted from the same file
+typedef struct nsf_session_s
 {
-    int r = NSF2VGM_ERR_SUCCESS, t;
+    char nsf_path[MAX_PATH_NAME];       // NSF the emulator is started on
+    const uint8_t *nsf_data;            // NSF content if in memory
+    bool mapped;                        // reader is nfr_mmap_create
+    nsfreader_t *reader;
+    nsf_t *nsf;                         // NULL if no emulator started
+} nsf_session_t;
 
-    char out_dir[MAX_PATH_NAME] = { '\0' };
-    char vgm_path[MAX_PATH_NAME] = { '\0' };
-    char game_name[MAX_GAME_NAME] = { '\0' };
-    char authors[MAX_AUTHOR_NAME] = { '\0' };
-    char release_date[MAX_RELEASE_DATE] = { '\0' };
 
-    nsfreader_t *reader = NULL;
-    nsfrip_t *rip = NULL;
-    nsf_t *nsf = NULL;
-    uint8_t *rom = NULL;
-    uint16_t rom_len = 0;
-    
-    bool cancelled = false;
+static void session_close(nsf_session_t *s)
+{
+    if (s->nsf) nsf_destroy(s->nsf);
+    if (s->reader)
+    {
+        if (s->nsf_data)
+            nfr_mem_destroy(s->reader);
+        else if (s->mapped)
+            nfr_mmap_destroy(s->reader);
+        else
+            nfr_destroy(s->reader);
+    }
+    memset(s, 0, sizeof(nsf_session_t));
+}
+
 
+// Start emulator on the NSF file of cp, or keep the running one if it is started on the same file
+static int session_open(nsf_session_t *s, convert_param_t *cp)
+{
+    int r = NSF2VGM_ERR_SUCCESS;
+    if (s->nsf && (s->nsf_data == cp->nsf_data) && (0 == strcmp(s->nsf_path, cp->nsf_path)))
+        return r;
+    session_close(s);
     do
     {
-        reader = nfr_create(cp->nsf_path, NSF_CACHE_SIZE);
-        if (NULL == reader)
+        s->nsf_data = cp->nsf_data;
+        if (cp->nsf_data)
+            s->reader = nfr_mem_create(cp->nsf_data, cp->nsf_size);
+        else
+        {
+            if (mmap_input)
+                s->reader = nfr_mmap_create(cp->nsf_path);
+            s->mapped = (NULL != s->reader);
+            if (NULL == s->reader)
+                s->reader = nfr_create(cp->nsf_path, NSF_CACHE_SIZE);   // default, or mapping failed
+        }
+        if (NULL == s->reader)
         {
             r = NSF2VGM_ERR_IOERROR;
-            PRINT_ERR("Failed to open NSF file \"%s\"\n", cp->nsf_path);
+            convert_print(cp, ANSI_RED, "Failed to open NSF file \"%s\"\n", cp->nsf_path);
             break;
         }
-        nsf = nsf_create();
-        if (!nsf)
+        s->nsf = nsf_create();
+        if (!s->nsf)
         {
             r = NSF2VGM_ERR_OUTOFMEMORY;
-            PRINT_ERR("%s", "Out of memory\n");
+            convert_print(cp, ANSI_RED, "%s", "Out of memory\n");
             break;
         }
-        t = nsf_start_emu(nsf, reader, 10, NSF_SAMPLE_RATE, 1);
-        if (NSF_ERR_SUCCESS != t)
+        if (NSF_ERR_SUCCESS != nsf_start_emu(s->nsf, s->reader, 10, NSF_SAMPLE_RATE, 1, true))    // preload music data for ripping
         {
             r = NSF2VGM_ERR_INVALIDNSF;
-            PRINT_ERR("File \"%s\" is not a valid NSF file\n", cp->nsf_path);
+            convert_print(cp, ANSI_RED, "File \"%s\" is not a valid NSF file\n", cp->nsf_path);
             break;
         }
+        strncpy(s->nsf_path, cp->nsf_path, MAX_PATH_NAME);
+        s->nsf_path[MAX_PATH_NAME - 1] = '\0';
+    } while (0);
+    if (r != NSF2VGM_ERR_SUCCESS)
+        session_close(s);
+    return r;
+}
+
+
+static int convert_nsf(convert_param_t *cp, bool warn_index_err, nsf_session_t *session)
+{
+    int r = NSF2VGM_ERR_SUCCESS;
+
+    char out_dir[MAX_PATH_NAME] = { '\0' };
+    char vgm_path[MAX_PATH_NAME] = { '\0' };
+    char game_name[MAX_GAME_NAME] = { '\0' };
+    char authors[MAX_AUTHOR_NAME] = { '\0' };
+    char release_date[MAX_RELEASE_DATE] = { '\0' };
+
+    nsfrip_t *rip = NULL;
+    nsf_t *nsf = NULL;
+    uint8_t *rom = NULL;
+    uint16_t rom_len = 0;
+    
+    bool cancelled = false;
+
+    do
+    {
+        r = session_open(session, cp);
+        if (r != NSF2VGM_ERR_SUCCESS)
+            break;
+        nsf = session->nsf;
         // check if index is valid
         if (cp->index > nsf->header->num_songs)
         {
             r = NSF2VGM_ERR_NOMORE;
             if (warn_index_err)
             {
-                PRINT_ERR("Track %d not found in the NSF file\n", cp->index);
+                convert_print(cp, ANSI_RED, "Track %d not found in the NSF file\n", cp->index);
             }
             break;
         }
@@ -133,7 +308,7 @@ static int convert_nsf(convert_param_t *cp, bool warn_index_err)
         if (!game_name[0])
         {
             r = NSF2VGM_ERR_INSUFFICIENT_DATA;
-            PRINT_ERR("%s", "The NSF file does not contain a game name, please specify in config json\n");
+            convert_print(cp, ANSI_RED, "%s", "The NSF file does not contain a game name, please specify in config json\n");
             break;
         }
         // with game name we can decide output dir
@@ -146,8 +321,11 @@ static int convert_nsf(convert_param_t *cp, bool warn_index_err)
         {
             cwk_path_get_absolute(cp->base_dir, game_name, out_dir, MAX_PATH_NAME);
         }
-        // output VGM file
+        // output VGM file, .vgm becomes .vgz when compressed
         cwk_path_get_absolute(out_dir, cp->track_file_name, vgm_path, MAX_PATH_NAME);
+        size_t path_len = strlen(vgm_path);
+        if ((cp->vgz_level > 0) && (path_len > 4) && (0 == strcasecmp(vgm_path + path_len - 4, ".vgm")))
+            vgm_path[path_len - 1] = (vgm_path[path_len - 1] == 'M') ? 'Z' : 'z';
         // authors
         if (cp->override_authors)
         {
@@ -205,36 +383,59 @@ static int convert_nsf(convert_param_t *cp, bool warn_index_err)
         if (!rip)
         {
             r = NSF2VGM_ERR_OUTOFMEMORY;
-            PRINT_ERR("%s", "Out of memory\n");
+            convert_print(cp, ANSI_RED, "%s", "Out of memory\n");
             break;
         }
-        PRINT_INF("Source File:  %s\n", cp->nsf_path);
-        PRINT_INF("Game name:    %s\n", game_name);
-        PRINT_INF("Track %02d:     %s\n", cp->index, cp->track_name);
-        PRINT_INF("Authors:      %s\n", authors);
-        PRINT_INF("Release date: %s\n", release_date);
+        if (cp->loop_detection && !nsfrip_watch_loop(rip, cp->min_loop_records, cp->loop_repeats))
+        {
+            r = NSF2VGM_ERR_OUTOFMEMORY;
+            convert_print(cp, ANSI_RED, "%s", "Out of memory\n");
+            break;
+        }
+        convert_print(cp, ANSI_LIGHTBLUE, "Source File:  %s\n", cp->nsf_path);
+        convert_print(cp, ANSI_LIGHTBLUE, "Game name:    %s\n", game_name);
+        convert_print(cp, ANSI_LIGHTBLUE, "Track %02d:     %s\n", cp->index, cp->track_name);
+        convert_print(cp, ANSI_LIGHTBLUE, "Authors:      %s\n", authors);
+        convert_print(cp, ANSI_LIGHTBLUE, "Release date: %s\n", release_date);
         nsf_enable_apu_sniffing(nsf, true, nsfrip_apu_write_reg, (void*)rip);
         unsigned int silence_samples =  (unsigned int)(cp->min_silence * NSF_SAMPLE_RATE + 0.5);
         if (cp->silence_detection) 
             nsf_enable_slience_detect(nsf, silence_samples);
         else
             nsf_enable_slience_detect(nsf, 0);  // 0 disables slience detection
+        nsf_set_rip_mode(nsf, true);   // only APU register writes are needed, no audio
         nsf_init_song(nsf, cp->index - 1);
-        unsigned long nsamples = 0;
-        int16_t sample;
+        unsigned long nsamples = 0, block, next_progress = NSF_RIP_PROGRESS;
+        int rendered;
         // play and rip
         int save = 0, percent;
         char progress[64];
         float t;
-        ansicon_puts(ANSI_YELLOW, "Ripping ");
+        convert_print(cp, ANSI_YELLOW, "%s", "Ripping ");
         unsigned long max_samples = (unsigned long)(cp->max_track_length * NSF_SAMPLE_RATE + 0.5);
-        while (!nsf_silence_detected(nsf) && (nsamples < max_samples))
+        while (!nsf_silence_detected(nsf) && (nsamples < max_samples) && !nsfrip_loop_confirmed(rip))
         {
-            nsf_get_samples(nsf, 1, &sample);
-            nsfrip_add_sample(rip);
-            ++nsamples;
-            if (nsamples % 40000 == 0)
+            block = max_samples - nsamples;
+            if (block > NSF_RIP_BLOCK)
+                block = NSF_RIP_BLOCK;
+            rendered = nsf_get_samples(nsf, (uint16_t)block, NULL);   // stops early if silence detected
+            if (rendered <= 0)
+                break;
+            nsfrip_add_samples(rip, rendered);
+            nsamples += rendered;
+            if (nsamples >= next_progress)
             {
+                next_progress += NSF_RIP_PROGRESS;
+                if (cp->log)
+                {
+                    // worker mode: no live progress, main thread watches for ESC
+                    if (pool.cancelled)
+                    {
+                        cancelled = true;
+                        break;
+                    }
+                    continue;
+                }
                 percent = (int)(nsamples * 100.0f / max_samples);
                 t = (float)nsamples / NSF_SAMPLE_RATE;
                 snprintf(progress, 40, "%d%% (%d:%02d.%03ds)", percent, (int)t / 60, (int)t % 60, (int)((t - (int)t) * 1000));
@@ -249,46 +450,53 @@ static int convert_nsf(convert_param_t *cp, bool warn_index_err)
         percent = (int)(nsamples * 100.0f / max_samples);
         t = (float)nsamples / NSF_SAMPLE_RATE;
         snprintf(progress, 40, "%d%% (%d:%02d.%02d)", percent, (int)t / 60, (int)t % 60, (int)((t - (int)t) * 100));
-        ansicon_puts(ANSI_YELLOW, progress);
+        convert_print(cp, ANSI_YELLOW, "%s", progress);
         if (cancelled)
         {
             r = NSF2VGM_ERR_CANCELLED;
-            ansicon_puts(ANSI_RED, " Cancelled\n");
+            convert_print(cp, ANSI_RED, "%s", " Cancelled\n");
             break;
         }
         nsfrip_finish_rip(rip);
+        if (rip->truncated)
+            convert_print(cp, ANSI_LIGHTMAGENTA, "%s", " max_records reached, rip truncated.");
         // if play is finished because of silence detected, trim silence.
         // Otherwise need to find loop
         if (nsf_silence_detected(nsf))
         {
-            ansicon_puts(ANSI_YELLOW, " silence detected\n");
+            convert_print(cp, ANSI_YELLOW, "%s", " silence detected\n");
             nsfrip_trim_silence(rip, silence_samples);
         }
         else
         {
-            ansicon_puts(ANSI_YELLOW, " done\n");
+            convert_print(cp, ANSI_YELLOW, "%s", nsfrip_loop_confirmed(rip) ? " loop confirmed\n" : " done\n");
             if (cp->loop_detection)
             {
                 if (nsfrip_find_loop(rip, cp->min_loop_records))
                 {
                     nsfrip_trim_loop(rip);
                     char buf[64];
-                    float t = (float)rip->records[rip->loop_start_idx].samples / NSF_SAMPLE_RATE;
+                    float t = (float)nsfrip_record_samples(rip, rip->loop_start_idx) / NSF_SAMPLE_RATE;
                     snprintf(buf, 64, "%d:%02d.%02d", (int)t / 60, (int)t % 60, (int)((t - (int)t) * 100));
-                    ansicon_puts(ANSI_YELLOW, "Found loop at ");
-                    ansicon_puts(ANSI_YELLOW, buf);
-                    t = (float)rip->records[rip->loop_end_idx].samples / NSF_SAMPLE_RATE;
+                    convert_print(cp, ANSI_YELLOW, "%s", "Found loop at ");
+                    convert_print(cp, ANSI_YELLOW, "%s", buf);
+                    t = (float)nsfrip_record_samples(rip, rip->loop_end_idx) / NSF_SAMPLE_RATE;
                     snprintf(buf, 64, "%d:%02d.%02d", (int)t / 60, (int)t % 60, (int)((t - (int)t) * 100));
-                    ansicon_puts(ANSI_YELLOW, ". Track length ");
-                    ansicon_puts(ANSI_YELLOW, buf);
-                    ansicon_puts(ANSI_YELLOW, "s\n");
+                    convert_print(cp, ANSI_YELLOW, "%s", ". Track length ");
+                    convert_print(cp, ANSI_YELLOW, "%s", buf);
+                    convert_print(cp, ANSI_YELLOW, "%s", "s\n");
                 }
                 else
                 {
-                    ansicon_puts(ANSI_LIGHTMAGENTA, "No loop found, it is NOT unusual. Increase max_track_length and try again.\n");
+                    convert_print(cp, ANSI_LIGHTMAGENTA, "%s", "No loop found, it is NOT unusual. Increase max_track_length and try again.\n");
                 }
             }
         }
+        if (cp->drop_redundant_writes)
+        {
+            unsigned long dropped = nsfrip_drop_redundant_writes(rip);
+            convert_print(cp, ANSI_YELLOW, "Dropped %lu redundant writes\n", dropped);
+        }
         // If APU uses rom samples, dump it
         if (rip->rom_hi > rip->rom_lo)
         {
@@ -297,7 +505,7 @@ static int convert_nsf(convert_param_t *cp, bool warn_index_err)
             if (NULL == rom)
             {
                 r = NSF2VGM_ERR_OUTOFMEMORY;
-                PRINT_ERR("%s", "Out of memory\n");
+                convert_print(cp, ANSI_RED, "%s", "Out of memory\n");
                 break;
             }
             nsf_dump_rom(nsf, rip->rom_lo, rom_len, rom);
@@ -312,19 +520,220 @@ static int convert_nsf(convert_param_t *cp, bool warn_index_err)
         meta.system_name_en = VGM_DEFAULT_SYSTEM_NAME;
         meta.creator_name = VGM_DEFAULT_CREATOR;
         meta.notes = VGM_DEFAULT_NOTES;
-        r = nsfrip_export_vgm(rip, rom, rom_len, &meta, vgm_path);
+        if (cp->vgz_level > 0)
+            r = nsfrip_export_vgz(rip, rom, rom_len, &meta, vgm_path, cp->vgz_level);
+        else
+            r = nsfrip_export_vgm(rip, rom, rom_len, &meta, vgm_path);
+        if (RIP2VGM_ERR_UNSUPPORTED == r)
+        {
+            convert_print(cp, ANSI_RED, "%s", "Export VGZ failed, nsf2vgm is built without zlib\n");
+            break;
+        }
         if (r != NSF2VGM_ERR_SUCCESS)
         {
-            PRINT_ERR("%s", "Export VGM failed\n");
+            convert_print(cp, ANSI_RED, "%s", "Export VGM failed\n");
             break;
         }
-        ansicon_printf(ANSI_LIGHTGREEN, "Save VGM to %s\n\n", vgm_path);
+#ifdef NESCPU_PROFILE
+        // CPU hot spots of the track next to the VGM
+        char profile_path[MAX_PATH_NAME];
+        snprintf(profile_path, MAX_PATH_NAME, "%s.profile.csv", vgm_path);
+        if (nescpu_profile_export(nsf->cpu, profile_path, NSF_PROFILE_MAX_PC))
+            convert_print(cp, ANSI_LIGHTGREEN, "Save CPU profile to %s\n", profile_path);
+#endif
+        convert_print(cp, ANSI_LIGHTGREEN, "Save VGM to %s\n\n", vgm_path);
 
     } while (0);
     if (rom) free(rom);
-    if (nsf) nsf_destroy(nsf);
+    if (nsf) nsf_enable_apu_sniffing(nsf, false, NULL, NULL);  // rip goes away, emulator stays in session
     if (rip) nsfrip_destroy(rip);
-    if (reader) nfr_destroy(reader);
+    return r;
+}
+
+
+// Copy a string parameter into job owned buffer
+static const char * job_string(char *buf, size_t size, const char *str)
+{
+    if (NULL == str) return NULL;
+    strncpy(buf, str, size);
+    buf[size - 1] = '\0';
+    return buf;
+}
+
+
+// Queue a track for the worker pool. Parameters are copied so the caller's buffers can be reused.
+static int queue_convert(const convert_param_t *cp, bool warn_index_err)
+{
+    convert_job_t *job = malloc(sizeof(convert_job_t));
+    if (NULL == job)
+    {
+        PRINT_ERR("%s", "Out of memory\n");
+        return NSF2VGM_ERR_OUTOFMEMORY;
+    }
+    job->params = *cp;
+    job->params.base_dir = job_string(job->base_dir, MAX_PATH_NAME, cp->base_dir);
+    job->params.nsf_path = job_string(job->nsf_path, MAX_PATH_NAME, cp->nsf_path);
+    job->params.track_name = job_string(job->track_name, MAX_TRACK_NAME, cp->track_name);
+    job->params.track_file_name = job_string(job->track_file_name, MAX_PATH_NAME, cp->track_file_name);
+    job->params.override_out_dir = job_string(job->override_out_dir, MAX_PATH_NAME, cp->override_out_dir);
+    job->params.override_game_name = job_string(job->override_game_name, MAX_GAME_NAME, cp->override_game_name);
+    job->params.override_authors = job_string(job->override_authors, MAX_AUTHOR_NAME, cp->override_authors);
+    job->params.override_release_date = job_string(job->override_release_date, MAX_RELEASE_DATE, cp->override_release_date);
+    job->params.log = job->log;
+    job->params.log_len = 0;
+    job->log[0] = '\0';
+    job->warn_index_err = warn_index_err;
+    job->result = NSF2VGM_ERR_SUCCESS;
+    job->next = NULL;
+    if (pool.tail)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    ++pool.total;
+    return NSF2VGM_ERR_SUCCESS;
+}
+
+
+// Convert a track now (single thread) with the session, or queue it for the worker pool
+static int submit_convert(convert_param_t *cp, bool warn_index_err, nsf_session_t *session)
+{
+    if (pool.threads > 1)
+        return queue_convert(cp, warn_index_err);
+    return convert_nsf(cp, warn_index_err, session);
+}
+
+
+// Read number of songs from NSF header. Returns 0 if the file cannot be read.
+static int count_tracks(const char *nsf_path, const uint8_t *data, uint32_t size)
+{
+    int num = 0;
+    nsf_header_t header;
+    nsfreader_t *reader = data ? nfr_mem_create(data, size) : nfr_create(nsf_path, NSF_CACHE_SIZE);
+    if (reader)
+    {
+        if ((reader->read(reader->self, (uint8_t *)&header, 0, sizeof(nsf_header_t)) == sizeof(nsf_header_t))
+            && (0 == memcmp(header.id, "NESM\x1A", 5)))
+        {
+            num = header.num_songs;
+        }
+        if (data)
+            nfr_mem_destroy(reader);
+        else
+            nfr_destroy(reader);
+    }
+    return num;
+}
+
+
+#ifdef _WIN32
+static DWORD WINAPI convert_worker(LPVOID param)
+#else
+static void * convert_worker(void *param)
+#endif
+{
+    nsf_session_t session;  // each worker reuses its emulator while picking tracks of the same NSF
+    (void)param;
+    memset(&session, 0, sizeof(nsf_session_t));
+    for (;;)
+    {
+        pool_mutex_lock(&pool.queue_lock);
+        convert_job_t *job = pool.next;
+        if (job) pool.next = job->next;
+        pool_mutex_unlock(&pool.queue_lock);
+        if (NULL == job) break;
+
+        if (pool.cancelled)
+            job->result = NSF2VGM_ERR_CANCELLED;
+        else
+            job->result = convert_nsf(&job->params, job->warn_index_err, &session);
+
+        pool_mutex_lock(&pool.console_lock);
+        if (job->params.log_len)
+        {
+            fwrite(job->log, 1, job->params.log_len, stdout);
+            fflush(stdout);
+        }
+        pool_mutex_unlock(&pool.console_lock);
+
+        pool_mutex_lock(&pool.queue_lock);
+        ++pool.finished;
+        pool_mutex_unlock(&pool.queue_lock);
+    }
+    session_close(&session);
+    return 0;
+}
+
+
+// Run queued jobs on the worker pool, returns the first error (other than track not found) in queue order
+static int run_convert_jobs(void)
+{
+    int r = NSF2VGM_ERR_SUCCESS;
+    pool_thread_t threads[NSF2VGM_MAX_JOBS];
+    int nthreads = 0, finished;
+
+    if (0 == pool.total) return r;
+    pool_mutex_init(&pool.queue_lock);
+    pool_mutex_init(&pool.console_lock);
+    pool.next = pool.head;
+    pool.finished = 0;
+    pool.cancelled = false;
+    for (int i = 0; (i < pool.threads) && (i < pool.total); ++i)
+    {
+#ifdef _WIN32
+        threads[nthreads] = CreateThread(NULL, 0, convert_worker, NULL, 0, NULL);
+        if (NULL == threads[nthreads]) break;
+#else
+        if (pthread_create(&threads[nthreads], NULL, convert_worker, NULL) != 0) break;
+#endif
+        ++nthreads;
+    }
+    if (0 == nthreads)
+    {
+        // No thread can be created, do it ourselves
+        convert_worker(NULL);
+    }
+    else
+    {
+        do
+        {
+            pool_sleep_ms(100);
+            if (!pool.cancelled && (27 == ansicon_getch_non_blocking())) // ESC
+            {
+                pool.cancelled = true;
+                pool_mutex_lock(&pool.console_lock);
+                ansicon_puts(ANSI_RED, "Cancelling...\n");
+                pool_mutex_unlock(&pool.console_lock);
+            }
+            pool_mutex_lock(&pool.queue_lock);
+            finished = pool.finished;
+            pool_mutex_unlock(&pool.queue_lock);
+        } while (finished < pool.total);
+        for (int i = 0; i < nthreads; ++i)
+        {
+#ifdef _WIN32
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+#else
+            pthread_join(threads[i], NULL);
+#endif
+        }
+    }
+    pool_mutex_destroy(&pool.console_lock);
+    pool_mutex_destroy(&pool.queue_lock);
+
+    while (pool.head)
+    {
+        convert_job_t *job = pool.head;
+        pool.head = job->next;
+        if ((NSF2VGM_ERR_SUCCESS == r) && (job->result != NSF2VGM_ERR_SUCCESS) && (job->result != NSF2VGM_ERR_NOMORE))
+            r = job->result;
+        free(job);
+    }
+    pool.tail = NULL;
+    pool.next = NULL;
+    pool.total = 0;
+    if (pool.cancelled) r = NSF2VGM_ERR_CANCELLED;
     return r;
 }
 
@@ -347,6 +756,12 @@ int process_json(const char *cf, int select)
     double min_silence;
     bool loop_detection;
     unsigned long min_loop_records;
+    unsigned int loop_repeats;
+    int level;
+    bool drop_redundant;
+
+    nsf_session_t session;      // emulator shared by tracks
+    memset(&session, 0, sizeof(nsf_session_t));
 
     FILE *jfd = NULL;           // config file handle
     char *jstr = NULL;          // json string
@@ -506,6 +921,36 @@ int process_json(const char *cf, int select)
         {
             min_loop_records = NSFRIP_DEFAULT_MIN_LOOP_RECORDS;
         }
+        // Process optional "loop_repeats" value or use default
+        item = cJSON_GetObjectItem(config_json, "loop_repeats");
+        if (cJSON_IsNumber(item) && item->valueint >= 0)
+        {
+            loop_repeats = item->valueint;
+        }
+        else
+        {
+            loop_repeats = NSFRIP_DEFAULT_LOOP_REPEATS;
+        }
+        // Process optional "vgz_level" value or use the command line setting
+        item = cJSON_GetObjectItem(config_json, "vgz_level");
+        if (cJSON_IsNumber(item) && item->valueint >= 0 && item->valueint <= NSFRIP_VGZ_LEVEL_MAX)
+        {
+            level = item->valueint;
+        }
+        else
+        {
+            level = vgz_level;
+        }
+        // Process optional "drop_redundant_writes" or use the command line setting
+        item = cJSON_GetObjectItem(config_json, "drop_redundant_writes");
+        if (cJSON_IsBool(item))
+        {
+            drop_redundant = item->type & cJSON_True;
+        }
+        else
+        {
+            drop_redundant = drop_redundant_writes;
+        }
 
         // Iteration on tracks
         const cJSON *track = NULL;
@@ -615,6 +1060,33 @@ int process_json(const char *cf, int select)
                     {
                         params.min_loop_records = min_loop_records;
                     }
+                    item = cJSON_GetObjectItem(track, "loop_repeats");
+                    if (cJSON_IsNumber(item) && item->valueint >= 0)
+                    {
+                        params.loop_repeats = item->valueint;
+                    }
+                    else
+                    {
+                        params.loop_repeats = loop_repeats;
+                    }
+                    item = cJSON_GetObjectItem(track, "vgz_level");
+                    if (cJSON_IsNumber(item) && item->valueint >= 0 && item->valueint <= NSFRIP_VGZ_LEVEL_MAX)
+                    {
+                        params.vgz_level = item->valueint;
+                    }
+                    else
+                    {
+                        params.vgz_level = level;
+                    }
+                    item = cJSON_GetObjectItem(track, "drop_redundant_writes");
+                    if (cJSON_IsBool(item))
+                    {
+                        params.drop_redundant_writes = item->type & cJSON_True;
+                    }
+                    else
+                    {
+                        params.drop_redundant_writes = drop_redundant;
+                    }
                     params.base_dir = base_dir;
                     params.nsf_path = nsf_path;
                     params.index = index;
@@ -625,13 +1097,14 @@ int process_json(const char *cf, int select)
                     if (override_authors[0]) params.override_authors = override_authors;
                     if (override_release_date[0]) params.override_release_date = override_release_date;
 
-                    if (convert_nsf(&params, true) != NSF2VGM_ERR_SUCCESS)    // warn_index_err is true, incorrect index in json config will be warned
+                    if (submit_convert(&params, true, &session) != NSF2VGM_ERR_SUCCESS)    // warn_index_err is true, incorrect index in json config will be warned
                         break;
                 }
             }
         }
         
     } while (0);
+    session_close(&session);
     if (config_json) cJSON_Delete(config_json);
     if (jstr != NULL) free(jstr);
     if (jfd != NULL) fclose(jfd);
@@ -639,15 +1112,39 @@ int process_json(const char *cf, int select)
 }
 
 
-int process_nsf(const char *nsf, int select)
+// Convert tracks of an NSF file. If data is not NULL, it is the NSF content and nsf is only a
+// name for messages, output goes to current directory.
+int process_nsf(const char *nsf, const uint8_t *data, uint32_t size, int select)
 {
     int r = NSF2VGM_ERR_SUCCESS;
     char base_dir[MAX_PATH_NAME] = { '\0' };
+    nsf_session_t session;  // emulator shared by tracks
+    memset(&session, 0, sizeof(nsf_session_t));
     do
     {
-        cwk_path_change_basename(nsf, "", base_dir, MAX_PATH_NAME);
-        // Iterate all tracks (assume max 99)
-        for (int index = 1; index < 99; ++index)
+        if (data)
+        {
+            char *cwd = getcwd(NULL, 0);
+            if (cwd)
+            {
+                strncpy(base_dir, cwd, MAX_PATH_NAME);
+                base_dir[MAX_PATH_NAME - 1] = '\0';
+                free(cwd);
+            }
+        }
+        else
+        {
+            cwk_path_change_basename(nsf, "", base_dir, MAX_PATH_NAME);
+        }
+        // Iterate all tracks (assume max 99). When queueing for the worker pool the track
+        // count is taken from the header. If it can't be read, queue track 1 to report the error.
+        int last = 98;
+        if (pool.threads > 1)
+        {
+            last = count_tracks(nsf, data, size);
+            if (0 == last) last = 1;
+        }
+        for (int index = 1; index <= last; ++index)
         {
             if ((select != 0) && (index != select)) continue;
             convert_param_t params;
@@ -663,6 +1160,8 @@ int process_nsf(const char *nsf, int select)
             track_file_name[MAX_PATH_NAME - 1] = '\0';
             params.base_dir = base_dir;
             params.nsf_path = nsf;
+            params.nsf_data = data;
+            params.nsf_size = size;
             params.track_name = track_name;
             params.index = index;
             params.track_file_name = track_file_name;
@@ -672,69 +1171,161 @@ int process_nsf(const char *nsf, int select)
             params.min_silence = NSFRIP_DEFAULT_MIN_SLIENCE;
             params.loop_detection = true;
             params.min_loop_records = NSFRIP_DEFAULT_MIN_LOOP_RECORDS;
-            r = convert_nsf(&params, false);
+            params.loop_repeats = NSFRIP_DEFAULT_LOOP_REPEATS;
+            params.vgz_level = vgz_level;
+            params.drop_redundant_writes = drop_redundant_writes;
+            r = submit_convert(&params, false, &session);
             if  (r != NSF2VGM_ERR_SUCCESS)
                 break;    
         }
     } while (0);
+    session_close(&session);
     return r;   
 }
 
 
+// Check if a command line argument is a track number
+static bool is_number(const char *str)
+{
+    if (!*str) return false;
+    while (*str)
+    {
+        if (!isdigit((unsigned char)*str)) return false;
+        ++str;
+    }
+    return true;
+}
+
+
 int main(int argc, const char *argv[])
 {
     int r = 0;
+    nsfreader_t *stdin_reader = NULL;
     
     ansicon_setup();
     ansicon_hide_cursor();
 
     do
     {
-        if (argc < 2)
+        // options
+        int argi = 1;
+        while ((argi < argc) && (argv[argi][0] == '-') && (argv[argi][1] != '\0'))
+        {
+            if ((0 == strcmp(argv[argi], "-j")) && (argi + 1 < argc))
+            {
+                pool.threads = atoi(argv[argi + 1]);
+                argi += 2;
+            }
+            else if ((0 == strncmp(argv[argi], "-j", 2)) && is_number(argv[argi] + 2))
+            {
+                pool.threads = atoi(argv[argi] + 2);
+                ++argi;
+            }
+            else if (0 == strcmp(argv[argi], "-r"))
+            {
+                drop_redundant_writes = true;
+                ++argi;
+            }
+            else if (0 == strcmp(argv[argi], "-m"))
+            {
+                mmap_input = true;
+                ++argi;
+            }
+            else if ((0 == strcmp(argv[argi], "-z")) && (argi + 1 < argc) && is_number(argv[argi + 1]))
+            {
+                vgz_level = atoi(argv[argi + 1]);
+                argi += 2;
+            }
+            else if ((0 == strncmp(argv[argi], "-z", 2)) && is_number(argv[argi] + 2))
+            {
+                vgz_level = atoi(argv[argi] + 2);
+                ++argi;
+            }
+            else
+            {
+                break;
+            }
+        }
+        if ((argi >= argc) || ((argv[argi][0] == '-') && (argv[argi][1] != '\0')) || (pool.threads < 1) || (vgz_level > NSFRIP_VGZ_LEVEL_MAX))
         {
             r = -1;
             usage();
             break;
         }
+        if (pool.threads > NSF2VGM_MAX_JOBS) pool.threads = NSF2VGM_MAX_JOBS;
 
-        const char *infile = argv[1];   // config file
-        char infile_abs[MAX_PATH_NAME];
-        // If path of input file is relative, extend it to absolute path
-        if (cwk_path_is_relative(infile))
+        // input files, optionally followed by a track number
+        int last = argc;
+        int select = 0;
+        if ((argc - argi >= 2) && is_number(argv[argc - 1]))
         {
-            char *cwd = getcwd(NULL, 0);
-            cwk_path_get_absolute(cwd, infile, infile_abs, MAX_PATH_NAME);
-            free(cwd);
-            infile = infile_abs;
+            select = atoi(argv[argc - 1]);
+            last = argc - 1;
         }
-        const char *ext;
-        size_t el;
-        if (cwk_path_get_extension(infile, &ext, &el))
+        for (; argi < last; ++argi)
         {
-            if (0 == strcasecmp(ext + 1, "json"))
+            if (0 == strcmp(argv[argi], "-"))
             {
-                int select = 0;
-                if (argc == 3) select = atoi(argv[2]);
-                r = process_json(infile, select);
+                // NSF from stdin, read once and shared by all its tracks
+                if (NULL == stdin_reader)
+                {
+#ifdef _WIN32
+                    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+                    stdin_reader = nfr_mem_create_from_stream(stdin);
+                    if (NULL == stdin_reader)
+                    {
+                        r = NSF2VGM_ERR_IOERROR;
+                        PRINT_ERR("%s", "Failed to read NSF from stdin\n");
+                        break;
+                    }
+                }
+                r = process_nsf(NSF2VGM_STDIN_NAME, nfr_mem_data(stdin_reader), stdin_reader->size(stdin_reader->self), select);
+                if (NSF2VGM_ERR_CANCELLED == r)
+                    break;
+                continue;
             }
-            else if (0 == strcasecmp(ext + 1, "nsf"))
+            const char *infile = argv[argi];   // config file
+            char infile_abs[MAX_PATH_NAME];
+            // If path of input file is relative, extend it to absolute path
+            if (cwk_path_is_relative(infile))
             {
-                int select = 0;
-                if (argc == 3) select = atoi(argv[2]);
-                r = process_nsf(infile, select);
+                char *cwd = getcwd(NULL, 0);
+                cwk_path_get_absolute(cwd, infile, infile_abs, MAX_PATH_NAME);
+                free(cwd);
+                infile = infile_abs;
             }
-            else
+            const char *ext;
+            size_t el;
+            if (cwk_path_get_extension(infile, &ext, &el))
             {
-                r = -1;
-                usage();
-                break;
+                if (0 == strcasecmp(ext + 1, "json"))
+                {
+                    r = process_json(infile, select);
+                }
+                else if (0 == strcasecmp(ext + 1, "nsf"))
+                {
+                    r = process_nsf(infile, NULL, 0, select);
+                }
+                else
+                {
+                    r = -1;
+                    usage();
+                    break;
+                }
             }
+            if (NSF2VGM_ERR_CANCELLED == r)
+                break;
+        }
+        if ((r != -1) && (r != NSF2VGM_ERR_CANCELLED) && (pool.threads > 1))
+        {
+            r = run_convert_jobs();
         }
-
     } while (0);
+    if (stdin_reader) nfr_mem_destroy(stdin_reader);
  
     ansicon_show_cursor();
     ansicon_restore();
 
     return r;
-}
\ No newline at end of file
+}
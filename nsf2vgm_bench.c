@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+#include "platform.h"
+#include "nsf.h"
+#include "nsfreader_file.h"
+#include "nsfreader_mmap.h"
+#include "nsfrip.h"
+
+/*
+    nsf2vgm-bench: run the conversion pipeline stage by stage on NSF files and report time per
+    stage as JSON on stdout. Stages are INIT (nsf_init_song), emulation (ripping), loop detection
+    (nsfrip_find_loop) and VGM export. Settings are the nsf2vgm defaults.
+    With -c it runs checks instead: APU writes after restoring a snapshot, into the same and into
+    a fresh emulator, must match the writes after taking it, and replaying the ripped records with
+    and without nsfrip_drop_redundant_writes must give the same APU timer periods.
+ */
+
+#define BENCH_SAMPLE_RATE           44100
+#define BENCH_CACHE_SIZE            4096
+#define BENCH_BLOCK                 4000    // samples per nsf_get_samples call
+#define BENCH_DEFAULT_TRACKS        3
+#define BENCH_DEFAULT_SECONDS       120.0
+#define BENCH_MIN_SILENCE           2
+#define BENCH_MIN_LOOP_RECORDS      1000
+#define BENCH_VGM_FILE              "nsf2vgm-bench.vgm"
+
+
+typedef struct bench_result_s
+{
+    unsigned long samples;
+    uint64_t cycles;        // emulated CPU cycles, excluding INIT
+    unsigned long records;
+    unsigned int loops;     // tracks with loop found
+    double init;            // seconds per stage
+    double emulation;
+    double loop_search;
+    double export;
+} bench_result_t;
+
+
+static double bench_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; ++str)
+    {
+        if ((*str == '"') || (*str == '\\'))
+            printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            printf("\\u%04x", (unsigned char)*str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+
+static void print_result(const bench_result_t *b)
+{
+    double total = b->init + b->emulation + b->loop_search + b->export;
+    printf("\"samples\": %lu, \"cycles\": %llu, \"records\": %lu, \"loops\": %u, ",
+        b->samples, (unsigned long long)b->cycles, b->records, b->loops);
+    printf("\"init_ms\": %.3f, \"emulation_ms\": %.3f, \"loop_ms\": %.3f, \"export_ms\": %.3f, \"total_ms\": %.3f, ",
+        b->init * 1000, b->emulation * 1000, b->loop_search * 1000, b->export * 1000, total * 1000);
+    printf("\"cycles_per_second\": %.0f, \"realtime_factor\": %.1f",
+        (b->emulation > 0) ? b->cycles / b->emulation : 0.0,
+        (total > 0) ? (double)b->samples / BENCH_SAMPLE_RATE / total : 0.0);
+}
+
+
+// Rip one track the way nsf2vgm does, timing each stage
+static int bench_track(nsf_t *nsf, int index, double seconds, bench_result_t *b)
+{
+    int r = 0;
+    nsfrip_t *rip = NULL;
+    uint8_t *rom = NULL;
+    uint16_t rom_len = 0;
+    double t0, t1;
+    do
+    {
+        rip = nsfrip_create(NSFRIP_DEFAULT_MAX_RECORDS);
+        if (NULL == rip)
+        {
+            r = -1;
+            break;
+        }
+        nsf_enable_apu_sniffing(nsf, true, nsfrip_apu_write_reg, (void *)rip);
+        nsf_enable_slience_detect(nsf, BENCH_MIN_SILENCE * BENCH_SAMPLE_RATE);
+        nsf_set_rip_mode(nsf, true);
+        // INIT
+        t0 = bench_time();
+        nsf_init_song(nsf, index - 1);
+        t1 = bench_time();
+        b->init = t1 - t0;
+        // emulation
+        unsigned long max_samples = (unsigned long)(seconds * BENCH_SAMPLE_RATE + 0.5);
+        unsigned long block;
+        int rendered;
+        t0 = t1;
+        while (!nsf_silence_detected(nsf) && (b->samples < max_samples))
+        {
+            block = max_samples - b->samples;
+            if (block > BENCH_BLOCK)
+                block = BENCH_BLOCK;
+            rendered = nsf_get_samples(nsf, (uint16_t)block, NULL);
+            if (rendered <= 0)
+                break;
+            nsfrip_add_samples(rip, rendered);
+            b->samples += rendered;
+        }
+        nsfrip_finish_rip(rip);
+        t1 = bench_time();
+        b->emulation = t1 - t0;
+        b->cycles = nsf->cycles;
+        b->records = rip->records_len;
+        // loop detection
+        t0 = t1;
+        if (nsf_silence_detected(nsf))
+        {
+            nsfrip_trim_silence(rip, BENCH_MIN_SILENCE * BENCH_SAMPLE_RATE);
+        }
+        else if (nsfrip_find_loop(rip, BENCH_MIN_LOOP_RECORDS))
+        {
+            nsfrip_trim_loop(rip);
+            b->loops = 1;
+        }
+        t1 = bench_time();
+        b->loop_search = t1 - t0;
+        // VGM export
+        t0 = t1;
+        if (rip->rom_hi > rip->rom_lo)
+        {
+            rom_len = rip->rom_hi - rip->rom_lo + 1;
+            rom = malloc(rom_len);
+            if (NULL == rom)
+            {
+                r = -1;
+                break;
+            }
+            nsf_dump_rom(nsf, rip->rom_lo, rom_len, rom);
+        }
+        vgm_meta_t meta = { 0 };
+        if (nsfrip_export_vgm(rip, rom, rom_len, &meta, BENCH_VGM_FILE) != RIP2VGM_ERR_SUCCESS)
+        {
+            r = -1;
+            break;
+        }
+        t1 = bench_time();
+        b->export = t1 - t0;
+        remove(BENCH_VGM_FILE);
+    } while (0);
+    nsf_enable_apu_sniffing(nsf, false, NULL, NULL);
+    if (rom) free(rom);
+    if (rip) nsfrip_destroy(rip);
+    return r;
+}
+
+
+// APU write trace, FNV-1a over (addr, val, sample)
+typedef struct bench_trace_s
+{
+    uint64_t hash;
+    unsigned long writes;
+    unsigned long last_sample;  // sample of the last write
+} bench_trace_t;
+
+
+static void bench_trace_write(uint16_t addr, uint8_t val, unsigned long sample, void *param)
+{
+    bench_trace_t *t = (bench_trace_t *)param;
+    uint8_t b[7] = { addr & 0xFF, addr >> 8, val, sample & 0xFF, (sample >> 8) & 0xFF, (sample >> 16) & 0xFF, (sample >> 24) & 0xFF };
+    for (int i = 0; i < 7; ++i)
+    {
+        t->hash ^= b[i];
+        t->hash *= 0x100000001B3ULL;
+    }
+    ++(t->writes);
+    t->last_sample = sample;
+}
+
+
+static void bench_trace_init(bench_trace_t *t)
+{
+    t->hash = 0xCBF29CE484222325ULL;
+    t->writes = 0;
+    t->last_sample = 0;
+}
+
+
+// Rip up to samples samples, passing APU writes to write if not NULL
+static unsigned long bench_rip(nsf_t *nsf, unsigned long samples, apu_write_reg_cb write, void *param)
+{
+    unsigned long total = 0, block;
+    int rendered;
+    nsf_enable_apu_sniffing(nsf, (NULL != write), write, param);
+    while (!nsf_silence_detected(nsf) && (total < samples))
+    {
+        block = samples - total;
+        if (block > BENCH_BLOCK)
+            block = BENCH_BLOCK;
+        rendered = nsf_get_samples(nsf, (uint16_t)block, NULL);
+        if (rendered <= 0)
+            break;
+        total += rendered;
+    }
+    nsf_enable_apu_sniffing(nsf, false, NULL, NULL);
+    return total;
+}
+
+
+// Snapshot half way to the last APU write of the track, rip the rest three times: after the
+// snapshot, after restoring it and after restoring it into fork (a second emulator on the same NSF).
+// Fails if there are no writes after the snapshot, nothing would be compared.
+static int bench_check_snapshot(nsf_t *nsf, nsf_t *fork, int index, double seconds, bench_trace_t *t)
+{
+    unsigned long length = (unsigned long)(seconds * BENCH_SAMPLE_RATE + 0.5);
+    unsigned long half;
+    void *snap = malloc(nsf_snapshot_size());
+    int r = -1;
+    do
+    {
+        if (NULL == snap)
+            break;
+        nsf_enable_slience_detect(nsf, BENCH_MIN_SILENCE * BENCH_SAMPLE_RATE);
+        nsf_set_rip_mode(nsf, true);
+        // Find the last write
+        nsf_init_song(nsf, index - 1);
+        bench_trace_init(&t[0]);
+        bench_rip(nsf, length, bench_trace_write, (void *)&t[0]);
+        half = t[0].last_sample / 2;
+        // Snapshot and rip the rest
+        nsf_init_song(nsf, index - 1);
+        bench_rip(nsf, half, NULL, NULL);
+        if (NSF_ERR_SUCCESS != nsf_snapshot(nsf, snap, nsf_snapshot_size()))
+            break;
+        bench_trace_init(&t[0]);
+        bench_rip(nsf, length - half, bench_trace_write, (void *)&t[0]);
+        if (NSF_ERR_SUCCESS != nsf_restore(nsf, snap, nsf_snapshot_size()))
+            break;
+        bench_trace_init(&t[1]);
+        bench_rip(nsf, length - half, bench_trace_write, (void *)&t[1]);
+        nsf_enable_slience_detect(fork, BENCH_MIN_SILENCE * BENCH_SAMPLE_RATE);
+        nsf_set_rip_mode(fork, true);
+        if (NSF_ERR_SUCCESS != nsf_restore(fork, snap, nsf_snapshot_size()))
+            break;
+        bench_trace_init(&t[2]);
+        bench_rip(fork, length - half, bench_trace_write, (void *)&t[2]);
+        if ((t[0].writes > 0)
+            && (t[0].hash == t[1].hash) && (t[0].writes == t[1].writes)
+            && (t[0].hash == t[2].hash) && (t[0].writes == t[2].writes))
+            r = 0;
+    } while (0);
+    if (snap) free(snap);
+    return r;
+}
+
+
+// Records of a rip, flat copy
+static nsfrip_record_t *bench_copy_records(nsfrip_t *rip)
+{
+    nsfrip_record_t *records = malloc((rip->records_len + 1) * sizeof(nsfrip_record_t));
+    if (NULL == records)
+        return NULL;
+    for (unsigned long i = 0; i < rip->records_len; ++i)
+        records[i] = *nsfrip_record(rip, i);
+    return records;
+}
+
+
+// Records replayed into an APU, see bench_replay
+typedef struct bench_replay_s
+{
+    nesbus_t *bus;
+    nesapu_t *apu;
+    const nsfrip_record_t *records;
+    unsigned long len, next;
+    unsigned long sample;   // time of the next record
+    uint32_t clock_rate;
+} bench_replay_t;
+
+
+// DMC sample fetches, sample data doesn't affect timer periods
+static bool bench_replay_read_rom(uint16_t addr, uint8_t *rval, void *cookie, uint8_t owner)
+{
+    *rval = 0;
+    return true;
+}
+
+
+static bool bench_replay_init(bench_replay_t *r, const nsf_t *nsf, const nsfrip_record_t *records, unsigned long len)
+{
+    memset(r, 0, sizeof(bench_replay_t));
+    r->records = records;
+    r->len = len;
+    r->sample = len ? records[0].wait_samples : 0;
+    r->clock_rate = nsf->clock_rate;
+    r->bus = nesbus_create(4, 3);
+    r->apu = nesapu_create(nsf->format, nsf->clock_rate, BENCH_SAMPLE_RATE);
+    if ((NULL == r->bus) || (NULL == r->apu) || !nesapu_attach_bus(r->apu, r->bus))
+        return false;
+    if (!nesbus_add_read_handler(r->bus, "ROM", 0x8000, 0xFFFF, bench_replay_read_rom, NULL))
+        return false;
+    nesapu_reset(r->apu);
+    return true;
+}
+
+
+static void bench_replay_free(bench_replay_t *r)
+{
+    if (r->apu) nesapu_destroy(r->apu);
+    if (r->bus) nesbus_destroy(r->bus);
+}
+
+
+// Apply records up to and including sample, then run APU to sample
+static void bench_replay(bench_replay_t *r, unsigned long sample)
+{
+    while ((r->next < r->len) && (r->sample <= sample))
+    {
+        uint32_t cycles = (uint32_t)((uint64_t)r->sample * r->clock_rate / BENCH_SAMPLE_RATE);
+        nesapu_run(r->apu, cycles - r->apu->cycles);
+        if (r->records[r->next].reg < NESAPU_REG_COUNT)
+            nesbus_write(r->bus, NESAPU_REG_BASE + r->records[r->next].reg, r->records[r->next].val);
+        ++(r->next);
+        if (r->next < r->len)
+            r->sample += r->records[r->next].wait_samples;
+    }
+    nesapu_run(r->apu, (uint32_t)((uint64_t)sample * r->clock_rate / BENCH_SAMPLE_RATE) - r->apu->cycles);
+}
+
+
+static bool bench_same_periods(const nesapu_t *a, const nesapu_t *b)
+{
+    return (a->pulse[0].timer_period == b->pulse[0].timer_period)
+        && (a->pulse[1].timer_period == b->pulse[1].timer_period)
+        && (a->triangle.timer_period == b->triangle.timer_period)
+        && (a->noise.timer_period == b->noise.timer_period)
+        && (a->dmc.timer_period == b->dmc.timer_period);
+}
+
+
+// Rip the track the way nsf2vgm -r does. Replay the records before and after dropping redundant
+// writes, channel timer periods must match at every record time of the original stream.
+static int bench_check_redundant(nsf_t *nsf, int index, double seconds, unsigned long *dropped)
+{
+    nsfrip_t *rip = NULL;
+    nsfrip_record_t *before = NULL, *after = NULL;
+    unsigned long before_len = 0, after_len = 0;
+    bench_replay_t a, b;
+    int r = -1;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    do
+    {
+        rip = nsfrip_create(NSFRIP_DEFAULT_MAX_RECORDS);
+        if (NULL == rip)
+            break;
+        nsf_enable_slience_detect(nsf, BENCH_MIN_SILENCE * BENCH_SAMPLE_RATE);
+        nsf_set_rip_mode(nsf, true);
+        nsf_init_song(nsf, index - 1);
+        nsfrip_add_samples(rip, bench_rip(nsf, (unsigned long)(seconds * BENCH_SAMPLE_RATE + 0.5), nsfrip_apu_write_reg, (void *)rip));
+        nsfrip_finish_rip(rip);
+        if (nsf_silence_detected(nsf))
+            nsfrip_trim_silence(rip, BENCH_MIN_SILENCE * BENCH_SAMPLE_RATE);
+        else if (nsfrip_find_loop(rip, BENCH_MIN_LOOP_RECORDS))
+            nsfrip_trim_loop(rip);
+        before_len = rip->records_len;
+        before = bench_copy_records(rip);
+        *dropped = nsfrip_drop_redundant_writes(rip);
+        after_len = rip->records_len;
+        after = bench_copy_records(rip);
+        if ((NULL == before) || (NULL == after))
+            break;
+        if (!bench_replay_init(&a, nsf, before, before_len) || !bench_replay_init(&b, nsf, after, after_len))
+            break;
+        r = 0;
+        while (a.next < a.len)
+        {
+            unsigned long sample = a.sample;
+            bench_replay(&a, sample);
+            bench_replay(&b, sample);
+            if (!bench_same_periods(a.apu, b.apu))
+            {
+                r = -1;
+                break;
+            }
+        }
+    } while (0);
+    bench_replay_free(&a);
+    bench_replay_free(&b);
+    if (before) free(before);
+    if (after) free(after);
+    if (rip) nsfrip_destroy(rip);
+    return r;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: nsf2vgm-bench [-c] [-m] [-t tracks] [-s seconds] file.nsf ...\n");
+    fprintf(stderr, "       -c: check snapshot/restore and redundant write removal instead of timing\n");
+    fprintf(stderr, "       -m: read NSF files through a memory mapping\n");
+    fprintf(stderr, "       -t: tracks per file (default %d, 0 for all)\n", BENCH_DEFAULT_TRACKS);
+    fprintf(stderr, "       -s: max seconds ripped per track (default %.0f)\n", BENCH_DEFAULT_SECONDS);
+}
+
+
+int main(int argc, const char *argv[])
+{
+    int tracks = BENCH_DEFAULT_TRACKS;
+    double seconds = BENCH_DEFAULT_SECONDS;
+    bool check = false;
+    bool mapped = false;
+    int argi = 1;
+    while ((argi + 1 < argc) && (argv[argi][0] == '-'))
+    {
+        if (0 == strcmp(argv[argi], "-c"))
+        {
+            check = true;
+            ++argi;
+            continue;
+        }
+        if (0 == strcmp(argv[argi], "-m"))
+        {
+            mapped = true;
+            ++argi;
+            continue;
+        }
+        if (0 == strcmp(argv[argi], "-t"))
+            tracks = atoi(argv[argi + 1]);
+        else if (0 == strcmp(argv[argi], "-s"))
+            seconds = atof(argv[argi + 1]);
+        else
+            break;
+        argi += 2;
+    }
+    if ((argi >= argc) || (argv[argi][0] == '-') || (tracks < 0) || (seconds <= 0))
+    {
+        usage();
+        return -1;
+    }
+
+    bench_result_t total;
+    memset(&total, 0, sizeof(bench_result_t));
+    bool first = true;
+    int checked = 0, failed = 0;
+    int r = 0;
+    printf("{\n  \"tracks\": [");
+    for (; argi < argc; ++argi)
+    {
+        nsfreader_t *reader = mapped ? nfr_mmap_create(argv[argi]) : NULL;
+        bool reader_mapped = (NULL != reader);
+        if (NULL == reader)
+            reader = nfr_create(argv[argi], BENCH_CACHE_SIZE);  // default, or mapping failed
+        nsf_t *nsf = NULL, *fork = NULL;
+        do
+        {
+            if (NULL == reader)
+            {
+                fprintf(stderr, "Unable to open %s\n", argv[argi]);
+                r = -1;
+                break;
+            }
+            nsf = nsf_create();
+            if ((NULL == nsf) || (NSF_ERR_SUCCESS != nsf_start_emu(nsf, reader, 10, BENCH_SAMPLE_RATE, 1, true)))
+            {
+                fprintf(stderr, "Unable to start emulator on %s\n", argv[argi]);
+                r = -1;
+                break;
+            }
+            if (check)
+            {
+                fork = nsf_create();
+                if ((NULL == fork) || (NSF_ERR_SUCCESS != nsf_start_emu(fork, reader, 10, BENCH_SAMPLE_RATE, 1, true)))
+                {
+                    fprintf(stderr, "Unable to start emulator on %s\n", argv[argi]);
+                    r = -1;
+                    break;
+                }
+            }
+            int songs = nsf->header->num_songs;
+            if ((tracks > 0) && (tracks < songs))
+                songs = tracks;
+            for (int index = 1; index <= songs; ++index)
+            {
+                if (check)
+                {
+                    bench_trace_t t[3];
+                    memset(t, 0, sizeof(t));
+                    unsigned long dropped = 0;
+                    bool ok = (0 == bench_check_snapshot(nsf, fork, index, seconds, t));
+                    bool replay_ok = (0 == bench_check_redundant(nsf, index, seconds, &dropped));
+                    printf("%s\n    { \"file\": ", first ? "" : ",");
+                    print_json_string(argv[argi]);
+                    printf(", \"track\": %d, \"writes\": %lu, \"snapshot\": \"%s\", ", index, t[0].writes, ok ? "ok" : (t[0].writes ? "mismatch" : "no writes"));
+                    printf("\"dropped\": %lu, \"replay\": \"%s\" }", dropped, replay_ok ? "ok" : "mismatch");
+                    first = false;
+                    ++checked;
+                    if (!ok)
+                        fprintf(stderr, "Snapshot %s on %s track %d\n", t[0].writes ? "mismatch" : "not tested, no writes", argv[argi], index);
+                    if (!replay_ok)
+                        fprintf(stderr, "Redundant write replay mismatch on %s track %d\n", argv[argi], index);
+                    if (!ok || !replay_ok)
+                    {
+                        ++failed;
+                        r = -1;
+                    }
+                    continue;
+                }
+                bench_result_t b;
+                memset(&b, 0, sizeof(bench_result_t));
+                if (bench_track(nsf, index, seconds, &b) != 0)
+                {
+                    fprintf(stderr, "Failed on %s track %d\n", argv[argi], index);
+                    r = -1;
+                    continue;
+                }
+                printf("%s\n    { \"file\": ", first ? "" : ",");
+                print_json_string(argv[argi]);
+                printf(", \"track\": %d, ", index);
+                print_result(&b);
+                printf(" }");
+                first = false;
+                total.samples += b.samples;
+                total.cycles += b.cycles;
+                total.records += b.records;
+                total.loops += b.loops;
+                total.init += b.init;
+                total.emulation += b.emulation;
+                total.loop_search += b.loop_search;
+                total.export += b.export;
+            }
+        } while (0);
+        if (fork) nsf_destroy(fork);
+        if (nsf) nsf_destroy(nsf);
+        if (reader)
+        {
+            if (reader_mapped)
+                nfr_mmap_destroy(reader);
+            else
+                nfr_destroy(reader);
+        }
+    }
+    printf("\n  ],\n  \"total\": { ");
+    if (check)
+        printf("\"tracks\": %d, \"failed\": %d", checked, failed);
+    else
+        print_result(&total);
+    printf(" }\n}\n");
+    return r;
+}
@@ -4,6 +4,26 @@
 #include "nsfreader_file.h"
 
 
+#define NFR_NO_BLOCK    0xFFFFFFFF
+
+#ifdef NFR_MEASURE_CACHE_PERFORMACE
+# define NFR_COUNT(ctx, field, n) ((ctx)->stats.field += (n))
+#else
+# define NFR_COUNT(ctx, field, n) ((void)0)
+#endif
+
+
+// Cache block, holds block_size bytes from an aligned file offset
+typedef struct nfr_block_s
+{
+    uint32_t offset;            // file offset of block, NFR_NO_BLOCK if empty
+    uint32_t length;            // valid bytes, less than block_size at end of file
+    unsigned long long used;    // LRU stamp
+    bool prefetched;            // loaded ahead, not used yet
+    uint8_t *data;
+} nfr_block_t;
+
+
 // NSF File Reader
 typedef struct nfr_ctx_s
 {
@@ -11,71 +31,163 @@ typedef struct nfr_ctx_s
     nsfreader_t super;
     // Private fields
     FILE *fd;
+    uint32_t file_size;
     uint8_t *cache;
-    uint32_t cache_size;
-    uint32_t cache_data_length;
-    uint32_t cache_offset;
+    nfr_block_t *blocks;
+    nfr_block_t *last;          // most recently used block
+    uint32_t block_count;
+    uint32_t block_size;
+    unsigned long long clock;
 #ifdef NFR_MEASURE_CACHE_PERFORMACE
-    unsigned long long cache_hit;
-    unsigned long long cache_miss;
+    nfr_stats_t stats;
 #endif
 } nfr_t;
 
 
-static uint32_t nfr_read(nsfreader_t *self, uint8_t *out, uint32_t offset, uint32_t length)
+// Load block at offset into the least recently used slot
+static nfr_block_t * load_block(nfr_t *ctx, uint32_t offset)
 {
-    // Simplified implementation here considering most of the time we're requesting 1 byte
-    nfr_t *ctx = (nfr_t*)self;
-    if (length == 0)
+    nfr_block_t *victim = &(ctx->blocks[0]);
+    for (uint32_t i = 1; i < ctx->block_count; ++i)
+    {
+        if (ctx->blocks[i].used < victim->used)
+            victim = &(ctx->blocks[i]);
+    }
+    if (victim->offset != NFR_NO_BLOCK)
+        NFR_COUNT(ctx, eviction, 1);
+    victim->offset = NFR_NO_BLOCK;
+    if (ctx->last == victim)
+        ctx->last = 0;
+    if (0 != fseek(ctx->fd, offset, SEEK_SET))
         return 0;
-    if (length > 1)
+    victim->length = (uint32_t)fread(victim->data, 1, ctx->block_size, ctx->fd);
+    if (0 == victim->length)
+        return 0;
+    victim->offset = offset;
+    victim->used = ++(ctx->clock);
+    victim->prefetched = false;
+    return victim;
+}
+
+
+// Find block containing offset (aligned), load it on miss and prefetch the next one
+static nfr_block_t * find_block(nfr_t *ctx, uint32_t offset)
+{
+    nfr_block_t *blk = ctx->last;
+    if (blk && (blk->offset == offset))
     {
-        fseek(ctx->fd, offset, SEEK_SET);
-        return (uint32_t)(fread(out, 1, length, ctx->fd));
+        NFR_COUNT(ctx, cache_hit, 1);
+        return blk;
     }
-    if ((offset >= ctx->cache_offset) && (offset < ctx->cache_offset + ctx->cache_data_length))
+    blk = 0;
+    for (uint32_t i = 0; i < ctx->block_count; ++i)
     {
-        // Cache hit
-#ifdef NFR_MEASURE_CACHE_PERFORMACE
-        ++(ctx->cache_hit);
-#endif
-        *out = ctx->cache[offset - ctx->cache_offset];
-        return 1;
+        if (ctx->blocks[i].offset == offset)
+        {
+            blk = &(ctx->blocks[i]);
+            break;
+        }
     }
-    // Cache miss
-#ifdef NFR_MEASURE_CACHE_PERFORMACE
-    ++(ctx->cache_miss);
-#endif
-    fseek(ctx->fd, offset, SEEK_SET);
-    ctx->cache_offset = offset;
-    ctx->cache_data_length = (int32_t)fread(ctx->cache, 1, ctx->cache_size, ctx->fd);
-    if (ctx->cache_data_length > 0)
+    if (blk)
     {
-        *out = ctx->cache[0];
-        return 1;
+        NFR_COUNT(ctx, cache_hit, 1);
+        if (blk->prefetched)
+        {
+            NFR_COUNT(ctx, prefetch_hit, 1);
+            blk->prefetched = false;
+        }
     }
-    // Offset is out-of-bound
-    return 0;
+    else
+    {
+        NFR_COUNT(ctx, cache_miss, 1);
+        blk = load_block(ctx, offset);
+        if (0 == blk)
+            return 0;
+        // Prefetch next block while the file position is there. It is given an older stamp than
+        // the block just loaded so it goes first if not used.
+        uint32_t next = offset + ctx->block_size;
+        if ((ctx->block_count > 1) && (next < ctx->file_size) && (next > offset))
+        {
+            bool cached = false;
+            for (uint32_t i = 0; i < ctx->block_count; ++i)
+            {
+                if (ctx->blocks[i].offset == next)
+                {
+                    cached = true;
+                    break;
+                }
+            }
+            if (!cached)
+            {
+                nfr_block_t *pre = load_block(ctx, next);
+                if (pre)
+                {
+                    NFR_COUNT(ctx, prefetch, 1);
+                    pre->prefetched = true;
+                    pre->used = ctx->clock - 1;
+                }
+            }
+        }
+    }
+    blk->used = ++(ctx->clock);
+    ctx->last = blk;
+    return blk;
 }
 
 
-static uint32_t nfr_size(nsfreader_t *self)
+static uint32_t nfr_read(nsfreader_t *self, uint8_t *out, uint32_t offset, uint32_t length)
 {
     nfr_t *ctx = (nfr_t*)self;
-    if (ctx && ctx->fd)
+    uint32_t done = 0, base, pos, n;
+    nfr_block_t *blk;
+
+    NFR_COUNT(ctx, reads, 1);
+    if ((length == 0) || (offset >= ctx->file_size))
+        return 0;
+    if (length > ctx->file_size - offset)
+        length = ctx->file_size - offset;
+    while (done < length)
     {
-        fseek(ctx->fd, 0, SEEK_END);
-        size_t len = ftell(ctx->fd);
-        return (uint32_t)len;
+        base = (offset + done) & ~(ctx->block_size - 1);
+        blk = find_block(ctx, base);
+        if (0 == blk)
+            break;
+        pos = offset + done - base;
+        if (pos >= blk->length)
+            break;
+        n = blk->length - pos;
+        if (n > length - done)
+            n = length - done;
+        if (n == 1)
+            out[done] = blk->data[pos];
+        else
+            memcpy(out + done, blk->data + pos, n);
+        done += n;
     }
+    NFR_COUNT(ctx, bytes, done);
+    return done;
+}
+
+
+static uint32_t nfr_size(nsfreader_t *self)
+{
+    nfr_t *ctx = (nfr_t*)self;
+    if (ctx && ctx->fd)
+        return ctx->file_size;
     return 0;
 }
 
 
-nsfreader_t * nfr_create(const char *fn, uint32_t cache_size)
+nsfreader_t * nfr_create_cache(const char *fn, uint32_t block_size, uint32_t blocks)
 {
     FILE *fd = 0;
     nfr_t *ctx = 0;
+    uint32_t size = 1;
+
+    while ((size < block_size) && (size < 0x80000000))
+        size <<= 1;
+    if (blocks < 1)
+        blocks = 1;
 
     fd = fopen(fn, "rb");
     if (0 == fd)
@@ -84,28 +196,38 @@ nsfreader_t * nfr_create(const char *fn, uint32_t cache_size)
     ctx = (nfr_t*)malloc(sizeof(nfr_t));
     if (0 == ctx)
         goto create_exit;
+    memset(ctx, 0, sizeof(nfr_t));
 
-    ctx->cache = (uint8_t*)malloc(cache_size);
+    ctx->cache = (uint8_t*)malloc((size_t)size * blocks);
     if (0 == ctx->cache)
         goto create_exit;
+    ctx->blocks = (nfr_block_t*)malloc(sizeof(nfr_block_t) * blocks);
+    if (0 == ctx->blocks)
+        goto create_exit;
 
+    fseek(fd, 0, SEEK_END);
+    ctx->file_size = (uint32_t)ftell(fd);
     ctx->fd = fd;
-    ctx->cache_size = cache_size;
-    ctx->cache_data_length = 0;
-    ctx->cache_offset = 0;
+    ctx->block_size = size;
+    ctx->block_count = blocks;
+    for (uint32_t i = 0; i < blocks; ++i)
+    {
+        ctx->blocks[i].offset = NFR_NO_BLOCK;
+        ctx->blocks[i].length = 0;
+        ctx->blocks[i].used = 0;
+        ctx->blocks[i].prefetched = false;
+        ctx->blocks[i].data = ctx->cache + (size_t)size * i;
+    }
 
     ctx->super.self = (nsfreader_t*)ctx;
     ctx->super.read = nfr_read;
     ctx->super.size = nfr_size;
 
-#ifdef NFR_MEASURE_CACHE_PERFORMACE
-    ctx->cache_hit = 0;
-    ctx->cache_miss = 0;
-#endif
-
     return (nsfreader_t*)ctx;
 
 create_exit:
+    if (ctx && ctx->blocks)
+        free(ctx->blocks);
     if (ctx && ctx->cache)
         free(ctx->cache);
     if (ctx)
@@ -116,11 +238,22 @@ create_exit:
 }
 
 
+nsfreader_t * nfr_create(const char *fn, uint32_t cache_size)
+{
+    uint32_t blocks = cache_size / NFR_DEFAULT_BLOCK_SIZE;
+    if (blocks < NFR_MIN_BLOCKS)
+        blocks = NFR_MIN_BLOCKS;
+    return nfr_create_cache(fn, NFR_DEFAULT_BLOCK_SIZE, blocks);
+}
+
+
 void nfr_destroy(nsfreader_t *nfr)
 {
     nfr_t *ctx = (nfr_t*)nfr;
     if (0 == ctx)
         return;
+    if (ctx->blocks)
+        free(ctx->blocks);
     if (ctx->cache)
         free(ctx->cache);
     if (ctx->fd)
@@ -131,10 +264,31 @@ void nfr_destroy(nsfreader_t *nfr)
 
 #ifdef NFR_MEASURE_CACHE_PERFORMACE
 
+bool nfr_get_stats(nsfreader_t *nfr, nfr_stats_t *stats)
+{
+    nfr_t *ctx = (nfr_t*)nfr;
+    if ((0 == ctx) || (0 == stats))
+        return false;
+    *stats = ctx->stats;
+    return true;
+}
+
+
+void nfr_reset_stats(nsfreader_t *nfr)
+{
+    nfr_t *ctx = (nfr_t*)nfr;
+    if (ctx)
+        memset(&(ctx->stats), 0, sizeof(nfr_stats_t));
+}
+
+
 void nfr_show_cache_status(nsfreader_t *nfr)
 {
     nfr_t *ctx = (nfr_t*)nfr;
-    NSF_PRINTF("Cache Status: (%llu/%llu), hit %.1f%%\n", ctx->cache_hit, ctx->cache_hit + ctx->cache_miss, (ctx->cache_hit * 100.0f) / (ctx->cache_hit + ctx->cache_miss));
+    unsigned long long lookups = ctx->stats.cache_hit + ctx->stats.cache_miss;
+    NSF_PRINTF("Cache Status: (%llu/%llu), hit %.1f%%, %llu reads, %llu bytes, prefetch %llu/%llu used, %llu evictions\n",
+        ctx->stats.cache_hit, lookups, lookups ? (ctx->stats.cache_hit * 100.0f) / lookups : 0.0f,
+        ctx->stats.reads, ctx->stats.bytes, ctx->stats.prefetch_hit, ctx->stats.prefetch, ctx->stats.eviction);
 }
 
 #endif
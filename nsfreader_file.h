@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include "nsfreader.h"
 
 #ifdef __cplusplus
@@ -8,17 +9,40 @@ extern "C" {
 
 #define NFR_MEASURE_CACHE_PERFORMACE
 
+#define NFR_DEFAULT_BLOCK_SIZE  1024    // cache block size used by nfr_create
+#define NFR_MIN_BLOCKS          2
+
+// Cache counters of a file reader, collected if NFR_MEASURE_CACHE_PERFORMACE is defined
+typedef struct nfr_stats_s
+{
+    unsigned long long reads;           // read calls
+    unsigned long long bytes;           // bytes returned by read calls
+    unsigned long long cache_hit;       // block lookups served from cache
+    unsigned long long cache_miss;      // blocks loaded from file on demand
+    unsigned long long prefetch;        // blocks loaded ahead of use
+    unsigned long long prefetch_hit;    // prefetched blocks used later
+    unsigned long long eviction;        // valid blocks replaced
+} nfr_stats_t;
+
+// cache_size bytes of cache in NFR_DEFAULT_BLOCK_SIZE blocks
 nsfreader_t* nfr_create(const char* fn, uint32_t cache_size);
 
+// blocks of block_size (rounded up to power of 2) bytes of cache, replaced in LRU order
+nsfreader_t* nfr_create_cache(const char* fn, uint32_t block_size, uint32_t blocks);
+
 void nfr_destroy(nsfreader_t* nfr);
 
 #ifdef NFR_MEASURE_CACHE_PERFORMACE
+bool nfr_get_stats(nsfreader_t* nfr, nfr_stats_t* stats);
+void nfr_reset_stats(nsfreader_t* nfr);
 void nfr_show_cache_status(nsfreader_t* nfr);
 #else
-#define nfr_show_cache_status(x) void(x)
+#define nfr_get_stats(x, s) (memset((s), 0, sizeof(nfr_stats_t)), false)
+#define nfr_reset_stats(x) ((void)(x))
+#define nfr_show_cache_status(x) ((void)(x))
 #endif
 
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "platform.h"
+#include "nsfreader_mem.h"
+
+
+#define NFR_MEM_STREAM_CHUNK    0x10000     // initial buffer size reading a stream
+#define NFR_MEM_MAX_SIZE        0x7FFFFFFF
+
+
+// NSF Memory Reader
+typedef struct nfr_mem_ctx_s
+{
+    // super class
+    nsfreader_t super;
+    // Private fields
+    const uint8_t *data;
+    uint32_t size;
+    uint8_t *owned;     // buffer to free on destroy, NULL if caller owned
+} nfr_mem_t;
+
+
+static uint32_t nfr_mem_read(nsfreader_t *self, uint8_t *out, uint32_t offset, uint32_t length)
+{
+    nfr_mem_t *ctx = (nfr_mem_t*)self;
+    if (offset >= ctx->size)
+        return 0;
+    if (length > ctx->size - offset)
+        length = ctx->size - offset;
+    if (length == 1)
+        *out = ctx->data[offset];
+    else
+        memcpy(out, ctx->data + offset, length);
+    return length;
+}
+
+
+static uint32_t nfr_mem_size(nsfreader_t *self)
+{
+    nfr_mem_t *ctx = (nfr_mem_t*)self;
+    return ctx ? ctx->size : 0;
+}
+
+
+nsfreader_t * nfr_mem_create(const uint8_t *data, uint32_t size)
+{
+    nfr_mem_t *ctx = 0;
+
+    if ((0 == data) && (size > 0))
+        return 0;
+    ctx = (nfr_mem_t*)malloc(sizeof(nfr_mem_t));
+    if (0 == ctx)
+        return 0;
+    ctx->data = data;
+    ctx->size = size;
+    ctx->owned = 0;
+    ctx->super.self = (nsfreader_t*)ctx;
+    ctx->super.read = nfr_mem_read;
+    ctx->super.size = nfr_mem_size;
+    return (nsfreader_t*)ctx;
+}
+
+
+nsfreader_t * nfr_mem_create_from_stream(FILE *fp)
+{
+    uint8_t *buf = 0, *tmp;
+    size_t capacity = 0, size = 0, n;
+    nfr_mem_t *ctx = 0;
+
+    if (0 == fp)
+        goto create_exit;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            if (capacity >= NFR_MEM_MAX_SIZE)
+                goto create_exit;
+            capacity = capacity ? capacity * 2 : NFR_MEM_STREAM_CHUNK;
+            if (capacity > NFR_MEM_MAX_SIZE)
+                capacity = NFR_MEM_MAX_SIZE;
+            tmp = (uint8_t*)realloc(buf, capacity);
+            if (0 == tmp)
+                goto create_exit;
+            buf = tmp;
+        }
+        n = fread(buf + size, 1, capacity - size, fp);
+        size += n;
+        if (n == 0)
+        {
+            if (ferror(fp))
+                goto create_exit;
+            break;
+        }
+    }
+    ctx = (nfr_mem_t*)nfr_mem_create(buf, (uint32_t)size);
+    if (0 == ctx)
+        goto create_exit;
+    ctx->owned = buf;
+    return (nsfreader_t*)ctx;
+
+create_exit:
+    if (buf)
+        free(buf);
+    return 0;
+}
+
+
+const uint8_t * nfr_mem_data(nsfreader_t *nfr)
+{
+    nfr_mem_t *ctx = (nfr_mem_t*)nfr;
+    return ctx ? ctx->data : 0;
+}
+
+
+void nfr_mem_destroy(nsfreader_t *nfr)
+{
+    nfr_mem_t *ctx = (nfr_mem_t*)nfr;
+    if (0 == ctx)
+        return;
+    if (ctx->owned)
+        free(ctx->owned);
+    free(ctx);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdio.h>
+#include "nsfreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NSF reader on a caller owned buffer. The buffer is not copied and must outlive the reader.
+nsfreader_t* nfr_mem_create(const uint8_t* data, uint32_t size);
+
+// NSF reader on the whole content of an opened stream (e.g. stdin or a pipe), read once into
+// a buffer owned by the reader.
+nsfreader_t* nfr_mem_create_from_stream(FILE* fp);
+
+// Buffer the reader reads from
+const uint8_t* nfr_mem_data(nsfreader_t* nfr);
+
+void nfr_mem_destroy(nsfreader_t* nfr);
+
+
+#ifdef __cplusplus
+}
+#endif
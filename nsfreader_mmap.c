@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "platform.h"
+#include "nsfreader_mmap.h"
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+#endif
+
+
+// NSF Memory Mapped File Reader
+typedef struct nfr_mmap_ctx_s
+{
+    // super class
+    nsfreader_t super;
+    // Private fields
+    const uint8_t *data;
+    uint32_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+} nfr_mmap_t;
+
+
+static uint32_t nfr_mmap_read(nsfreader_t *self, uint8_t *out, uint32_t offset, uint32_t length)
+{
+    nfr_mmap_t *ctx = (nfr_mmap_t*)self;
+    if (offset >= ctx->size)
+        return 0;
+    if (length > ctx->size - offset)
+        length = ctx->size - offset;
+    if (length == 1)
+        *out = ctx->data[offset];
+    else
+        memcpy(out, ctx->data + offset, length);
+    return length;
+}
+
+
+static uint32_t nfr_mmap_size(nsfreader_t *self)
+{
+    nfr_mmap_t *ctx = (nfr_mmap_t*)self;
+    return ctx ? ctx->size : 0;
+}
+
+
+nsfreader_t * nfr_mmap_create(const char *fn)
+{
+    nfr_mmap_t *ctx = 0;
+
+    ctx = (nfr_mmap_t*)malloc(sizeof(nfr_mmap_t));
+    if (0 == ctx)
+        goto create_exit;
+    ctx->data = 0;
+    ctx->size = 0;
+
+#ifdef _WIN32
+    ctx->mapping = 0;
+    ctx->file = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == ctx->file)
+        goto create_exit;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(ctx->file, &size) || (size.QuadPart > 0xFFFFFFFF))
+        goto create_exit;
+    ctx->size = (uint32_t)size.QuadPart;
+    if (ctx->size > 0)
+    {
+        ctx->mapping = CreateFileMappingA(ctx->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (0 == ctx->mapping)
+            goto create_exit;
+        ctx->data = (const uint8_t*)MapViewOfFile(ctx->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (0 == ctx->data)
+            goto create_exit;
+    }
+#else
+    struct stat st;
+    ctx->fd = open(fn, O_RDONLY);
+    if (ctx->fd < 0)
+        goto create_exit;
+    if ((fstat(ctx->fd, &st) != 0) || (st.st_size > 0xFFFFFFFF))
+        goto create_exit;
+    ctx->size = (uint32_t)st.st_size;
+    if (ctx->size > 0)
+    {
+        void *p = mmap(NULL, ctx->size, PROT_READ, MAP_PRIVATE, ctx->fd, 0);
+        if (MAP_FAILED == p)
+            goto create_exit;
+        ctx->data = (const uint8_t*)p;
+    }
+#endif
+
+    ctx->super.self = (nsfreader_t*)ctx;
+    ctx->super.read = nfr_mmap_read;
+    ctx->super.size = nfr_mmap_size;
+
+    return (nsfreader_t*)ctx;
+
+create_exit:
+    if (ctx)
+    {
+        ctx->data = 0;  // mapping is the last step, not established if we are here
+        nfr_mmap_destroy((nsfreader_t*)ctx);
+    }
+    return 0;
+}
+
+
+void nfr_mmap_destroy(nsfreader_t *nfr)
+{
+    nfr_mmap_t *ctx = (nfr_mmap_t*)nfr;
+    if (0 == ctx)
+        return;
+#ifdef _WIN32
+    if (ctx->data)
+        UnmapViewOfFile(ctx->data);
+    if (ctx->mapping)
+        CloseHandle(ctx->mapping);
+    if (ctx->file != INVALID_HANDLE_VALUE)
+        CloseHandle(ctx->file);
+#else
+    if (ctx->data)
+        munmap((void*)ctx->data, ctx->size);
+    if (ctx->fd >= 0)
+        close(ctx->fd);
+#endif
+    free(ctx);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "nsfreader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NSF reader on a read-only memory mapping of the file, reads are memcpy from the mapping
+nsfreader_t* nfr_mmap_create(const char* fn);
+
+void nfr_mmap_destroy(nsfreader_t* nfr);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,32 +8,31 @@
 
 #define RECORD_WRITE_REG    0xb4000000
 
+#define LOOP_WINDOW         16          // records hashed to find earlier occurrences of the latest records
+#define LOOP_TABLE_BITS     16
+#define LOOP_NONE           ((unsigned long)-1)
+#define LOOP_HASH_BASE      0x100000001B3ULL
+#define LOOP_BUCKET(h)      ((unsigned long)(((h) * 0x9E3779B97F4A7C15ULL) >> (64 - LOOP_TABLE_BITS)))
 
+
+// Records are allocated one chunk at a time when ripping, max_records only limits the count
 nsfrip_t * nsfrip_create(unsigned long max_records)
 {
     nsfrip_t *rip = malloc(sizeof(nsfrip_t));
     if (rip)
     {
         memset(rip, 0, sizeof(nsfrip_t));
-        rip->records = malloc(max_records * sizeof(nsfrip_record_t));
-        if (!rip->records)
-        {
-            free(rip);
-            rip = NULL;
-        }
-        else
-        {
-            rip->total_samples = 0;
-            rip->rom_lo = 0xffff;
-            rip->rom_hi = 0x0000;
-            rip->reg4012 = 0;
-            rip->reg4012_valid = false;
-            rip->reg4013 = 0;
-            rip->reg4013_valid = false;
-            rip->wait_samples = 0;
-            rip->records_len = 0;
-            rip->max_records = max_records;
-        }
+        rip->total_samples = 0;
+        rip->rom_lo = 0xffff;
+        rip->rom_hi = 0x0000;
+        rip->reg4012 = 0;
+        rip->reg4012_valid = false;
+        rip->reg4013 = 0;
+        rip->reg4013_valid = false;
+        rip->wait_samples = 0;
+        rip->samples = 0;
+        rip->records_len = 0;
+        rip->max_records = max_records;
     }
     return rip;
 }
@@ -43,40 +42,105 @@ void nsfrip_destroy(nsfrip_t *rip)
 {
     if (rip)
     {
-        if (rip->records)
+        if (rip->chunks)
         {
-            free(rip->records);
+            for (unsigned long i = 0; i < rip->chunks_len; ++i)
+                free(rip->chunks[i]);
+            free(rip->chunks);
         }
+        if (rip->loop_table) free(rip->loop_table);
+        if (rip->loop_hashes) free(rip->loop_hashes);
         free(rip);
     }
 }
 
 
+// Value compared by loop search, same for records writing the same value to the same register
+static inline uint32_t record_key(const nsfrip_record_t *r)
+{
+    if (NSFRIP_REG_NONE == r->reg) return 0;
+    return RECORD_WRITE_REG | ((0x4000 | (uint32_t)r->reg) << 8) | r->val;
+}
+
+
+static inline bool has_room(nsfrip_t *rip)
+{
+    return (0 == rip->max_records) || (rip->records_len < rip->max_records);
+}
+
+
+// Append a record, NULL if max_records is reached or out of memory
+static nsfrip_record_t * new_record(nsfrip_t *rip)
+{
+    if (!has_room(rip))
+    {
+        rip->truncated = true;
+        return NULL;
+    }
+    if ((rip->records_len >> NSFRIP_CHUNK_BITS) == rip->chunks_len)
+    {
+        if (rip->chunks_len == rip->chunks_cap)
+        {
+            unsigned long cap = rip->chunks_cap ? rip->chunks_cap * 2 : 16;
+            nsfrip_record_t **chunks = realloc(rip->chunks, cap * sizeof(nsfrip_record_t *));
+            if (NULL == chunks)
+            {
+                rip->truncated = true;
+                return NULL;
+            }
+            rip->chunks = chunks;
+            rip->chunks_cap = cap;
+        }
+        rip->chunks[rip->chunks_len] = malloc(NSFRIP_CHUNK_SIZE * sizeof(nsfrip_record_t));
+        if (NULL == rip->chunks[rip->chunks_len])
+        {
+            rip->truncated = true;
+            return NULL;
+        }
+        ++(rip->chunks_len);
+    }
+    nsfrip_record_t *record = nsfrip_record(rip, rip->records_len);
+    ++(rip->records_len);
+    return record;
+}
+
+
 void nsfrip_add_sample(nsfrip_t *rip)
 {
+    ++(rip->samples);
     ++(rip->wait_samples);
 }
 
 
+void nsfrip_add_samples(nsfrip_t *rip, unsigned long samples)
+{
+    rip->samples += samples;
+    rip->wait_samples = rip->samples - rip->total_samples;
+}
+
+
 void nsfrip_finish_rip(nsfrip_t *rip)
 {
+    nsfrip_record_t *record;
     // add those samples in waiting
-    while ((rip->wait_samples > 65535) && (rip->records_len < rip->max_records))
+    while (rip->wait_samples > 65535)
     {
+        record = new_record(rip);
+        if (NULL == record) return;
         rip->total_samples += 65535;
         rip->wait_samples -= 65535;
-        rip->records[rip->records_len].wait_samples = 65535;
-        rip->records[rip->records_len].reg_ops = 0;
-        ++(rip->records_len);
+        record->wait_samples = 65535;
+        record->reg = NSFRIP_REG_NONE;
+        record->val = 0;
     }
-    if (rip->records_len < rip->max_records)
+    record = new_record(rip);
+    if (record)
     {
-        
         rip->total_samples += rip->wait_samples;
-        rip->records[rip->records_len].wait_samples = rip->wait_samples;
+        record->wait_samples = rip->wait_samples;
         rip->wait_samples = 0;
-        rip->records[rip->records_len].reg_ops = 0;
-        ++(rip->records_len);
+        record->reg = NSFRIP_REG_NONE;
+        record->val = 0;
     }
 }
 
@@ -87,38 +151,107 @@ void nsfrip_dump(nsfrip_t *rip, unsigned long records)
     if (records == 0) records = rip->records_len;
     for (unsigned long i = 0; i < records; ++i)
     {
-        uint32_t record = rip->records[i].reg_ops;
-        int16_t addr = (record >> 8) & 0xffff;
-        uint8_t val = record & 0xff;
-        NSF_PRINTF("%06lu: Write $%04x : %02x\n", i, addr, val);
+        nsfrip_record_t *record = nsfrip_record(rip, i);
+        if (NSFRIP_REG_NONE != record->reg)
+            NSF_PRINTF("%06lu: Write $%04x : %02x\n", i, 0x4000 + record->reg, record->val);
+    }
+}
+
+
+/*
+    Loop watch. Keeps a few candidate periods and, for each, how many of the latest records equal
+    the record one period earlier. A period is confirmed when the latest (repeats + 1) periods are
+    identical. Candidates come from a hash table of the LOOP_WINDOW records ending at each record.
+    Records enter the table only when they are min_length old, so a lookup gives the nearest
+    earlier occurrence of the latest records that is far enough to be a loop.
+ */
+static void track_loop(nsfrip_t *rip)
+{
+    unsigned long pos = rip->records_len - 1;
+    uint32_t key = record_key(nsfrip_record(rip, pos));
+    unsigned long hashes = rip->loop_min_length + 1;
+    nsfrip_loop_candidate_t *c;
+    unsigned long period;
+    int i, slot;
+
+    // check candidates
+    for (i = 0; i < NSFRIP_LOOP_CANDIDATES; ++i)
+    {
+        c = &(rip->loop_candidates[i]);
+        if (c->period == 0) continue;
+        if (key == record_key(nsfrip_record(rip, pos - c->period)))
+        {
+            ++(c->run);
+            if (c->run >= (unsigned long)rip->loop_repeats * c->period)
+                rip->loop_confirmed = true;
+        }
+        else
+        {
+            c->period = 0;
+        }
+    }
+    // rolling hash of latest LOOP_WINDOW records
+    rip->loop_hash = rip->loop_hash * LOOP_HASH_BASE + key + 1;
+    if (pos >= LOOP_WINDOW)
+        rip->loop_hash -= (record_key(nsfrip_record(rip, pos - LOOP_WINDOW)) + 1) * rip->loop_hash_out;
+    rip->loop_hashes[pos % hashes] = rip->loop_hash;
+    if (pos >= rip->loop_min_length)
+    {
+        unsigned long old = pos - rip->loop_min_length;
+        if (old + 1 >= LOOP_WINDOW)
+            rip->loop_table[LOOP_BUCKET(rip->loop_hashes[old % hashes])] = old;
+    }
+    if (pos + 1 < LOOP_WINDOW)
+        return;
+    unsigned long prev = rip->loop_table[LOOP_BUCKET(rip->loop_hash)];
+    if (prev == LOOP_NONE)
+        return;
+    // track new period, replacing a free slot or the one with shortest run
+    period = pos - prev;
+    slot = 0;
+    for (i = 0; i < NSFRIP_LOOP_CANDIDATES; ++i)
+    {
+        c = &(rip->loop_candidates[i]);
+        if (c->period == period) return;    // already tracked
+        if (rip->loop_candidates[slot].period == 0) continue;
+        if ((c->period == 0) || (c->run < rip->loop_candidates[slot].run))
+            slot = i;
     }
+    rip->loop_candidates[slot].period = period;
+    rip->loop_candidates[slot].run = 0;
 }
 
 
-void nsfrip_apu_write_reg(uint16_t addr, uint8_t val, void *param)
+void nsfrip_apu_write_reg(uint16_t addr, uint8_t val, unsigned long sample, void *param)
 {
     nsfrip_t *rip = (nsfrip_t *)param;
-    if (rip->records_len < rip->max_records)
+    nsfrip_record_t *record;
+    if (has_room(rip))
     {
+        // Samples since last record, total_samples is the sum of recorded waits
+        rip->wait_samples = sample - rip->total_samples;
         while (rip->wait_samples > 65535)
         {
+            record = new_record(rip);
+            if (NULL == record) return;
             rip->total_samples += 65535;
             rip->wait_samples -= 65535;
-            rip->records[rip->records_len].samples = rip->total_samples;
-            rip->records[rip->records_len].wait_samples = 65535;
-            rip->records[rip->records_len].reg_ops = 0;
-            ++(rip->records_len);
-            if (rip->records_len < rip->max_records)
+            record->wait_samples = 65535;
+            record->reg = NSFRIP_REG_NONE;
+            record->val = 0;
+            if (rip->loop_repeats) track_loop(rip);
+            if (!has_room(rip))
                 break;
         }
-        if (rip->records_len < rip->max_records)
+        record = new_record(rip);
+        if (record)
         {
             rip->total_samples += rip->wait_samples;
-            rip->records[rip->records_len].samples = rip->total_samples;
-            rip->records[rip->records_len].wait_samples = rip->wait_samples;
+            record->wait_samples = rip->wait_samples;
             rip->wait_samples = 0;
-            rip->records[rip->records_len].reg_ops = RECORD_WRITE_REG | (addr << 8) | val;
-            ++(rip->records_len);
+            record->reg = (uint8_t)(addr & 0xff);
+            record->val = val;
+            if (rip->loop_repeats) track_loop(rip);
             // Find DMC sample address based on write to $4012 and $4013
             if (addr == 0x4012)
             {
@@ -141,12 +274,16 @@ void nsfrip_apu_write_reg(uint16_t addr, uint8_t val, void *param)
             }
         }
     }
+    else
+    {
+        rip->truncated = true;
+    }
 }
 
 
 static inline bool compare_records(const nsfrip_record_t *a, const nsfrip_record_t *b)
 {
-    return (a->reg_ops == b->reg_ops);
+    return (a->reg == b->reg) && (a->val == b->val);
 }
 
 
@@ -165,7 +302,7 @@ static inline bool compare_records(const nsfrip_record_t *a, const nsfrip_record
         
 
  */
-static inline bool is_loop(nsfrip_record_t *records, unsigned long length, unsigned long loop_start, unsigned long loop_length)
+static inline bool is_loop(nsfrip_t *rip, unsigned long length, unsigned long loop_start, unsigned long loop_length)
 {
     unsigned long k = ((length - loop_start + 1) / loop_length - 1); // loop_start + (k + 1) * loop_length - 1 < length
     const nsfrip_record_t *a, *b;
@@ -173,8 +310,8 @@ static inline bool is_loop(nsfrip_record_t *records, unsigned long length, unsig
     {
         for (unsigned long j = 0; j < loop_length; ++j)
         {
-            a = &records[loop_start + j];
-            b = &records[loop_start + i * loop_length + j];
+            a = nsfrip_record(rip, loop_start + j);
+            b = nsfrip_record(rip, loop_start + i * loop_length + j);
             if (!compare_records(a, b))
                 return false;
         }
@@ -183,13 +320,9 @@ static inline bool is_loop(nsfrip_record_t *records, unsigned long length, unsig
 }
 
 
-bool nsfrip_find_loop(nsfrip_t *rip, unsigned long min_length)
+// Exhaustive search, used to confirm the result when the hashed search hits a collision
+static bool find_loop_exhaustive(nsfrip_t *rip, unsigned long length, unsigned long min_length)
 {
-    nsfrip_record_t *records = rip->records;
-    // The last ripped record is a pure wait record added in nsfrip_finish_rip. It does not contain register operation.
-    // Loop finding shall exclude last record.
-    unsigned long length = rip->records_len - 1;
-
     unsigned long start, max_length, loop_length;
 
     for (start = 0; start < length / 2; ++start)
@@ -197,7 +330,7 @@ bool nsfrip_find_loop(nsfrip_t *rip, unsigned long min_length)
         max_length = (length - start) / 2;
         for (loop_length = min_length; loop_length < max_length; ++loop_length)
         {
-            if (is_loop(records, length, start, loop_length))
+            if (is_loop(rip, length, start, loop_length))
             {
                 rip->loop_start_idx = start;
                 rip->loop_end_idx = start + loop_length - 1;
@@ -209,13 +342,161 @@ bool nsfrip_find_loop(nsfrip_t *rip, unsigned long min_length)
 }
 
 
+/*
+    Rolling hash of records (reg_ops), modulo 2^61-1. Used to compare two runs of records
+    in O(1), and the length of common prefix/suffix of two positions in O(log n).
+ */
+#define HASH_MOD    0x1FFFFFFFFFFFFFFFULL
+#define HASH_BASE   0x5BD1E995ULL
+
+typedef struct record_hash_s
+{
+    uint64_t *prefix;   // prefix[i] is the hash of records[0..i-1]
+    uint64_t *power;    // power[i] = HASH_BASE^i
+} record_hash_t;
+
+
+static inline uint64_t hash_reduce(uint64_t x)
+{
+    x = (x >> 61) + (x & HASH_MOD);
+    return (x >= HASH_MOD) ? x - HASH_MOD : x;
+}
+
+
+// a * b mod 2^61-1, a and b < 2^61
+static inline uint64_t hash_mul(uint64_t a, uint64_t b)
+{
+    uint64_t a1 = a >> 32, a0 = a & 0xFFFFFFFF;
+    uint64_t b1 = b >> 32, b0 = b & 0xFFFFFFFF;
+    uint64_t mid = a1 * b0 + a0 * b1;                   // < 2^62
+    uint64_t lo = hash_reduce(a0 * b0);
+    // 2^64 = 2^3 and 2^61 = 1 (mod 2^61-1)
+    return hash_reduce((a1 * b1 << 3) + (mid >> 29) + ((mid & 0x1FFFFFFF) << 32) + lo);
+}
+
+
+// hash of records[pos..pos+len-1]
+static inline uint64_t hash_range(const record_hash_t *h, unsigned long pos, unsigned long len)
+{
+    uint64_t x = h->prefix[pos + len] + HASH_MOD - hash_mul(h->prefix[pos], h->power[len]);
+    return (x >= HASH_MOD) ? x - HASH_MOD : x;
+}
+
+
+// Number of equal records going forward from a and b, up to max
+static unsigned long common_prefix(const record_hash_t *h, unsigned long a, unsigned long b, unsigned long max)
+{
+    unsigned long lo = 0, hi = max, mid;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo + 1) / 2;
+        if (hash_range(h, a, mid) == hash_range(h, b, mid))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+
+// Number of equal records going backward from a and b (inclusive), up to max
+static unsigned long common_suffix(const record_hash_t *h, unsigned long a, unsigned long b, unsigned long max)
+{
+    unsigned long lo = 0, hi = max, mid;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo + 1) / 2;
+        if (hash_range(h, a + 1 - mid, mid) == hash_range(h, b + 1 - mid, mid))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+
+/*
+    Find the earliest loop start and the shortest loop length for it, same result as testing
+    is_loop() for every start and length in order.
+
+    With n = length + 1 records, is_loop(start, L) holds iff records[p] == records[p - L] for
+    every p in [start + L, n - (n - start) % L), i.e. all periods but the partial one at the end
+    repeat. Within the search range start + 2L < n - 2, so for each L only two "breaks"
+    (p with records[p] != records[p - L]) matter:
+        b1: the last break at or before n - L. The loop must start after b1 - L.
+        b2: the first break after n - L, in the last partial period. (n - start) % L must be at
+            least n - b2 so the break falls into the partial period that is not compared.
+    Both are found with hashed common suffix/prefix, so each L costs O(log n).
+ */
+bool nsfrip_find_loop(nsfrip_t *rip, unsigned long min_length)
+{
+    // The last ripped record is a pure wait record added in nsfrip_finish_rip. It does not contain register operation.
+    // Loop finding shall exclude last record.
+    if (rip->records_len < 2) return false;
+    unsigned long length = rip->records_len - 1;
+    unsigned long n = rip->records_len;
+    unsigned long best_start = length, best_length = 0;
+    unsigned long loop_length, start, common, first, gap;
+    record_hash_t h;
+    bool found = false;
+
+    if (min_length < 1) min_length = 1;
+    h.prefix = malloc((n + 1) * sizeof(uint64_t));
+    h.power = malloc((n + 1) * sizeof(uint64_t));
+    if ((NULL == h.prefix) || (NULL == h.power))
+    {
+        if (h.prefix) free(h.prefix);
+        if (h.power) free(h.power);
+        return find_loop_exhaustive(rip, length, min_length);
+    }
+    h.prefix[0] = 0;
+    h.power[0] = 1;
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        h.prefix[i + 1] = hash_reduce(hash_mul(h.prefix[i], HASH_BASE) + record_key(nsfrip_record(rip, i)) + 1);
+        h.power[i + 1] = hash_mul(h.power[i], HASH_BASE);
+    }
+
+    for (loop_length = min_length; loop_length < length / 2; ++loop_length)
+    {
+        // b1: compare backward from n - L, down to position L
+        common = common_suffix(&h, n - loop_length, n - 2 * loop_length, n - 2 * loop_length + 1);
+        start = (common == n - 2 * loop_length + 1) ? 0 : (n - loop_length - common) - loop_length + 1;
+        // b2: compare forward from n - L + 1, the L - 1 records of the last partial period
+        first = common_prefix(&h, n - loop_length + 1, n - 2 * loop_length + 1, loop_length - 1);
+        gap = (first == loop_length - 1) ? 0 : loop_length - 1 - first;   // n - b2
+        if ((n - start) % loop_length < gap)
+            start += (n - start) % loop_length + 1;
+        if ((start < length / 2) && (loop_length < (length - start) / 2) && (start < best_start))
+        {
+            best_start = start;
+            best_length = loop_length;
+            found = true;
+        }
+    }
+    free(h.prefix);
+    free(h.power);
+
+    // Hashes can only make false matches, a confirmed result is the same as the exhaustive search
+    if (found && is_loop(rip, length, best_start, best_length))
+    {
+        rip->loop_start_idx = best_start;
+        rip->loop_end_idx = best_start + best_length - 1;
+        return true;
+    }
+    if (found)
+        return find_loop_exhaustive(rip, length, min_length);
+    return false;
+}
+
+
 // Trim records after loop end
 void nsfrip_trim_loop(nsfrip_t *rip)
 {
     if (rip->loop_end_idx != 0)
     {
+        rip->total_samples = nsfrip_record_samples(rip, rip->loop_end_idx);
         rip->records_len = rip->loop_end_idx + 1;
-        rip->total_samples = rip->records[rip->loop_end_idx].samples;
     }
 }
 
@@ -228,16 +509,180 @@ void nsfrip_trim_silence(nsfrip_t *rip, uint32_t samples)
 
     while (total_waits < samples)
     {
-        total_waits += rip->records[index].wait_samples;
+        total_waits += nsfrip_record(rip, index)->wait_samples;
         --index;
     }
     ++index;
     if (total_waits > samples)
     {
-        unsigned long adjust = rip->records[index].wait_samples - (total_waits - samples);
-        rip->records[index].wait_samples -= adjust;
-        rip->records[index].samples -= adjust;
+        unsigned long adjust = nsfrip_record(rip, index)->wait_samples - (total_waits - samples);
+        nsfrip_record(rip, index)->wait_samples -= adjust;
     }
     rip->records_len = index + 1;
     rip->total_samples -= samples;
 }
+
+
+// Watch for loops while ripping: the loop is confirmed when the latest records repeat a period of
+// at least min_length records repeats times. repeats = 0 disables the watch.
+bool nsfrip_watch_loop(nsfrip_t *rip, unsigned long min_length, unsigned int repeats)
+{
+    if (rip->loop_table) free(rip->loop_table);
+    if (rip->loop_hashes) free(rip->loop_hashes);
+    rip->loop_table = NULL;
+    rip->loop_hashes = NULL;
+    rip->loop_repeats = 0;
+    rip->loop_confirmed = false;
+    memset(rip->loop_candidates, 0, sizeof(rip->loop_candidates));
+    if (0 == repeats) return true;
+    if (rip->records_len != 0) return false;    // must be enabled before ripping starts
+    rip->loop_table = malloc(((size_t)1 << LOOP_TABLE_BITS) * sizeof(unsigned long));
+    rip->loop_min_length = (min_length < 1) ? 1 : min_length;
+    rip->loop_hashes = malloc((rip->loop_min_length + 1) * sizeof(uint64_t));
+    if ((NULL == rip->loop_table) || (NULL == rip->loop_hashes))
+    {
+        if (rip->loop_table) free(rip->loop_table);
+        if (rip->loop_hashes) free(rip->loop_hashes);
+        rip->loop_table = NULL;
+        rip->loop_hashes = NULL;
+        return false;
+    }
+    for (unsigned long i = 0; i < ((unsigned long)1 << LOOP_TABLE_BITS); ++i)
+        rip->loop_table[i] = LOOP_NONE;
+    rip->loop_hash = 0;
+    rip->loop_hash_out = 1;
+    for (int i = 0; i < LOOP_WINDOW; ++i)
+        rip->loop_hash_out *= LOOP_HASH_BASE;
+    rip->loop_repeats = repeats;
+    return true;
+}
+
+
+bool nsfrip_loop_confirmed(nsfrip_t *rip)
+{
+    return rip->loop_confirmed;
+}
+
+
+// Samples from the start of rip to the end of the record at index
+unsigned long nsfrip_record_samples(nsfrip_t *rip, unsigned long index)
+{
+    unsigned long samples = 0;
+    for (unsigned long i = 0; (i <= index) && (i < rip->records_len); ++i)
+        samples += nsfrip_record(rip, i)->wait_samples;
+    return samples;
+}
+
+
+/*
+    Writes that can be dropped when the register already holds the value. Writes to $4003/$4007/
+    $400B/$400F (length reload, envelope/phase restart), $4011 (DAC level, also moved by DMC
+    playback), $4015 and $4017 have side effects and are always kept. $4001/$4005 reload the
+    sweep divider, only harmless while the sweep is disabled. $4002/$4006 reset the timer period
+    an active sweep keeps moving, kept while sweep[channel] is true.
+ */
+static inline bool is_redundant(const bool *known, const uint8_t *value, const bool *sweep, const nsfrip_record_t *r)
+{
+    switch (r->reg)
+    {
+    case 0x02: case 0x06:   // pulse timer low
+        if (sweep[r->reg >> 2]) return false;
+        break;
+    case 0x00: case 0x04:   // pulse duty/volume
+    case 0x08: case 0x09: case 0x0a:    // triangle linear counter, timer low
+    case 0x0c: case 0x0d: case 0x0e:    // noise volume, period
+    case 0x10: case 0x12: case 0x13:    // DMC rate, sample address and length
+        break;
+    case 0x01: case 0x05:
+        if (r->val & 0x80) return false;
+        break;
+    default:
+        return false;
+    }
+    return known[r->reg] && (value[r->reg] == r->val);
+}
+
+
+// Append a pure wait record at index j, rebuilding the stream in place
+static inline void put_wait(nsfrip_t *rip, unsigned long *j, uint32_t wait)
+{
+    nsfrip_record_t *out = nsfrip_record(rip, *j);
+    out->wait_samples = wait;
+    out->reg = NSFRIP_REG_NONE;
+    out->val = 0;
+    ++(*j);
+}
+
+
+/*
+    Drop register writes that don't change the register, and merge their waits into the next
+    record. Run it after loop trimming: register state is forgotten at the loop start, as the
+    player comes back there with state from the loop end. The loop start record is kept as is.
+    Returns number of records removed.
+ */
+unsigned long nsfrip_drop_redundant_writes(nsfrip_t *rip)
+{
+    bool known[0x18];
+    uint8_t value[0x18];
+    bool sweep[2] = { false, false };   // pulse sweep enabled with non-zero shift, off at power up
+    unsigned long i, j = 0;
+    unsigned long loop_start = rip->loop_start_idx;
+    bool loop_end = (rip->loop_end_idx != 0) && (rip->loop_end_idx + 1 == rip->records_len);
+    uint32_t pending = 0;   // wait of dropped records
+    nsfrip_record_t r;
+
+    memset(known, 0, sizeof(known));
+    for (i = 0; i < rip->records_len; ++i)
+    {
+        r = *nsfrip_record(rip, i);
+        if ((i != 0) && (i == rip->loop_start_idx))
+        {
+            // loop marker goes between this record's wait and write, keep both
+            if (pending > 0)
+                put_wait(rip, &j, pending);
+            pending = 0;
+            memset(known, 0, sizeof(known));
+            sweep[0] = sweep[1] = true;     // unknown, may come from the loop end
+            loop_start = j;
+            *nsfrip_record(rip, j) = r;
+            ++j;
+        }
+        else if ((NSFRIP_REG_NONE == r.reg) || is_redundant(known, value, sweep, &r))
+        {
+            if ((pending > 0) && (pending + r.wait_samples > 65535))
+            {
+                put_wait(rip, &j, pending);
+                pending = 0;
+            }
+            pending += r.wait_samples;
+            continue;
+        }
+        else
+        {
+            if ((pending > 0) && (pending + r.wait_samples > 65535))
+            {
+                put_wait(rip, &j, pending);
+                pending = 0;
+            }
+            r.wait_samples += pending;
+            pending = 0;
+            *nsfrip_record(rip, j) = r;
+            ++j;
+        }
+        if ((NSFRIP_REG_NONE != r.reg) && (r.reg < 0x18))
+        {
+            known[r.reg] = true;
+            value[r.reg] = r.val;
+            if ((0x01 == r.reg) || (0x05 == r.reg))
+                sweep[r.reg >> 2] = (0 != (r.val & 0x80)) && (0 != (r.val & 0x07));
+        }
+    }
+    if (pending > 0)
+        put_wait(rip, &j, pending);
+    i = rip->records_len - j;
+    rip->records_len = j;
+    rip->loop_start_idx = loop_start;
+    if (loop_end)
+        rip->loop_end_idx = j - 1;
+    return i;
+}
@@ -8,11 +8,26 @@ extern "C" {
 
 typedef struct nsfrip_record_s
 {
-    uint32_t wait_samples;
-    uint32_t reg_ops;
-    unsigned long samples;
+    uint32_t wait_samples;  // samples since previous record
+    uint8_t reg;            // APU register $4000 + reg, NSFRIP_REG_NONE if the record only waits
+    uint8_t val;
 } nsfrip_record_t;
 
+#define NSFRIP_REG_NONE     0xff
+
+#define NSFRIP_CHUNK_BITS   12                              // records are stored in chunks of 4096
+#define NSFRIP_CHUNK_SIZE   (1UL << NSFRIP_CHUNK_BITS)
+#define NSFRIP_CHUNK_MASK   (NSFRIP_CHUNK_SIZE - 1)
+
+#define NSFRIP_LOOP_CANDIDATES  8       // periods tracked at the same time by the loop watch
+#define NSFRIP_DEFAULT_MAX_RECORDS  100000  // nsf2vgm default for nsfrip_create, 0 is unlimited
+
+typedef struct nsfrip_loop_candidate_s
+{
+    unsigned long period;   // 0 if unused
+    unsigned long run;      // records matching the record one period before, up to the latest record
+} nsfrip_loop_candidate_t;
+
 typedef struct nsfrip_s
 {
     unsigned long total_samples;
@@ -23,25 +38,49 @@ typedef struct nsfrip_s
     uint8_t reg4013; // DMC sample length
     bool reg4013_valid;
     unsigned int wait_samples;
-    nsfrip_record_t *records;
+    unsigned long samples;  // samples ripped so far
+    nsfrip_record_t **chunks;           // record storage, grows one chunk at a time
+    unsigned long chunks_len;
+    unsigned long chunks_cap;
     unsigned long records_len;
     unsigned long loop_start_idx;
     unsigned long loop_end_idx;
-    unsigned long max_records;
+    unsigned long max_records;          // 0 for no limit
+    bool truncated;                     // records dropped because of max_records or out of memory
+    // Loop watch, see nsfrip_watch_loop
+    unsigned int loop_repeats;          // 0 if disabled
+    unsigned long loop_min_length;
+    uint64_t loop_hash;                 // hash of the latest records
+    uint64_t loop_hash_out;             // weight of the record leaving the hash window
+    uint64_t *loop_hashes;              // hash of the window ending at the latest loop_min_length + 1 records
+    unsigned long *loop_table;          // hash bucket -> latest record ending that window
+    nsfrip_loop_candidate_t loop_candidates[NSFRIP_LOOP_CANDIDATES];
+    bool loop_confirmed;
 } nsfrip_t;
 
 
+// Record at index, index must be less than records_len
+static inline nsfrip_record_t * nsfrip_record(nsfrip_t *rip, unsigned long index)
+{
+    return &(rip->chunks[index >> NSFRIP_CHUNK_BITS][index & NSFRIP_CHUNK_MASK]);
+}
+
 nsfrip_t * nsfrip_create(unsigned long max_records);
 void nsfrip_destroy(nsfrip_t *rip);
 void nsfrip_add_sample(nsfrip_t *rip);
+void nsfrip_add_samples(nsfrip_t *rip, unsigned long samples);
 void nsfrip_finish_rip(nsfrip_t *rip);
 void nsfrip_dump(nsfrip_t *rip, unsigned long records);
 bool nsfrip_find_loop(nsfrip_t *rip, unsigned long min_length);
 void nsfrip_trim_loop(nsfrip_t *rip);
 void nsfrip_trim_silence(nsfrip_t *rip, uint32_t samples);
+bool nsfrip_watch_loop(nsfrip_t *rip, unsigned long min_length, unsigned int repeats);
+bool nsfrip_loop_confirmed(nsfrip_t *rip);
+unsigned long nsfrip_record_samples(nsfrip_t *rip, unsigned long index);
+unsigned long nsfrip_drop_redundant_writes(nsfrip_t *rip);
 
-// For use with nsfbus 
-void nsfrip_apu_write_reg(uint16_t addr, uint8_t val, void *param);
+// For use with nsf_enable_apu_sniffing, sample is the index of output sample the write happens in
+void nsfrip_apu_write_reg(uint16_t addr, uint8_t val, unsigned long sample, void *param);
 
 
 // From nsfrip to VGM
@@ -49,6 +88,7 @@ void nsfrip_apu_write_reg(uint16_t addr, uint8_t val, void *param);
 #define RIP2VGM_ERR_SUCCESS         0
 #define RIP2VGM_ERR_OUTOFMEMORY     -1
 #define RIP2VGM_ERR_FILEIO          -2
+#define RIP2VGM_ERR_UNSUPPORTED     -3      // VGZ requested but built without zlib
 
 typedef struct vgm_meta_s
 {
@@ -62,6 +102,8 @@ typedef struct vgm_meta_s
 } vgm_meta_t;
 
 int  nsfrip_export_vgm(nsfrip_t *rip, uint8_t *rom, uint16_t rom_len, vgm_meta_t *info, char const *vgm);
+// level 1 (fastest) .. 9 (smallest), other values use zlib default
+int  nsfrip_export_vgz(nsfrip_t *rip, uint8_t *rom, uint16_t rom_len, vgm_meta_t *info, char const *vgz, int level);
 
 
 #ifdef __cplusplus
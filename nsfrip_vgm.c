@@ -2,8 +2,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
 #include "platform.h"
 #include "nsfrip.h"
+#ifdef NSF2VGM_HAVE_ZLIB
+# include <zlib.h>
+#endif
 
 
 PACK(struct vgm_header_s
@@ -83,189 +87,325 @@ PACK(struct vgm_header_s
 typedef struct vgm_header_s vgm_header_t;
 
 
-static int find_gd3_string_storage(const char *str)
+#define VGM_WRITER_BUFFER_SIZE  4096    // commands are staged here between fwrite calls
+
+// Incremental VGM encoder. Commands are buffered and streamed to the file, header fields
+// that depend on the stream length are patched when the writer is closed. A writer without
+// output (dry run) only counts, which gives the header before a stream that can't seek (VGZ).
+typedef struct vgm_writer_s
+{
+    FILE *fd;
+#ifdef NSF2VGM_HAVE_ZLIB
+    gzFile gz;
+#endif
+    uint8_t buf[VGM_WRITER_BUFFER_SIZE];
+    unsigned int buf_len;
+    unsigned long pos;          // bytes written after the header
+    unsigned long total_samples;
+    unsigned long loop_pos;     // stream position of loop point, 0 if no loop
+    unsigned long loop_samples;
+    bool error;
+} vgm_writer_t;
+
+
+static void vgm_flush(vgm_writer_t *w)
+{
+    if (w->buf_len > 0)
+    {
+#ifdef NSF2VGM_HAVE_ZLIB
+        if (w->gz)
+        {
+            if (gzwrite(w->gz, w->buf, w->buf_len) != (int)w->buf_len)
+                w->error = true;
+        }
+        else
+#endif
+        if (w->fd)
+        {
+            if (fwrite(w->buf, w->buf_len, 1, w->fd) != 1)
+                w->error = true;
+        }
+        w->buf_len = 0;
+    }
+}
+
+
+static void vgm_put(vgm_writer_t *w, const uint8_t *data, unsigned long len)
 {
-    int len = 0;
+    while (len > 0)
+    {
+        unsigned long n = VGM_WRITER_BUFFER_SIZE - w->buf_len;
+        if (n > len) n = len;
+        memcpy(w->buf + w->buf_len, data, n);
+        w->buf_len += n;
+        w->pos += n;
+        data += n;
+        len -= n;
+        if (VGM_WRITER_BUFFER_SIZE == w->buf_len)
+            vgm_flush(w);
+    }
+}
+
+
+static void vgm_put_u8(vgm_writer_t *w, uint8_t v)
+{
+    if (VGM_WRITER_BUFFER_SIZE == w->buf_len)
+        vgm_flush(w);
+    w->buf[w->buf_len] = v;
+    ++w->buf_len;
+    ++w->pos;
+}
+
+
+static void vgm_put_u16(vgm_writer_t *w, uint16_t v)
+{
+    vgm_put_u8(w, v & 0xff);
+    vgm_put_u8(w, (v >> 8) & 0xff);
+}
+
+
+static void vgm_put_u32(vgm_writer_t *w, uint32_t v)
+{
+    vgm_put_u16(w, v & 0xffff);
+    vgm_put_u16(w, (v >> 16) & 0xffff);
+}
+
+
+static bool vgm_open(vgm_writer_t *w, char const *vgm)
+{
+    memset(w, 0, sizeof(vgm_writer_t));
+    w->fd = fopen(vgm, "wb");
+    if (NULL == w->fd)
+        return false;
+    // header is written as placeholder and patched in vgm_close
+    vgm_header_t header;
+    memset(&header, 0, sizeof(vgm_header_t));
+    if (fwrite(&header, sizeof(vgm_header_t), 1, w->fd) != 1)
+        w->error = true;
+    return true;
+}
+
+
+static void vgm_wait(vgm_writer_t *w, uint32_t wait)
+{
+    w->total_samples += wait;
+    w->loop_samples += wait;
+    while (wait > 65535)
+    {
+        vgm_put_u8(w, 0x61);                // 0x61 nn nn, longest single wait
+        vgm_put_u16(w, 65535);
+        wait -= 65535;
+    }
+    if (735 == wait)
+        vgm_put_u8(w, 0x62);                // 0x62 - wait 735 samples
+    else if (882 == wait)
+        vgm_put_u8(w, 0x63);                // 0x63 - wait 882 samples
+    else if ((wait >= 1) && (wait <= 16))
+        vgm_put_u8(w, 0x70 + wait - 1);     // 0x7n - wait n+1 samples
+    else
+    {
+        vgm_put_u8(w, 0x61);                // 0x61 nn nn - wait nnnn samples
+        vgm_put_u16(w, (uint16_t)wait);
+    }
+}
+
+
+static void vgm_write_reg(vgm_writer_t *w, uint8_t reg, uint8_t val)
+{
+    vgm_put_u8(w, 0xb4);    // b4 aa dd
+    vgm_put_u8(w, reg);
+    vgm_put_u8(w, val);
+}
+
+
+static void vgm_mark_loop(vgm_writer_t *w)
+{
+    w->loop_pos = w->pos;
+    w->loop_samples = 0;
+}
+
+
+// NES APU RAM data block 0x67 0x66 0xc2 ss ss ss ss ll ll rom
+static void vgm_data_block(vgm_writer_t *w, uint16_t addr, const uint8_t *rom, uint16_t rom_len)
+{
+    vgm_put_u8(w, 0x67);
+    vgm_put_u8(w, 0x66);
+    vgm_put_u8(w, 0xc2);
+    vgm_put_u32(w, rom_len + 2);
+    vgm_put_u16(w, addr);
+    vgm_put(w, rom, rom_len);
+}
+
+
+static unsigned long find_gd3_string_storage(const char *str)
+{
+    unsigned long len = 0;
     if (str && str[0])
-        len = (int)strlen(str);
+        len = (unsigned long)strlen(str);
     len = len + len + 2;    // 16 bit character + null termination
     return len;
 }
 
 
-static int encode_gd3_string(const char *str, uint8_t *buf)
+static void encode_gd3_string(vgm_writer_t *w, const char *str)
 {
-    uint16_t *buf16 = (uint16_t *)buf;
-    int len = 0, i;
-    if (str && str[0])
-        len = (int)strlen(str);
-    for (i = 0; i < len; ++i)
+    if (str)
+    {
+        for (; *str; ++str)
+            vgm_put_u16(w, (uint16_t)*str);
+    }
+    vgm_put_u16(w, 0);
+}
+
+
+// https://vgmrips.net/wiki/GD3_Specification
+static void vgm_gd3(vgm_writer_t *w, vgm_meta_t *meta)
+{
+    unsigned long gd3_len;
+    gd3_len = 4 + 4 + 4;                                        //"Gd3 " + "00 01 00 00" + "ll ll ll ll"
+    gd3_len += find_gd3_string_storage(meta->track_name_en);    // Track name (Eng)
+    gd3_len += 2;                                               // Track name (Jap)
+    gd3_len += find_gd3_string_storage(meta->game_name_en);     // Game name (Eng)
+    gd3_len += 2;                                               // Game name (Jap)
+    gd3_len += find_gd3_string_storage(meta->system_name_en);   // System name (Eng)
+    gd3_len += 2;                                               // System name (Jap)
+    gd3_len += find_gd3_string_storage(meta->author_name_en);   // Author name (Eng)
+    gd3_len += 2;                                               // Author name (Jap)
+    gd3_len += find_gd3_string_storage(meta->release_date);     // Release date
+    gd3_len += find_gd3_string_storage(meta->creator_name);     // Creator
+    gd3_len += find_gd3_string_storage(meta->notes);            // Notes
+    gd3_len += 2;                                               // Final termination
+    vgm_put_u32(w, 0x20336447);     // GD3 tag "Gd3 "
+    vgm_put_u32(w, 0x00000100);     // Version 00 01 00 00
+    vgm_put_u32(w, gd3_len - 8);    // Length of the following data in bytes
+    encode_gd3_string(w, meta->track_name_en);
+    encode_gd3_string(w, NULL);
+    encode_gd3_string(w, meta->game_name_en);
+    encode_gd3_string(w, NULL);
+    encode_gd3_string(w, meta->system_name_en);
+    encode_gd3_string(w, NULL);
+    encode_gd3_string(w, meta->author_name_en);
+    encode_gd3_string(w, NULL);
+    encode_gd3_string(w, meta->release_date);
+    encode_gd3_string(w, meta->creator_name);
+    encode_gd3_string(w, meta->notes);
+    vgm_put_u16(w, 0);
+}
+
+
+// Finish the stream with GD3 tag and fill in the header
+static void vgm_finish(vgm_writer_t *w, vgm_meta_t *meta, vgm_header_t *header)
+{
+    vgm_put_u8(w, 0x66);   // eof of sound data
+    unsigned long gd3_pos = w->pos;
+    vgm_gd3(w, meta);
+    vgm_flush(w);
+    memset(header, 0, sizeof(vgm_header_t));
+    header->ident = 0x206d6756;
+    header->version = 0x00000171;
+    header->eof_offset = sizeof(vgm_header_t) + w->pos - 4;
+    header->gd3_offset = sizeof(vgm_header_t) - 0x14 + gd3_pos;
+    header->data_offset = sizeof(vgm_header_t) - 0x34;
+    header->total_samples = w->total_samples;
+    if (w->loop_pos > 0)
+    {
+        header->loop_offset = sizeof(vgm_header_t) + w->loop_pos - 0x1c;
+        header->loop_samples = w->loop_samples;
+    }
+    header->nes_apu_clk = 1789773;
+}
+
+
+// Finish the file and patch header. Returns false on any write error.
+static bool vgm_close(vgm_writer_t *w, vgm_meta_t *meta)
+{
+    vgm_header_t header;
+    vgm_finish(w, meta, &header);
+    if ((fseek(w->fd, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(vgm_header_t), 1, w->fd) != 1))
+        w->error = true;
+    if (fclose(w->fd) != 0)
+        w->error = true;
+    w->fd = NULL;
+    return !w->error;
+}
+
+
+// ROM data and ripped records
+static void vgm_encode(vgm_writer_t *w, nsfrip_t *rip, uint8_t *rom, uint16_t rom_len)
+{
+    // save rom data
+    if (rom_len > 0)
+        vgm_data_block(w, rip->rom_lo, rom, rom_len);
+    // save ripped data to stream
+    for (unsigned long i = 0; i < rip->records_len; ++i)
     {
-        buf16[i] = (uint16_t)str[i];
+        const nsfrip_record_t *record = nsfrip_record(rip, i);
+        if (record->wait_samples > 0)
+            vgm_wait(w, record->wait_samples);
+        if ((i != 0) && (i == rip->loop_start_idx))
+            vgm_mark_loop(w);
+        if (record->reg != NSFRIP_REG_NONE)
+            vgm_write_reg(w, record->reg, record->val);
     }
-    buf16[i] = 0;
-    return len + len + 2;
 }
 
 
 int nsfrip_export_vgm(nsfrip_t *rip, uint8_t *rom, uint16_t rom_len, vgm_meta_t *meta, char const *vgm)
 {
+    vgm_writer_t *w = malloc(sizeof(vgm_writer_t));
+    if (NULL == w)
+        return RIP2VGM_ERR_OUTOFMEMORY;
+    if (!vgm_open(w, vgm))
+    {
+        free(w);
+        return RIP2VGM_ERR_FILEIO;
+    }
+    vgm_encode(w, rip, rom, rom_len);
+    int r = vgm_close(w, meta) ? RIP2VGM_ERR_SUCCESS : RIP2VGM_ERR_FILEIO;
+    free(w);
+    return r;
+}
+
+
+// gzip compressed VGM. gzip streams can't seek back to patch the header, so the stream is
+// encoded twice: once without output to build the header, then through deflate.
+int nsfrip_export_vgz(nsfrip_t *rip, uint8_t *rom, uint16_t rom_len, vgm_meta_t *meta, char const *vgz, int level)
+{
+#ifdef NSF2VGM_HAVE_ZLIB
     int r = RIP2VGM_ERR_SUCCESS;
-    uint8_t *stream = NULL;
-    uint8_t *gd3 = NULL;
-    FILE *fd = NULL;
+    vgm_header_t header;
+    char mode[8];
+    vgm_writer_t *w = malloc(sizeof(vgm_writer_t));
+    if (NULL == w)
+        return RIP2VGM_ERR_OUTOFMEMORY;
     do
     {
-        unsigned int loop_pos_rel = 0;
-        unsigned int loop_samples = 0; 
-        unsigned long total_samples = 0;
-        unsigned long stream_len, stream_idx;
-        stream_len = rom_len + 9;   // NES APU RAM 0x67 0x66 0xc2 ss ss ss ss (ll ll rom)
-        // each record in rip is 4 bytes, maximum expand to 2 VGM commands, records_len * 8 should be enough
-        stream_len += rip->records_len * 8;
-        stream = malloc(stream_len);
-        if (NULL == stream)
-        {
-            r = RIP2VGM_ERR_OUTOFMEMORY;
-            break;
-        }
-        stream_idx = 0;
-        // save rom data
-        if (rom_len > 0)
-        {
-            stream[stream_idx] = 0x67; ++stream_idx;
-            stream[stream_idx] = 0x66; ++stream_idx;
-            stream[stream_idx] = 0xc2; ++stream_idx;
-            stream[stream_idx] = (rom_len + 2) & 0xff; ++stream_idx;
-            stream[stream_idx] = ((rom_len + 2) >> 8) & 0xff; ++stream_idx;
-            stream[stream_idx] = ((rom_len + 2) >> 16) & 0xff; ++stream_idx;
-            stream[stream_idx] = ((rom_len + 2) >> 24) & 0xff; ++stream_idx;
-            stream[stream_idx] = rip->rom_lo & 0xff; ++stream_idx;
-            stream[stream_idx] = (rip->rom_lo >> 8) & 0xff; ++stream_idx;
-            memcpy(stream + stream_idx, rom, rom_len); stream_idx += rom_len;
-        }
-        // save ripped data to stream
-        for (unsigned long i = 0; i < rip->records_len; ++i)
-        {
-            uint32_t wait = rip->records[i].wait_samples;
-            uint32_t reg = rip->records[i].reg_ops;
-            if (wait > 0)
-            {
-                total_samples += wait;
-                loop_samples += wait;
-                if (735 == wait)
-                {
-                    stream[stream_idx] = 0x62;  // 0x62 - wait 735 samples
-                    ++stream_idx;
-                }
-                else if (882 == wait)
-                {
-                    stream[stream_idx] = 0x63;  // 0x63 - wait 882 samples
-                    ++stream_idx;
-                }
-                else if ((wait >= 1) && (wait <= 16))
-                {
-                    stream[stream_idx] = 0x70 + wait - 1;   // 0x7n - wait n+1 samples
-                    ++stream_idx;
-                }
-                else
-                {
-                    stream[stream_idx] = 0x61;              // 0x61 nn nn - wait nnnn samples
-                    ++stream_idx;
-                    stream[stream_idx] = wait & 0xff;
-                    ++stream_idx;
-                    stream[stream_idx] = (wait >> 8) & 0xff;
-                    ++stream_idx;
-                }
-            }
-            if ((i != 0) &&  (i == rip->loop_start_idx))
-            {
-                loop_pos_rel = stream_idx;
-                loop_samples = 0;
-            }
-            if (reg > 0)
-            {
-                stream[stream_idx] = 0xb4;  // b4 aa dd
-                stream[stream_idx + 1] = (reg & 0x0000ff00) >> 8;
-                stream[stream_idx + 2] = reg & 0xff;
-                stream_idx += 3;
-            }
-        }
-        stream[stream_idx] = 0x66;   // eof of sound data
-        ++stream_idx;
-        // https://vgmrips.net/wiki/GD3_Specification
-        unsigned long gd3_len, gd3_idx;
-        gd3_len = 4 + 4 + 4;                                        //"Gd3 " + "00 01 00 00" + "ll ll ll ll"
-        gd3_len += find_gd3_string_storage(meta->track_name_en);    // Track name (Eng)
-        gd3_len += 2;                                               // Track name (Jap)
-        gd3_len += find_gd3_string_storage(meta->game_name_en);     // Game name (Eng)
-        gd3_len += 2;                                               // Game name (Jap)
-        gd3_len += find_gd3_string_storage(meta->system_name_en);   // System name (Eng)
-        gd3_len += 2;                                               // System name (Jap)
-        gd3_len += find_gd3_string_storage(meta->author_name_en);   // Author name (Eng)
-        gd3_len += 2;                                               // Author name (Jap)
-        gd3_len += find_gd3_string_storage(meta->release_date);     // Release date
-        gd3_len += find_gd3_string_storage(meta->creator_name);     // Creator
-        gd3_len += find_gd3_string_storage(meta->notes);            // Notes
-        gd3_len += 2;                                               // Final termination
-        gd3 = malloc(gd3_len);
-        if (NULL == gd3)
-        {
-            r = RIP2VGM_ERR_OUTOFMEMORY;
-            break;
-        }
-        gd3[0] = 0x47; gd3[1] = 0x64; gd3[2] = 0x33; gd3[3] = 0x20; // GD3 tag "Gd3 "
-        gd3[4] = 0x00; gd3[5] = 0x01; gd3[6] = 0x00; gd3[7] = 0x00; // Version 00 01 00 00
-        *(uint32_t *)(gd3 + 8) = (uint32_t)(gd3_len - 8);           // Length of the following data in bytes
-        gd3_idx = 12;
-        gd3_idx += encode_gd3_string(meta->track_name_en, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(NULL, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(meta->game_name_en, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(NULL, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(meta->system_name_en, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(NULL, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(meta->author_name_en, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(NULL, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(meta->release_date, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(meta->creator_name, gd3 + gd3_idx);
-        gd3_idx += encode_gd3_string(meta->notes, gd3 + gd3_idx);
-        gd3[gd3_idx] = 0;
-        gd3[gd3_idx + 1] = 0;
-        
-        // vgm header
-        vgm_header_t header;
-        memset(&header, 0, sizeof(vgm_header_t));
-        header.ident = 0x206d6756;
-        header.version = 0x00000171;
-        header.eof_offset = sizeof(vgm_header_t) + stream_idx + gd3_len - 4;
-        header.gd3_offset = sizeof(vgm_header_t) - 0x14 + stream_idx;
-        header.data_offset = sizeof(vgm_header_t) - 0x34;
-        header.total_samples = total_samples;
-        if (loop_pos_rel > 0)
-        {
-            header.loop_offset = sizeof(vgm_header_t) + loop_pos_rel - 0x1c;
-            header.loop_samples = loop_samples; 
-        }
-        else
-        {
-            header.loop_offset = 0;
-            header.loop_samples = 0; 
-        }
-        header.nes_apu_clk = 1789773;
-        fd = fopen(vgm, "wb");
-        if (NULL == fd)
+        memset(w, 0, sizeof(vgm_writer_t));
+        vgm_encode(w, rip, rom, rom_len);
+        vgm_finish(w, meta, &header);
+        memset(w, 0, sizeof(vgm_writer_t));
+        if ((level < 1) || (level > 9))
+            level = Z_DEFAULT_COMPRESSION;
+        snprintf(mode, sizeof(mode), (Z_DEFAULT_COMPRESSION == level) ? "wb" : "wb%d", level);
+        w->gz = gzopen(vgz, mode);
+        if (NULL == w->gz)
         {
             r = RIP2VGM_ERR_FILEIO;
             break;
         }
-        fwrite(&header, sizeof(vgm_header_t), 1, fd);
-        fwrite(stream, stream_idx, 1, fd);
-        fwrite(gd3, gd3_len, 1, fd );
-        fclose(fd);
-        fd = NULL;
+        if (gzwrite(w->gz, &header, sizeof(vgm_header_t)) != (int)sizeof(vgm_header_t))
+            w->error = true;
+        vgm_encode(w, rip, rom, rom_len);
+        vgm_finish(w, meta, &header);
+        if (gzclose(w->gz) != Z_OK)
+            w->error = true;
+        if (w->error)
+            r = RIP2VGM_ERR_FILEIO;
     } while (0);
-    if (fd) fclose(fd);
-    if (gd3) free(gd3);
-    if (stream) free(stream);
+    free(w);
     return r;
+#else
+    (void)rip; (void)rom; (void)rom_len; (void)meta; (void)vgz; (void)level;
+    return RIP2VGM_ERR_UNSUPPORTED;
+#endif
 }